@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16 // Allocations start at multiples of it, which suits any type
+#define ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+/**
+ * @brief Block of memory that allocations are taken from, one after the other
+*/
+typedef struct block {
+
+    struct block * next; // Block taken after this one filled up, NULL for the last one
+    size_t size; // Bytes after the header
+    size_t used;
+
+} BLOCK;
+
+/**
+ * @brief Memory whose allocations are all released at once. Its first block is allocated with it and
+ * kept when it's reset, the blocks it took once that one filled up are freed then, so an arena that is
+ * reused holds the same memory between uses
+*/
+struct arena {
+
+    BLOCK * first;
+    BLOCK * last; // Block where allocations are taken from
+    size_t total; // Bytes of all its blocks
+
+};
+
+/**
+ * @brief Gets the memory of a block, after its header
+*/
+static char * block_data(BLOCK * b) {
+
+    return (char *) b + ROUND(sizeof(BLOCK));
+
+}
+
+/**
+ * @brief Creates an arena
+ * @param size Bytes of its first block, and of the least the others take
+ * @return The arena, NULL on error
+*/
+ARENA arena_new(size_t size) {
+
+    ARENA a = malloc(ROUND(sizeof(struct arena)) + ROUND(sizeof(BLOCK)) + size);
+    if (!a) return NULL;
+
+    a->first = a->last = (BLOCK *) ((char *) a + ROUND(sizeof(struct arena)));
+    a->first->next = NULL;
+    a->first->size = size;
+    a->first->used = 0;
+    a->total = size;
+
+    return a;
+
+}
+
+/**
+ * @brief Allocates memory that lasts until the arena is reset or freed
+ * @param a Arena
+ * @param size Bytes
+ * @return The memory, NULL on error
+*/
+void * arena_alloc(ARENA a, size_t size) {
+
+    // Whatever is allocated next stays aligned
+    size = ROUND(size);
+
+    if (a->last->size - a->last->used < size) {
+        size_t block = size > a->first->size ? size : a->first->size;
+        BLOCK * b = malloc(ROUND(sizeof(BLOCK)) + block);
+        if (!b) return NULL;
+        b->next = NULL;
+        b->size = block;
+        b->used = 0;
+        a->last->next = b;
+        a->last = b;
+        a->total += block;
+    }
+
+    void * p = block_data(a->last) + a->last->used;
+    a->last->used += size;
+
+    return p;
+
+}
+
+/**
+ * @brief Copies a string to an arena
+ * @param a Arena
+ * @param s String
+ * @return The copy, NULL on error
+*/
+char * arena_strdup(ARENA a, const char * s) {
+
+    size_t length = strlen(s) + 1;
+    char * copy = arena_alloc(a, length);
+    if (copy) memcpy(copy, s, length);
+
+    return copy;
+
+}
+
+/**
+ * @brief Gets the bytes an arena holds
+*/
+size_t arena_size(ARENA a) {
+
+    return a->total;
+
+}
+
+/**
+ * @brief Releases everything allocated from an arena, which keeps only its first block
+ * @param a Arena
+*/
+void arena_reset(ARENA a) {
+
+    for (BLOCK * b = a->first->next, * next; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+
+    a->first->next = NULL;
+    a->first->used = 0;
+    a->last = a->first;
+    a->total = a->first->size;
+
+}
+
+/**
+ * @brief Frees an arena and everything allocated from it
+ * @param a Arena
+*/
+void arena_free(ARENA a) {
+
+    arena_reset(a);
+    free(a);
+
+}
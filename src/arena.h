@@ -0,0 +1,20 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena * ARENA;
+
+ARENA arena_new(size_t size);
+
+void * arena_alloc(ARENA a, size_t size);
+
+char * arena_strdup(ARENA a, const char * s);
+
+size_t arena_size(ARENA a);
+
+void arena_reset(ARENA a);
+
+void arena_free(ARENA a);
+
+#endif
@@ -0,0 +1,720 @@
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libaurras.h"
+
+#define MAX 1024
+#define MAX_CHAIN 32 // Filters of a chain of the mix
+#define MAX_MIX 64 // Chains of the mix
+#define MAX_SAMPLES 256 // Sources the jobs are drawn from
+#define MAX_OUTSTANDING 4096 // Jobs an open-loop client has in flight before it stops submitting
+#define MAX_RECORDS 64 // Records taken at once
+#define MAX_ARGS 256 // Arguments and environment variables of the server kept for its restart
+#define POLL_INTERVAL 0.005 // Seconds between looks at a server that is restarting
+#define MAX_PROC_LIST 65536 // Bytes read of the arguments or the environment of the server
+
+/**
+ * @brief Chain of the mix and how often it's drawn
+*/
+typedef struct mix_chain {
+
+    char * filters[MAX_CHAIN];
+    int n_filters;
+    int weight;
+
+} MIX_CHAIN;
+
+/**
+ * @brief Options of the benchmark
+*/
+typedef struct bench {
+
+    char * socket_path; // Socket of the server, NULL for the default one
+    int clients; // Processes with a connection each
+    int jobs; // Jobs over all clients
+    double duration; // Seconds after which no more jobs are submitted, 0 for no limit
+    double rate; // Jobs per second over all clients in open loop, 0 for closed loop
+    int depth; // Jobs each client has in flight in closed loop
+    unsigned int seed;
+    MIX_CHAIN mix[MAX_MIX];
+    int n_mix;
+    int total_weight;
+    char * samples[MAX_SAMPLES];
+    int n_samples;
+    char * output; // File with the results, for machines
+    double crash; // Seconds after which the server is killed and started again, 0 for no crash
+    long max_growth; // Kilobytes the memory of the server may grow by over the run before it fails, -1 for no limit
+
+} BENCH;
+
+/**
+ * @brief How a job ended, sent by the clients to the parent through a pipe
+*/
+typedef struct result {
+
+    double latency; // Seconds since it was submitted until its last record, -1 if it couldn't be submitted
+    double queued;
+    double running;
+    double cpu;
+    int state; // AURRAS_STATE
+
+} RESULT;
+
+/**
+ * @brief How the server came back from the crash, sent by the crasher to the parent through a pipe
+*/
+typedef struct recovery {
+
+    double restart; // Seconds since the server was killed until the new one answered
+    double replay; // Seconds the new one took to rebuild its queue from the journal
+    int replayed; // Jobs it rebuilt
+    int resumed; // Segments of them that didn't run again
+    int redone; // Segments or jobs that did
+    double drained; // Seconds since it was killed until the new one was idle, -1 if it never answered
+
+} RECOVERY;
+
+/**
+ * @brief Memory the server holds, before the jobs and once they all ended
+*/
+typedef struct footprint {
+
+    long rss; // Kilobytes resident
+    double heap; // Bytes allocated
+    int requests; // Requests in memory
+    int pooled; // Requests kept to be reused
+
+} FOOTPRINT;
+
+/**
+ * @brief Gets the current time
+ * @return Seconds, in CLOCK_MONOTONIC
+*/
+double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/**
+ * @brief Parses a mix of chains: chains separated by ',', filters by spaces, each chain with an optional
+ * ":weight", like "alto eco:3,rapido"
+ * @param b Benchmark
+ * @param mix Mix, changed by the parsing
+*/
+void parse_mix(BENCH * b, char * mix) {
+
+    char * save_chain, * save;
+    for (char * chain = strtok_r(mix, ",", &save_chain); chain && b->n_mix < MAX_MIX; chain = strtok_r(NULL, ",", &save_chain)) {
+
+        MIX_CHAIN * c = &b->mix[b->n_mix];
+        char * weight = strchr(chain, ':');
+        if (weight) *weight++ = '\0';
+        c->weight = weight ? atoi(weight) : 1;
+        c->n_filters = 0;
+        for (char * filter = strtok_r(chain, " ", &save); filter && c->n_filters < MAX_CHAIN; filter = strtok_r(NULL, " ", &save))
+            c->filters[c->n_filters++] = strdup(filter);
+        if (c->n_filters && c->weight > 0) b->n_mix++;
+
+    }
+
+}
+
+/**
+ * @brief Builds the default mix from the filters the server is configured with: each filter alone,
+ * and each filter followed by the next one
+ * @param b Benchmark
+ * @return 0 on success, -1 if the server can't be reached
+*/
+int default_mix(BENCH * b) {
+
+    AURRAS a = aurras_open(b->socket_path);
+    STATUS * status = malloc(sizeof(STATUS));
+    if (!a || aurras_snapshot(a, status) < 0) {
+        free(status);
+        if (a) aurras_close(a);
+        return -1;
+    }
+
+    for (int i = 0; i < status->n_filters && b->n_mix < MAX_MIX; i++) {
+        b->mix[b->n_mix].filters[0] = strdup(status->filters[i].name);
+        b->mix[b->n_mix].n_filters = 1;
+        b->mix[b->n_mix++].weight = 1;
+    }
+    for (int i = 0; i + 1 < status->n_filters && b->n_mix < MAX_MIX; i++) {
+        b->mix[b->n_mix].filters[0] = strdup(status->filters[i].name);
+        b->mix[b->n_mix].filters[1] = strdup(status->filters[i + 1].name);
+        b->mix[b->n_mix].n_filters = 2;
+        b->mix[b->n_mix++].weight = 1;
+    }
+
+    free(status);
+    aurras_close(a);
+    return 0;
+
+}
+
+/**
+ * @brief Lists the regular files of a directory as the sources of the jobs
+ * @param b Benchmark
+ * @param directory Directory
+*/
+void find_samples(BENCH * b, char * directory) {
+
+    DIR * dir = opendir(directory);
+    if (!dir) {
+        perror(directory);
+        exit(1);
+    }
+
+    struct dirent * entry;
+    while ((entry = readdir(dir)) && b->n_samples < MAX_SAMPLES) {
+
+        char path[MAX];
+        struct stat st;
+        snprintf(path, MAX, "%s/%s", directory, entry->d_name);
+        if (entry->d_name[0] != '.' && stat(path, &st) == 0 && S_ISREG(st.st_mode)) b->samples[b->n_samples++] = strdup(path);
+
+    }
+    closedir(dir);
+
+    if (!b->n_samples) {
+        fprintf(stderr, "%s: no samples\n", directory);
+        exit(1);
+    }
+
+}
+
+/**
+ * @brief Submits a job with a chain drawn from the mix over a random sample. The output goes to /dev/null,
+ * which the server doesn't cache, so every job runs. With a crash, the job is sent by name so the server
+ * journals it
+ * @param b Benchmark
+ * @param a Connection
+ * @param fd_null Descriptor of /dev/null
+ * @param seed State of the random numbers of the client
+ * @return Id of the job, -1 on error
+*/
+int submit_job(BENCH * b, AURRAS a, int fd_null, unsigned int * seed) {
+
+    int pick = rand_r(seed) % b->total_weight, i = 0;
+    while (pick >= b->mix[i].weight) pick -= b->mix[i++].weight;
+    MIX_CHAIN * c = &b->mix[i];
+    char * sample = b->samples[rand_r(seed) % b->n_samples];
+    if (b->crash > 0) return aurras_submit(a, sample, "/dev/null", c->filters, c->n_filters, 0, NULL);
+
+    int fds[2] = { open(sample, O_RDONLY | O_CLOEXEC), fd_null };
+    if (fds[0] < 0) {
+        perror(sample);
+        return -1;
+    }
+    int job = aurras_submit(a, sample, "/dev/null", c->filters, c->n_filters, 0, fds);
+    close(fds[0]);
+
+    return job;
+
+}
+
+/**
+ * @brief Runs a client: submits its share of the jobs, in closed loop keeping depth of them in flight, or in
+ * open loop at its share of the rate whatever the server does, and sends how each one ended to the parent
+ * @param b Benchmark
+ * @param index Index of the client
+ * @param fd_results Write end of the pipe to the parent
+*/
+void run_client(BENCH * b, int index, int fd_results) {
+
+    int share = b->jobs / b->clients + (index < b->jobs % b->clients);
+    unsigned int seed = b->seed + index;
+    AURRAS a = aurras_open(b->socket_path);
+    int fd_null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (!a || fd_null < 0) {
+        perror("connect");
+        _exit(1);
+    }
+
+    // Ids are given in order from 0, so each one is the index of its submission time
+    double * submitted = malloc((share + 1) * sizeof(double));
+    int sent = 0, ended = 0;
+    double start = now(), next = start, interval = b->rate > 0 ? b->clients / b->rate : 0;
+
+    while (1) {
+
+        double t = now();
+        int submitting = sent < share && !(b->duration > 0 && t - start >= b->duration);
+
+        // In open loop, jobs are due at fixed times, late ones are submitted right away
+        while (submitting && sent - ended < (b->rate > 0 ? MAX_OUTSTANDING : b->depth) && (b->rate <= 0 || t >= next)) {
+            submitted[sent] = now();
+            if (submit_job(b, a, fd_null, &seed) < 0) {
+                RESULT result = { -1, 0, 0, 0, AURRAS_FAILED };
+                write(fd_results, &result, sizeof(result));
+                share = sent;
+                submitting = 0;
+                break;
+            }
+            sent++;
+            next += interval;
+            submitting = sent < share;
+        }
+        if (!submitting && ended == sent) break;
+
+        int timeout = -1;
+        if (submitting && b->rate > 0) timeout = next > t ? (int) ((next - t) * 1e3) + 1 : 0;
+        struct pollfd p = { aurras_fd(a), POLLIN, 0 };
+        if (poll(&p, 1, timeout) < 0 && errno != EINTR) break;
+
+        AURRAS_RECORD records[MAX_RECORDS];
+        int n = aurras_records(a, records, MAX_RECORDS);
+        if (n < 0) break;
+        for (int i = 0; i < n; i++) {
+            if (records[i].state == AURRAS_PROCESSING || records[i].job >= sent) continue;
+            RESULT result = { now() - submitted[records[i].job], records[i].queued, records[i].running, records[i].cpu, records[i].state };
+            write(fd_results, &result, sizeof(result));
+            ended++;
+        }
+
+    }
+
+    // Jobs without an end never got one from the server
+    for (; ended < sent; ended++) {
+        RESULT result = { -1, 0, 0, 0, AURRAS_FAILED };
+        write(fd_results, &result, sizeof(result));
+    }
+
+    free(submitted);
+    close(fd_null);
+    aurras_close(a);
+    _exit(0);
+
+}
+
+/**
+ * @brief Reads a list of strings ended by '\0' from a file of /proc, like the arguments of a process
+ * @param path Path to the file
+ * @param list Where to place the strings, ended by NULL
+ * @param max Size of the list
+ * @return 0 on success, -1 on error
+*/
+int read_proc_list(char * path, char * list[], int max) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    char * buffer = malloc(MAX_PROC_LIST + 1);
+    int used = 0, n;
+    while (used < MAX_PROC_LIST && (n = read(fd, buffer + used, MAX_PROC_LIST - used)) > 0) used += n;
+    buffer[used] = '\0';
+    close(fd);
+
+    n = 0;
+    for (int i = 0; i < used && n < max - 1; i += strlen(buffer + i) + 1) list[n++] = buffer + i;
+    list[n] = NULL;
+
+    return n ? 0 : -1;
+
+}
+
+/**
+ * @brief Kills the server once the jobs ran for a while, starts it again as it was started, with its
+ * directory, arguments, environment and streams, then waits until it answers and until its queue
+ * is empty, and sends how long that took to the parent
+ * @param b Benchmark
+ * @param fd_report Write end of the pipe to the parent
+*/
+void run_crasher(BENCH * b, int fd_report) {
+
+    RECOVERY recovery = { -1, 0, 0, 0, 0, -1 };
+    usleep(b->crash * 1e6);
+
+    AURRAS a = aurras_open(b->socket_path);
+    STATUS * status = malloc(sizeof(STATUS));
+    if (!a || aurras_snapshot(a, status) < 0) {
+        perror("crash");
+        write(fd_report, &recovery, sizeof(recovery));
+        _exit(1);
+    }
+    aurras_close(a);
+
+    // Everything the restart needs is read before the kill
+    pid_t pid = status->pid;
+    char path[MAX], exe[MAX], cwd[MAX];
+    char * args[MAX_ARGS], * env[MAX_ARGS];
+    int fd_out, fd_err;
+    snprintf(path, MAX, "/proc/%d/exe", pid);
+    ssize_t n = readlink(path, exe, MAX - 1);
+    exe[n > 0 ? n : 0] = '\0';
+    snprintf(path, MAX, "/proc/%d/cwd", pid);
+    n = readlink(path, cwd, MAX - 1);
+    cwd[n > 0 ? n : 0] = '\0';
+    snprintf(path, MAX, "/proc/%d/cmdline", pid);
+    int valid = read_proc_list(path, args, MAX_ARGS) == 0;
+    snprintf(path, MAX, "/proc/%d/environ", pid);
+    if (read_proc_list(path, env, MAX_ARGS) < 0) env[0] = NULL;
+    snprintf(path, MAX, "/proc/%d/fd/1", pid);
+    fd_out = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    snprintf(path, MAX, "/proc/%d/fd/2", pid);
+    fd_err = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (!valid || !*exe || !*cwd) {
+        fprintf(stderr, "crash: can't read how the server %d was started\n", pid);
+        write(fd_report, &recovery, sizeof(recovery));
+        _exit(1);
+    }
+
+    double killed = now();
+    kill(pid, SIGKILL);
+
+    // The new server doesn't belong to the benchmark, so it outlives it
+    pid_t server = fork();
+    if (server == 0) {
+        setsid();
+        if (chdir(cwd) < 0) _exit(127);
+        if (fd_out >= 0) dup2(fd_out, STDOUT_FILENO);
+        if (fd_err >= 0) dup2(fd_err, STDERR_FILENO);
+        execve(exe, args, env);
+        _exit(127);
+    }
+    if (fd_out >= 0) close(fd_out);
+    if (fd_err >= 0) close(fd_err);
+
+    // It's ready once it published a status with its own pid, the old socket and status may still be there until then
+    a = NULL;
+    while (server > 0 && now() - killed < 60) {
+        if ((a = aurras_open(b->socket_path)) && aurras_snapshot(a, status) == 0 && status->pid == server && status->updated > 0)
+            break;
+        if (a) aurras_close(a);
+        a = NULL;
+        usleep(POLL_INTERVAL * 1e6);
+    }
+    if (a) {
+        recovery.restart = now() - killed;
+        while (aurras_snapshot(a, status) == 0 && status->n_running + status->n_waiting) usleep(POLL_INTERVAL * 1e6);
+        recovery.drained = now() - killed;
+        recovery.replay = status->replay_seconds;
+        recovery.replayed = status->replayed;
+        recovery.resumed = status->resumed;
+        recovery.redone = status->redone;
+        aurras_close(a);
+    }
+
+    write(fd_report, &recovery, sizeof(recovery));
+    free(status);
+    _exit(0);
+
+}
+
+/**
+ * @brief Measures the memory the server holds, after it has no more tasks
+ * @param b Benchmark
+ * @param f Where the measures are written
+ * @return 0 on success, -1 if the server didn't answer
+*/
+int measure_footprint(BENCH * b, FOOTPRINT * f) {
+
+    AURRAS a = aurras_open(b->socket_path);
+    STATUS * status = malloc(sizeof(STATUS));
+    int valid = a && aurras_snapshot(a, status) == 0;
+    while (valid && status->n_running + status->n_waiting) {
+        usleep(POLL_INTERVAL * 1e6);
+        valid = aurras_snapshot(a, status) == 0;
+    }
+    if (a) aurras_close(a);
+
+    f->rss = -1;
+    f->heap = valid ? status->heap : -1;
+    f->requests = valid ? status->n_requests : -1;
+    f->pooled = valid ? status->n_pooled : -1;
+
+    char path[MAX], line[MAX];
+    snprintf(path, MAX, "/proc/%d/status", valid ? status->pid : 0);
+    FILE * proc = valid ? fopen(path, "r") : NULL;
+    while (proc && fgets(line, MAX, proc)) sscanf(line, "VmRSS: %ld", &f->rss);
+    if (proc) fclose(proc);
+
+    free(status);
+    return valid ? 0 : -1;
+
+}
+
+/**
+ * @brief Orders values from the lowest to the highest
+*/
+int compare_doubles(const void * a, const void * b) {
+
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+
+}
+
+/**
+ * @brief Gets a percentile of sorted values
+ * @param values Sorted values
+ * @param n Number of values
+ * @param p Percentile, from 0 to 100
+ * @return Value, 0 without values
+*/
+double percentile(double * values, int n, double p) {
+
+    if (!n) return 0;
+    int i = (int) (p / 100 * n + 0.999999) - 1;
+    return values[i < 0 ? 0 : i >= n ? n - 1 : i];
+
+}
+
+/**
+ * @brief Writes how a series of values is distributed, in milliseconds, as "name_p50_ms value" lines
+ * @param f Stream
+ * @param name Name of the series
+ * @param values Values in seconds, sorted by the function
+ * @param n Number of values
+*/
+void write_series(FILE * f, char * name, double * values, int n) {
+
+    qsort(values, n, sizeof(double), compare_doubles);
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += values[i];
+
+    fprintf(f, "%s_mean_ms %.3f\n", name, n ? 1e3 * sum / n : 0);
+    fprintf(f, "%s_p50_ms %.3f\n", name, 1e3 * percentile(values, n, 50));
+    fprintf(f, "%s_p95_ms %.3f\n", name, 1e3 * percentile(values, n, 95));
+    fprintf(f, "%s_p99_ms %.3f\n", name, 1e3 * percentile(values, n, 99));
+    fprintf(f, "%s_max_ms %.3f\n", name, n ? 1e3 * values[n - 1] : 0);
+
+}
+
+/**
+ * @brief Writes the results of the benchmark, one "key value" line each
+ * @param f Stream
+ * @param b Benchmark
+ * @param results How each job ended
+ * @param n Number of results
+ * @param wall Seconds since the clients started until the last job ended
+ * @param recovery How the server came back from the crash, NULL without one
+ * @param before Memory of the server before the jobs, NULL if it wasn't measured
+ * @param after Memory of the server once they ended, NULL if it wasn't measured
+*/
+void write_results(FILE * f, BENCH * b, RESULT * results, int n, double wall, RECOVERY * recovery,
+                   FOOTPRINT * before, FOOTPRINT * after) {
+
+    double * latency = malloc((n + 1) * sizeof(double)), * queued = malloc((n + 1) * sizeof(double));
+    double * cpu = malloc((n + 1) * sizeof(double));
+    int done = 0, failed = 0;
+    for (int i = 0; i < n; i++) {
+        if (results[i].state != AURRAS_DONE) {
+            failed++;
+            continue;
+        }
+        latency[done] = results[i].latency;
+        queued[done] = results[i].queued;
+        cpu[done++] = results[i].cpu;
+    }
+
+    char * revision = getenv("AURRAS_REVISION");
+    fprintf(f, "revision %s\n", revision && *revision ? revision : "unknown");
+    fprintf(f, "mode %s\n", b->rate > 0 ? "open" : "closed");
+    fprintf(f, "clients %d\n", b->clients);
+    if (b->rate > 0) fprintf(f, "rate_jobs_per_second %.3f\n", b->rate);
+    else fprintf(f, "depth %d\n", b->depth);
+    fprintf(f, "mix ");
+    for (int i = 0; i < b->n_mix; i++) {
+        for (int j = 0; j < b->mix[i].n_filters; j++) fprintf(f, "%s%s", j ? "+" : "", b->mix[i].filters[j]);
+        fprintf(f, ":%d%s", b->mix[i].weight, i < b->n_mix - 1 ? "," : "\n");
+    }
+    fprintf(f, "samples %d\n", b->n_samples);
+    fprintf(f, "jobs %d\n", n);
+    fprintf(f, "done %d\n", done);
+    fprintf(f, "failed %d\n", failed);
+    fprintf(f, "wall_seconds %.3f\n", wall);
+    fprintf(f, "throughput_jobs_per_second %.3f\n", wall > 0 ? done / wall : 0);
+    write_series(f, "latency", latency, done);
+    write_series(f, "queue", queued, done);
+    write_series(f, "cpu", cpu, done);
+    if (recovery) {
+        fprintf(f, "crash_after_seconds %.3f\n", b->crash);
+        fprintf(f, "restart_ms %.3f\n", 1e3 * recovery->restart);
+        fprintf(f, "replay_ms %.3f\n", 1e3 * recovery->replay);
+        fprintf(f, "replayed_jobs %d\n", recovery->replayed);
+        fprintf(f, "resumed_segments %d\n", recovery->resumed);
+        fprintf(f, "redone_runs %d\n", recovery->redone);
+        fprintf(f, "drained_seconds %.3f\n", recovery->drained);
+    }
+    if (before && after) {
+        fprintf(f, "server_rss_kb_before %ld\n", before->rss);
+        fprintf(f, "server_rss_kb_after %ld\n", after->rss);
+        fprintf(f, "server_heap_kb_before %.0f\n", before->heap / 1024);
+        fprintf(f, "server_heap_kb_after %.0f\n", after->heap / 1024);
+        fprintf(f, "server_requests_after %d\n", after->requests);
+        fprintf(f, "server_pooled_after %d\n", after->pooled);
+    }
+
+    free(latency);
+    free(queued);
+    free(cpu);
+
+}
+
+/**
+ * @brief Shows how to use the benchmark
+ * @param name Name of the program
+*/
+void usage(char * name) {
+
+    fprintf(stderr, "%s [--clients N] [--jobs N] [--duration seconds] [--rate jobs-per-second | --depth N]\n"
+                    "    [--mix \"filter filter:weight,...\"] [--seed N] [--samples directory] [--socket path] [--output file]\n"
+                    "    [--crash seconds] [--max-growth kilobytes]\n"
+                    "(closed loop by default, open loop with --rate; the mix defaults to the filters of the server;\n"
+                    " --crash kills the server after that long, starts it again and measures how it recovers;\n"
+                    " --max-growth fails the run if the resident or allocated memory of the server grew by more)\n", name);
+    exit(1);
+
+}
+
+/**
+ * @brief Drives a running server with concurrent clients and measures throughput and latency
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @return Status
+*/
+int main(int argc, char * argv[]) {
+
+    BENCH b = { .socket_path = NULL, .clients = 4, .jobs = 100, .duration = 0, .rate = 0, .depth = 1, .seed = 1,
+                .output = "bench_output.txt", .crash = 0, .max_growth = -1 };
+    char * samples = "samples";
+
+    struct option options[] = {
+        { "clients", required_argument, NULL, 'c' }, { "jobs", required_argument, NULL, 'n' },
+        { "duration", required_argument, NULL, 'd' }, { "rate", required_argument, NULL, 'r' },
+        { "depth", required_argument, NULL, 'D' }, { "mix", required_argument, NULL, 'm' },
+        { "seed", required_argument, NULL, 's' }, { "samples", required_argument, NULL, 'S' },
+        { "socket", required_argument, NULL, 'k' }, { "output", required_argument, NULL, 'o' },
+        { "crash", required_argument, NULL, 'x' }, { "max-growth", required_argument, NULL, 'g' },
+        { NULL, 0, NULL, 0 }
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "c:n:d:r:D:m:s:S:k:o:x:g:", options, NULL)) != -1) {
+        switch (option) {
+            case 'c': b.clients = atoi(optarg); break;
+            case 'n': b.jobs = atoi(optarg); break;
+            case 'd': b.duration = atof(optarg); break;
+            case 'r': b.rate = atof(optarg); break;
+            case 'D': b.depth = atoi(optarg); break;
+            case 'm': parse_mix(&b, optarg); break;
+            case 's': b.seed = strtoul(optarg, NULL, 10); break;
+            case 'S': samples = optarg; break;
+            case 'k': b.socket_path = optarg; break;
+            case 'o': b.output = optarg; break;
+            case 'x': b.crash = atof(optarg); break;
+            case 'g': b.max_growth = atol(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || b.clients < 1 || b.jobs < 1 || b.depth < 1) usage(argv[0]);
+
+    find_samples(&b, samples);
+    if (!b.n_mix && default_mix(&b) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    for (int i = 0; i < b.n_mix; i++) b.total_weight += b.mix[i].weight;
+    if (!b.total_weight) usage(argv[0]);
+
+    // Each client is a process of its own, as the server shares its filters fairly between processes
+    int fd_results[2];
+    if (pipe2(fd_results, O_CLOEXEC) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    FOOTPRINT before, after;
+    int measured = measure_footprint(&b, &before) == 0;
+    double start = now();
+    for (int i = 0; i < b.clients; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd_results[0]);
+            run_client(&b, i, fd_results[1]);
+        }
+        else if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+    }
+
+    // The crasher only writes its own report
+    int fd_report[2] = { -1, -1 };
+    if (b.crash > 0) {
+        if (pipe2(fd_report, O_CLOEXEC) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd_results[0]);
+            close(fd_results[1]);
+            close(fd_report[0]);
+            run_crasher(&b, fd_report[1]);
+        }
+        else if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        close(fd_report[1]);
+    }
+    close(fd_results[1]);
+
+    // Results are small enough to be written whole, so they never mix
+    RESULT * results = malloc(b.jobs * sizeof(RESULT));
+    int n = 0;
+    double last = start;
+    while (n < b.jobs && read(fd_results[0], &results[n], sizeof(RESULT)) == sizeof(RESULT)) {
+        n++;
+        last = now();
+    }
+    close(fd_results[0]);
+    RECOVERY recovery;
+    int recovered = fd_report[0] >= 0 && read(fd_report[0], &recovery, sizeof(recovery)) == sizeof(recovery);
+    if (fd_report[0] >= 0) close(fd_report[0]);
+    while (wait(NULL) > 0);
+    measured = measured && measure_footprint(&b, &after) == 0;
+
+    write_results(stdout, &b, results, n, last - start, recovered ? &recovery : NULL,
+                  measured ? &before : NULL, measured ? &after : NULL);
+    FILE * f = fopen(b.output, "w");
+    if (!f) {
+        perror(b.output);
+        exit(1);
+    }
+    write_results(f, &b, results, n, last - start, recovered ? &recovery : NULL,
+                  measured ? &before : NULL, measured ? &after : NULL);
+    fclose(f);
+
+    // Over a soak, memory that grows with the jobs is memory the server keeps for each of them
+    int grew = 0;
+    if (b.max_growth >= 0 && !measured) {
+        fprintf(stderr, "max-growth: the memory of the server couldn't be measured\n");
+        grew = 1;
+    }
+    else if (b.max_growth >= 0 && (after.rss - before.rss > b.max_growth || (after.heap - before.heap) / 1024 > b.max_growth)) {
+        fprintf(stderr, "max-growth: the server grew by %ld kB resident and %.0f kB allocated, over %ld kB\n",
+                after.rss - before.rss, (after.heap - before.heap) / 1024, b.max_growth);
+        grew = 1;
+    }
+
+    free(results);
+    return grew;
+
+}
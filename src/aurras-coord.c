@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+#include "status.h"
+
+#define MAX 1024
+#define MAX_EVENTS 64 // Events handled in each iteration of the loop
+#define REFRESH_INTERVAL 100 // Milliseconds between updates of the aggregated status
+
+/**
+ * @brief Instance of the server registered with the coordinator, or a client that only looks at the status
+*/
+typedef struct instances {
+
+    int fd;
+    char * socket_path; // Socket of the instance, NULL until it registers
+    char * name; // Last part of the socket, shown with its tasks
+    STATUS * status; // Segment the instance publishes its status in, NULL if it can't be mapped
+    CAPACITY capacity; // What it can take, as it last told
+    CAPACITY_FILTER filters[STATUS_MAX_FILTERS];
+    char buffer[sizeof(MESSAGE_HEADER) + PROTOCOL_MAX_PAYLOAD]; // Bytes that don't make a whole message yet
+    size_t used;
+    struct instances * next;
+
+} *INSTANCE;
+
+/**
+ * @brief Frees an instance whose connection ended
+ * @param i Instance
+*/
+void free_instance(INSTANCE i) {
+
+    close(i->fd);
+    if (i->status) status_unmap(i->status);
+    free(i->socket_path);
+    free(i);
+
+}
+
+/**
+ * @brief Accepts every instance or client waiting to connect
+ * @param fd_listen Listening socket
+ * @param epoll_fd Epoll instance where the connections are watched
+ * @param instances Pointer to the struct with the instances
+*/
+void accept_instances(int fd_listen, int epoll_fd, INSTANCE * instances) {
+
+    int fd;
+    while ((fd = accept4(fd_listen, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+
+        INSTANCE i = calloc(1, sizeof(struct instances));
+        i->fd = fd;
+        i->next = *instances;
+        *instances = i;
+
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        struct epoll_event event = { .events = EPOLLIN };
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    }
+
+}
+
+/**
+ * @brief Handles one message of an instance
+ * @param i Instance
+ * @param header Header of the message
+ * @param payload Payload of the message
+ * @param status Aggregated status, the reply to a MESSAGE_STATUS
+ * @return 0 on success, -1 if the message is invalid
+*/
+int handle_message(INSTANCE i, MESSAGE_HEADER * header, char * payload, STATUS * status) {
+
+    switch (header->type) {
+
+        // Clients of the library send their directory first, which isn't needed here
+        case MESSAGE_DIRECTORY:
+            return 0;
+
+        case MESSAGE_REGISTER: {
+            if (!header->length || payload[header->length - 1] || i->socket_path) return -1;
+            i->socket_path = strdup(payload);
+            char * slash = strrchr(i->socket_path, '/');
+            i->name = slash ? slash + 1 : i->socket_path;
+
+            char path[MAX];
+            snprintf(path, MAX, "%s" STATUS_SUFFIX, i->socket_path);
+            if (!(i->status = status_map(path))) perror(path);
+            fprintf(stderr, "Instance %s registered\n", i->socket_path);
+            return 0;
+        }
+
+        case MESSAGE_CAPACITY: {
+            CAPACITY capacity;
+            if (!i->socket_path || header->length < sizeof(capacity)) return -1;
+            memcpy(&capacity, payload, sizeof(capacity));
+            if (capacity.n_filters < 0 || capacity.n_filters > STATUS_MAX_FILTERS ||
+                header->length != sizeof(capacity) + capacity.n_filters * sizeof(CAPACITY_FILTER))
+                return -1;
+            i->capacity = capacity;
+            memcpy(i->filters, payload + sizeof(capacity), capacity.n_filters * sizeof(CAPACITY_FILTER));
+            return 0;
+        }
+
+        case MESSAGE_STATUS: {
+            char * text = malloc(PROTOCOL_MAX_PAYLOAD);
+            int length = status_format(status, text, PROTOCOL_MAX_PAYLOAD);
+            send_message(i->fd, MESSAGE_STATUS_REPLY, header->tag, 0, text, length, NULL, 0);
+            free(text);
+            return 0;
+        }
+
+    }
+
+    return -1;
+
+}
+
+/**
+ * @brief Reads what an instance sent and handles every whole message in it. An instance whose connection
+ * ends, or that breaks the protocol, is forgotten
+ * @param fd Connection of the instance
+ * @param epoll_fd Epoll instance where the connections are watched
+ * @param instances Pointer to the struct with the instances
+ * @param status Aggregated status
+*/
+void read_instance(int fd, int epoll_fd, INSTANCE * instances, STATUS * status) {
+
+    INSTANCE * tmp = instances;
+    while (*tmp && (*tmp)->fd != fd) tmp = &(*tmp)->next;
+    if (!*tmp) return;
+    INSTANCE i = *tmp;
+
+    ssize_t bytes_read = 0, size = 0;
+    int valid = 1;
+    while (valid) {
+
+        // Descriptors aren't expected, the ones that come are closed
+        int fds[PROTOCOL_MAX_FDS], n_fds = 0;
+        bytes_read = receive_bytes(fd, i->buffer + i->used, sizeof(i->buffer) - i->used, fds, &n_fds, PROTOCOL_MAX_FDS, MSG_DONTWAIT);
+        for (int j = 0; j < n_fds; j++) close(fds[j]);
+        if (bytes_read <= 0) break;
+        i->used += bytes_read;
+
+        size_t offset = 0;
+        MESSAGE_HEADER header;
+        char * payload;
+        while (valid && (size = parse_message(i->buffer + offset, i->used - offset, &header, &payload)) > 0) {
+            valid = handle_message(i, &header, payload, status) == 0;
+            offset += size;
+        }
+        if (size < 0) valid = 0;
+
+        i->used -= offset;
+        memmove(i->buffer, i->buffer + offset, i->used);
+
+    }
+
+    if (valid && bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (!valid) send_message(fd, MESSAGE_ERROR, 0, 0, NULL, 0, NULL, 0);
+    if (i->socket_path) fprintf(stderr, "Instance %s left\n", i->socket_path);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    *tmp = i->next;
+    free_instance(i);
+
+}
+
+/**
+ * @brief Counts the lendable jobs of a busy instance that an idle one has free filters for, filter by filter
+ * @param busy Instance with lendable jobs
+ * @param idle Instance without waiting jobs
+ * @return Jobs the idle instance could start
+*/
+int overlap(INSTANCE busy, INSTANCE idle) {
+
+    int n = 0;
+    for (int f = 0; f < busy->capacity.n_filters; f++) {
+
+        CAPACITY_FILTER * needed = &busy->filters[f];
+        if (!needed->queued) continue;
+        for (int g = 0; g < idle->capacity.n_filters; g++)
+            if (!strcmp(idle->filters[g].name, needed->name)) {
+                n += needed->queued < idle->filters[g].free ? needed->queued : idle->filters[g].free;
+                break;
+            }
+
+    }
+
+    return n;
+
+}
+
+/**
+ * @brief Has every idle instance steal jobs from the busy instance it can help the most: the busy one lends them
+ * to it. Until they tell what they can take again, the idle one counts as having them waiting
+ * @param instances Struct with the instances
+*/
+void balance(INSTANCE instances) {
+
+    for (INSTANCE idle = instances; idle; idle = idle->next) {
+
+        if (!idle->socket_path || idle->capacity.waiting) continue;
+
+        INSTANCE busy = NULL;
+        int best = 0;
+        for (INSTANCE i = instances; i; i = i->next) {
+            if (i == idle || !i->socket_path || !i->capacity.lendable) continue;
+            int n = overlap(i, idle);
+            if (n > best) {
+                best = n;
+                busy = i;
+            }
+        }
+        if (!busy) continue;
+
+        // Jobs a filter needs are counted once per filter of their chain, so no more than the lendable ones are asked for
+        int n = best < busy->capacity.lendable ? best : busy->capacity.lendable;
+        if (send_message(busy->fd, MESSAGE_STEAL, n, 0, idle->socket_path, strlen(idle->socket_path) + 1, NULL, 0) < 0) continue;
+        fprintf(stderr, "Instance %s steals %d jobs from %s\n", idle->socket_path, n, busy->socket_path);
+        busy->capacity.lendable -= n;
+        busy->capacity.waiting -= n;
+        idle->capacity.waiting += n;
+
+    }
+
+}
+
+/**
+ * @brief Publishes the status of every instance as one: their tasks, named by the instance, and their filters,
+ * merged by name
+ * @param instances Struct with the instances
+ * @param status Segment of the coordinator
+ * @param copy Where the status of each instance is copied to
+*/
+void aggregate(INSTANCE instances, STATUS * status, STATUS * copy) {
+
+    status_begin(status);
+
+    status->n_running = status->n_waiting = status->n_tasks = status->n_filters = 0;
+    status->budget = status->budget_used = status->replay_seconds = 0;
+    status->replayed = status->resumed = status->redone = 0;
+    status->n_requests = status->n_pooled = 0;
+    status->heap = 0;
+    status->text[0] = '\0';
+
+    int length = 0;
+    for (INSTANCE i = instances; i; i = i->next) {
+
+        if (!i->status || status_read(i->status, copy) < 0) continue;
+        status->n_running += copy->n_running;
+        status->n_waiting += copy->n_waiting;
+        status->budget += copy->budget;
+        status->budget_used += copy->budget_used;
+        status->replay_seconds += copy->replay_seconds;
+        status->replayed += copy->replayed;
+        status->resumed += copy->resumed;
+        status->redone += copy->redone;
+        status->n_requests += copy->n_requests;
+        status->n_pooled += copy->n_pooled;
+        status->heap += copy->heap;
+        if (length < STATUS_TEXT)
+            length += snprintf(status->text + length, STATUS_TEXT - length, "Instance %s (pid %d): %d running, %d waiting\n",
+                               i->socket_path, copy->pid, copy->n_running, copy->n_waiting);
+
+        for (int t = 0; t < copy->n_tasks && status->n_tasks < STATUS_MAX_TASKS; t++) {
+            STATUS_TASK * task = &status->tasks[status->n_tasks++];
+            *task = copy->tasks[t];
+            int n = snprintf(task->line, STATUS_LINE, "%s: ", i->name);
+            if (n < STATUS_LINE) snprintf(task->line + n, STATUS_LINE - n, "%s", copy->tasks[t].line);
+        }
+
+        for (int f = 0; f < copy->n_filters; f++) {
+            int g;
+            for (g = 0; g < status->n_filters && strcmp(status->filters[g].name, copy->filters[f].name); g++);
+            if (g == status->n_filters) {
+                if (g == STATUS_MAX_FILTERS) continue;
+                status->filters[g] = copy->filters[f];
+                status->n_filters++;
+                continue;
+            }
+            STATUS_FILTER * merged = &status->filters[g];
+            merged->running += copy->filters[f].running;
+            merged->limit += copy->filters[f].limit;
+            merged->max += copy->filters[f].max;
+            merged->queued += copy->filters[f].queued;
+            if (copy->filters[f].warm >= 0) merged->warm = (merged->warm > 0 ? merged->warm : 0) + copy->filters[f].warm;
+        }
+
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    status->updated = now.tv_sec + now.tv_nsec / 1e9;
+
+    status_end(status);
+
+}
+
+/**
+ * @brief Coordinates the instances of the server that share their work on this machine: they register
+ * through its socket and tell it what they can take, and it has the idle ones steal jobs from the busy ones.
+ * Its status segment, next to its socket, shows all of them as one server
+ * @param argc Number of arguments
+ * @param argv Arguments: the socket, COORDINATOR_SOCKET if not given
+ * @return Status
+*/
+int main(int argc, char * argv[]) {
+
+    if (argc > 2) {
+        fprintf(stderr, "%s [socket]\n", argv[0]);
+        exit(1);
+    }
+    char * socket_path = argc == 2 ? argv[1] : COORDINATOR_SOCKET;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("coordinator socket");
+        exit(1);
+    }
+
+    char status_path[MAX];
+    snprintf(status_path, MAX, "%s" STATUS_SUFFIX, socket_path);
+    STATUS * status = status_create(status_path);
+    if (!status) {
+        perror("status segment");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN };
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    INSTANCE instances = NULL;
+    STATUS * copy = malloc(sizeof(STATUS));
+    while (1) {
+
+        struct epoll_event events[MAX_EVENTS];
+        int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, REFRESH_INTERVAL);
+        if (n_events < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int e = 0; e < n_events; e++)
+            if (events[e].data.fd == fd) accept_instances(fd, epoll_fd, &instances);
+            else read_instance(events[e].data.fd, epoll_fd, &instances, status);
+
+        balance(instances);
+        aggregate(instances, status, copy);
+
+    }
+
+    while (instances) {
+        INSTANCE next = instances->next;
+        free_instance(instances);
+        instances = next;
+    }
+    free(copy);
+    close(epoll_fd);
+    close(fd);
+    unlink(socket_path);
+    unlink(status_path);
+    status_unmap(status);
+
+    return 0;
+
+}
@@ -4,41 +4,272 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
-#define MAIN_FIFO "tmp/main_fifo"
+#include "protocol.h"
+#include "libaurras.h"
+
 #define MAX 1024
+#define MAX_STATUS 65536 // Bytes of the status that are shown
+#define TOP_BAR 20 // Width of the utilization bar of each filter
 
 /**
- * @brief Creates an expression for a transform instruction, to send to the server
- * @param argv Relevant arguments, like source file, output file and filters
- * @param argc Number of arguments
- * @param pid Pid of the client
- * @return String with the built expression
+ * @brief Batch job, one line of a manifest
+*/
+typedef struct job {
+
+    int line;
+    char * source; // Names as written in the manifest, relative to the working directory
+    char * output;
+    char ** filters;
+    int n_filters;
+    int priority;
+    double start; // Window of a preview, in seconds, none if both are 0
+    double duration;
+    double deadline; // Seconds the server gives the job to end, none if 0
+    int state; // AURRAS_STATE once the job ended, -1 until then
+
+} JOB;
+
+/**
+ * @brief Parses a manifest of a batch, where each line is a transform: [--priority 0-9] [--start s] [--duration s]
+ * [--deadline s] input output filters...
+ * Empty lines and lines starting with '#' are skipped
+ * @param filename Name of the manifest
+ * @param n_jobs Where to place the number of jobs
+ * @return Array with the jobs
+*/
+JOB * read_manifest(char * filename, int * n_jobs) {
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        exit(1);
+    }
+
+    char * buffer = malloc(st.st_size + 1);
+    ssize_t bytes_read, size = 0;
+    while (size < st.st_size && (bytes_read = read(fd, buffer + size, st.st_size - size)) > 0) size += bytes_read;
+    buffer[size] = '\0';
+    close(fd);
+
+    JOB * jobs = NULL;
+    int capacity = 0;
+    *n_jobs = 0;
+    char * save;
+    int line_number = 0;
+    for (char * line = buffer, * end; line; line = end) {
+
+        // Empty lines count for the line numbers too
+        line_number++;
+        end = strchr(line, '\n');
+        if (end) *end++ = '\0';
+
+        char * args[MAX];
+        int n_args = 0;
+        for (char * arg = strtok_r(line, " \t\r", &save); arg && n_args < MAX; arg = strtok_r(NULL, " \t\r", &save))
+            args[n_args++] = arg;
+        if (!n_args || args[0][0] == '#') continue;
+
+        int priority = 0, first = 0;
+        double start = 0, duration = 0, deadline = 0;
+        for (; first + 1 < n_args && !strncmp(args[first], "--", 2); first += 2) {
+            if (!strcmp(args[first], "--priority")) priority = atoi(args[first + 1]);
+            else if (!strcmp(args[first], "--start")) start = atof(args[first + 1]);
+            else if (!strcmp(args[first], "--duration")) duration = atof(args[first + 1]);
+            else if (!strcmp(args[first], "--deadline")) deadline = atof(args[first + 1]);
+            else break;
+        }
+        if (n_args - first < 3) {
+            fprintf(stderr, "%s:%d: expected [--priority 0-9] [--start s] [--duration s] [--deadline s] input output filters...\n", 
+                            filename, line_number);
+            exit(1);
+        }
+
+        if (*n_jobs == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            jobs = realloc(jobs, capacity * sizeof(JOB));
+        }
+        JOB * job = &jobs[(*n_jobs)++];
+        job->line = line_number;
+        job->source = strdup(args[first]);
+        job->output = strdup(args[first + 1]);
+        job->n_filters = n_args - first - 2;
+        job->filters = malloc(job->n_filters * sizeof(char *));
+        for (int i = 0; i < job->n_filters; i++) job->filters[i] = strdup(args[first + 2 + i]);
+        job->priority = priority;
+        job->start = start;
+        job->duration = duration;
+        job->deadline = deadline;
+        job->state = -1;
+
+    }
+
+    free(buffer);
+    return jobs;
+
+}
+
+/**
+ * @brief Runs the jobs of a manifest through a single connection. The server opens the files by name,
+ * relative to the working directory, only while it handles each job
+ * @param filename Name of the manifest
+ * @return Number of jobs that didn't end well
+*/
+int run_batch(char * filename) {
+
+    int n_jobs;
+    JOB * jobs = read_manifest(filename, &n_jobs);
+
+    AURRAS a = aurras_open(NULL);
+    if (!a) {
+        perror("connect");
+        exit(1);
+    }
+
+    // Ids are given in order from 0, so each is the index of its job
+    int submitted = 0;
+    for (; submitted < n_jobs; submitted++) {
+        JOB * job = &jobs[submitted];
+        aurras_deadline(a, job->deadline);
+        if (aurras_submit_range(a, job->source, job->output, job->filters, job->n_filters, job->priority, 
+                                job->start, job->duration, NULL) < 0) {
+            fprintf(stderr, "%s:%d: ", filename, job->line);
+            perror("submit");
+            break;
+        }
+    }
+
+    int ended = 0, failed = n_jobs - submitted;
+    AURRAS_RECORD record;
+    while (ended < submitted && aurras_next(a, &record) == 0) {
+
+        if (record.state == AURRAS_PROCESSING || record.job >= submitted) continue;
+        JOB * job = &jobs[record.job];
+        job->state = record.state;
+        ended++;
+
+        if (record.state == AURRAS_DONE)
+            printf("%s -> %s: done (%.3fs queued, %.3fs running)\n", job->source, job->output, record.queued, record.running);
+        else {
+            failed++;
+            printf("%s -> %s: %s (exit status %d)\n", job->source, job->output, 
+                   record.state == AURRAS_CANCELLED ? "cancelled" : record.state == AURRAS_EXPIRED ? "expired" :
+                   record.state == AURRAS_REJECTED ? "rejected, the server is busy" : "failed", record.exit_status);
+        }
+
+    }
+
+    // Jobs without an end never got one from the server
+    for (int i = 0; i < n_jobs; i++) {
+        if (i < submitted && jobs[i].state < 0) {
+            fprintf(stderr, "%s:%d: no reply from the server\n", filename, jobs[i].line);
+            failed++;
+        }
+        free(jobs[i].source);
+        free(jobs[i].output);
+        for (int j = 0; j < jobs[i].n_filters; j++) free(jobs[i].filters[j]);
+        free(jobs[i].filters);
+    }
+    printf("%d done, %d failed\n", n_jobs - failed, failed);
+
+    free(jobs);
+    aurras_close(a);
+    return failed;
+
+}
+
+/**
+ * @brief Shows the status of the server live, like top, until it ends or the user interrupts it
+ * @param interval Seconds between refreshes
 */
-char * build_expression(char * argv[], int argc, char * pid) {
+void run_top(double interval) {
+
+    AURRAS a = aurras_open(NULL);
+    STATUS * s = malloc(sizeof(STATUS));
+    char * screen = malloc(MAX_STATUS);
+    if (!a || aurras_snapshot(a, s) < 0) {
+        perror("top");
+        exit(1);
+    }
+
+    while (aurras_snapshot(a, s) == 0) {
+
+        // Lines are cut to the terminal, tasks that don't fit are only counted
+        struct winsize ws = { 24, 80, 0, 0 };
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || !ws.ws_row || !ws.ws_col) ws = (struct winsize) { 24, 80, 0, 0 };
+        int width = ws.ws_col < MAX ? ws.ws_col : MAX - 1;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        double now = ts.tv_sec + ts.tv_nsec / 1e9;
 
-    char * buffer = malloc(MAX);
-    // Type of instruction, input, output,
-    snprintf(buffer, MAX, "1,%s,%s,", argv[0], argv[1]);
+        int length = 0, rows = 0;
+        char line[MAX];
+        length += snprintf(screen + length, MAX_STATUS - length, "\033[H\033[J");
+
+        snprintf(line, width + 1, "aurrasd %d: %d running, %d waiting, updated %.1fs ago",
+                 s->pid, s->n_running, s->n_waiting, now - s->updated);
+        length += snprintf(screen + length, MAX_STATUS - length, "%s\n\n%-16s %9s %4s  %-*s %6s %6s\n",
+                           line, "FILTER", "RUNNING", "MAX", TOP_BAR + 7, "UTILIZATION", "QUEUED", "WARM");
+        rows += 3;
+
+        for (int i = 0; i < s->n_filters && length < MAX_STATUS - MAX; i++) {
+
+            STATUS_FILTER * f = &s->filters[i];
+            double used = f->limit ? (double) f->running / f->limit : 0;
+            char bar[TOP_BAR + 1], warm[12] = "-";
+            for (int j = 0; j < TOP_BAR; j++) bar[j] = j < used * TOP_BAR ? '#' : '.';
+            bar[TOP_BAR] = '\0';
+            if (f->warm >= 0) snprintf(warm, sizeof(warm), "%d", f->warm);
+
+            snprintf(line, width + 1, "%-16s %4d/%-4d %4d [%s] %3.0f%% %6d %6s", f->name, f->running, f->limit, f->max, bar,
+                     100 * used, f->queued, warm);
+            length += snprintf(screen + length, MAX_STATUS - length, "%s\n", line);
+            rows++;
+
+        }
+
+        length += snprintf(screen + length, MAX_STATUS - length, "\n%-7s %-8s %3s %8s %-9s %s\n", "TASK", "STATE", "PRI", "TIME", "CORES", "DESCRIPTION");
+        rows += 2;
+
+        int shown = 0;
+        for (int i = 0; i < s->n_tasks && rows < ws.ws_row - 2 && length < MAX_STATUS - MAX; i++, shown++, rows++) {
+
+            STATUS_TASK * t = &s->tasks[i];
+            int waiting = t->state == TASK_WAITING;
+            snprintf(line, width + 1, "#%-6d %-8s %3d %7.1fs %-9s %s", t->task, waiting ? "waiting" : "running", t->priority,
+                     now - (waiting ? t->arrival : t->started), t->domain >= 0 ? t->cpus : "-", t->line);
+            length += snprintf(screen + length, MAX_STATUS - length, "%s\n", line);
+
+        }
+        if (shown < s->n_running + s->n_waiting)
+            length += snprintf(screen + length, MAX_STATUS - length, "(%d more tasks)\n", s->n_running + s->n_waiting - shown);
+
+        write(STDOUT_FILENO, screen, length);
+
+        struct timespec pause = { (time_t) interval, (long) ((interval - (time_t) interval) * 1e9) };
+        nanosleep(&pause, NULL);
 
-    // Loop to write the filters separated by " "
-    for (int i = 2; i < argc; i++) {
-        snprintf(buffer + strlen(buffer), MAX, "%s", argv[i]);
-        if (i != argc - 1) snprintf(buffer + strlen(buffer), MAX, " ");
     }
 
-    // Loop to write the pid of the client
-    snprintf(buffer + strlen(buffer), MAX, ",%s\n", pid);
+    // The loop only ends once the server is gone
+    perror("top");
+    free(screen);
+    free(s);
+    aurras_close(a);
+    exit(1);
 
-    return buffer;
 }
 
 /**
  * @brief Function that manages the cases of client actions
  * @param argc Number of arguments
- * @param argv Arguments 
+ * @param argv Arguments
  * @return Status
 */
 int main(int argc, char * argv[]) {
@@ -46,121 +277,149 @@ int main(int argc, char * argv[]) {
     if (argc == 1) { // Case to give guide to user
 
         char * buffer = malloc(MAX);
-        sprintf(buffer, "./aurras status\n./aurras transform input-filename output-filename filter-id-1 filter-id-2 ...\n");
+        sprintf(buffer, "./aurras status\n./aurras stats\n./aurras top [refresh-seconds]\n./aurras transform [--priority 0-9] [--start seconds] [--duration seconds] [--deadline seconds] input-filename output-filename filter-id-1 filter-id-2 ...\n(- as input-filename or output-filename is stdin or stdout, --start and --duration preview a part of the input, --deadline drops it if it didn't end by then)\n./aurras transform [--priority 0-9] input-filename output-filename filter-id-1 ... -- output-filename-2 filter-id-1 ...\n(several outputs of one input, the filters their chains start with run once)\n./aurras batch manifest-filename\n(one transform per line: [--priority 0-9] [--start seconds] [--duration seconds] [--deadline seconds] input-filename output-filename filter-id-1 ...)\n./aurras cancel task-number\n(cancels a task shown by status, of any client)\n");
         write(STDOUT_FILENO, buffer, strlen(buffer));
         free(buffer);
 
     }
     else if (argc == 2 && !strcmp(argv[1], "status")) { // Case to give status on the server
 
-        // Gets pids of the client
-        pid_t pid = getpid();
-        char * pid_str = malloc(20); 
-        snprintf(pid_str, 20, "tmp/%d", pid);
-        
-        // Creates fifo with the name of the pid in tmp directory
-        if (mkfifo(pid_str, 0666) < 0) {
-            perror("mkfifo");
+        AURRAS a = aurras_open(NULL);
+        char * buffer = malloc(MAX_STATUS);
+        int length = a ? aurras_status(a, buffer, MAX_STATUS) : -1;
+        if (length < 0) {
+            perror("status");
             exit(1);
         }
+        write(STDOUT_FILENO, buffer, length);
+
+        free(buffer);
+        aurras_close(a);
 
-        // Open the client to server fifo
-        int fd = open(MAIN_FIFO, O_WRONLY, 0644);
-        if (fd < 0) {
-            perror("open main fifo");
+    }
+    else if (argc == 2 && !strcmp(argv[1], "stats")) { // Case to give the latency and resources of the jobs
+
+        AURRAS a = aurras_open(NULL);
+        char * buffer = malloc(MAX_STATUS);
+        int length = a ? aurras_stats(a, buffer, MAX_STATUS) : -1;
+        if (length < 0) {
+            perror("stats");
             exit(1);
         }
+        write(STDOUT_FILENO, buffer, length);
 
-        // Sends 0 <=> status and the path to the server to client fifo
-        char * buffer = malloc(MAX);
-        snprintf(buffer, MAX, "0,tmp/%d", pid);
-        write(fd, buffer, strlen(buffer));
-        close(fd);
-
-        // Opens server to client fifo
-        fd = open(pid_str, O_RDONLY);
-        if (fd < 0) {
-            perror("open client fifo");
+        free(buffer);
+        aurras_close(a);
+
+    }
+    else if (argc == 3 && !strcmp(argv[1], "cancel")) { // Case to cancel a task by its number in the status
+
+        AURRAS a = aurras_open(NULL);
+        char buffer[MAX];
+        int length = a ? aurras_cancel_task(a, atoi(argv[2]), buffer, MAX) : -1;
+        if (length < 0) {
+            perror("cancel");
             exit(1);
         }
+        write(STDOUT_FILENO, buffer, length);
 
-        free(pid_str);
+        aurras_close(a);
 
-        // Attempts to read the server to client fifo until it receives the status info and writes it to stdout
-        int flag = 1;
-        while(flag) {
-            ssize_t b_read;
-            if ((b_read = read(fd, buffer, MAX)) > 0) { // Talvez mudar isto para abrir denovo caso nao leia para nao rebentar
-                write(STDOUT_FILENO, buffer, b_read);
-                flag = 0;
-            }
+    }
+    else if ((argc == 2 || argc == 3) && !strcmp(argv[1], "top")) { // Case to watch the server live
 
-        }
+        double interval = argc == 3 ? atof(argv[2]) : 1;
+        run_top(interval > 0 ? interval : 1);
+
+    }
+    else if (argc == 3 && !strcmp(argv[1], "batch")) { // Case of many transformations at once
 
-        close(fd);
+        if (run_batch(argv[2])) exit(1);
 
     }
     else if (argc > 4 && !strcmp(argv[1], "transform")) { // Cases of transformation requests
 
-            // Create a server to client fifo with the client pid as name
-            pid_t pid = getpid();
-            char * pid_str = malloc(MAX);
-            snprintf(pid_str, MAX, "tmp/");
-            snprintf(pid_str + strlen(pid_str), MAX, "%d", pid);
-            if (mkfifo(pid_str, 0666) < 0) {
-                perror("mkfifo");
-                exit(1);
+            // Optional priority level, higher levels are served first, window of a preview and deadline
+            int priority = 0;
+            double start = 0, duration = 0, deadline = 0;
+            for (; argc > 6 && !strncmp(argv[2], "--", 2); argv += 2, argc -= 2) {
+                if (!strcmp(argv[2], "--priority")) priority = atoi(argv[3]);
+                else if (!strcmp(argv[2], "--start")) start = atof(argv[3]);
+                else if (!strcmp(argv[2], "--duration")) duration = atof(argv[3]);
+                else if (!strcmp(argv[2], "--deadline")) deadline = atof(argv[3]);
+                else break;
+            }
+
+            // Each "--" starts another output, followed by its filters. Those are opened by the server, by name
+            char * outputs[PROTOCOL_MAX_OUTPUTS] = { argv[3] }, ** chains[PROTOCOL_MAX_OUTPUTS] = { argv + 4 };
+            int n_filters[PROTOCOL_MAX_OUTPUTS] = { 0 }, n_outputs = 1;
+            for (int i = 4; i < argc; i++) {
+                if (strcmp(argv[i], "--")) n_filters[n_outputs - 1]++;
+                else if (n_outputs == PROTOCOL_MAX_OUTPUTS || i + 2 >= argc) {
+                    fprintf(stderr, "At most %d outputs, each one with a name and filters\n", PROTOCOL_MAX_OUTPUTS);
+                    exit(1);
+                }
+                else {
+                    outputs[n_outputs] = argv[++i];
+                    chains[n_outputs++] = argv + i + 1;
+                }
             }
-        
-            // Open client to server fifo 
-            int fd = open(MAIN_FIFO, O_WRONLY, 0644);
-            if (fd < 0) {
-                perror("open");
+
+            if (n_outputs > 1 && (start > 0 || duration > 0)) {
+                fprintf(stderr, "A preview has a single output\n");
                 exit(1);
             }
 
-            // Writes the expression to the client to server fifo
-            char * instruction = build_expression(argv + 2, argc - 2, pid_str);
-            write(fd, instruction, strlen(instruction));
-            close(fd);
+            // The source and the output are opened here and sent to the server, "-" is stdin or stdout.
+            // The output is readable so the server can keep a copy of it
+            int fds[2] = { -1, -1 };
+            if (n_outputs == 1) {
+                fds[0] = strcmp(argv[2], "-") ? open(argv[2], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+                fds[1] = strcmp(argv[3], "-") ? open(argv[3], O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : STDOUT_FILENO;
+                if (fds[0] < 0 || fds[1] < 0) {
+                    perror("open");
+                    exit(1);
+                }
+            }
 
-            // Writes that client is pending 
-            write(STDOUT_FILENO, "Pending\n", 9);
+            // Messages go to stderr when stdout carries the output
+            int fd_messages = fds[1] == STDOUT_FILENO ? STDERR_FILENO : STDOUT_FILENO;
 
-            // Open server to client fifo again
-            fd = open(pid_str, O_RDONLY);
-            if (fd < 0) {
-                perror("open");
+            AURRAS a = aurras_open(NULL);
+            if (a) aurras_deadline(a, deadline);
+            if (!a || (n_outputs == 1 ? aurras_submit_range(a, argv[2], argv[3], argv + 4, argc - 4, priority, start, duration, fds)
+                                      : aurras_submit_tree(a, argv[2], outputs, chains, n_filters, n_outputs, priority)) < 0) {
+                perror("submit");
                 exit(1);
             }
-            free(pid_str);
+            if (fds[0] >= 0 && fds[0] != STDIN_FILENO) close(fds[0]);
+            if (fds[1] >= 0 && fds[1] != STDOUT_FILENO) close(fds[1]);
 
-            // Read it until server sends message that it's ready
-            char c = ' '; 
-            int first = 1;
-            while (c != '0') {
-                
-                // Informs that the server picked up the request 
-                if (first && c == '1') {
-                    first = 0;
-                    write(STDOUT_FILENO, "Processing\n", 12);
-                }
+            // Writes that client is pending
+            write(fd_messages, "Pending\n", 8);
 
-                // Attempts to read again
-                read(fd, &c, 1); // FAZER VERIFICAAO DO READ E REABRIR?
+            // Read it until server sends message that it's ready
+            AURRAS_RECORD record = { 0, AURRAS_FAILED, 0, 0, 0, 0 };
+            while (aurras_next(a, &record) == 0 && record.state == AURRAS_PROCESSING)
+                // Informs that the server picked up the request
+                write(fd_messages, "Processing\n", 11);
 
+            aurras_close(a);
+            if (record.state != AURRAS_DONE) {
+                char * ending = record.state == AURRAS_CANCELLED ? "Cancelled\n" : record.state == AURRAS_EXPIRED ? "Expired\n" :
+                                record.state == AURRAS_REJECTED ? "Rejected, the server is busy\n" : "Failed\n";
+                write(fd_messages, ending, strlen(ending));
+                exit(1);
             }
 
-            close(fd);
-
     }
     else {
 
         perror("Invalid commands");
         exit(1);
-        
+
     }
 
     return 0;
 
-}
\ No newline at end of file
+}
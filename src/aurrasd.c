@@ -1,548 +1,4898 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <sched.h>
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <malloc.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "dsp.h"
+#include "cache.h"
+#include "protocol.h"
+#include "status.h"
+#include "metrics.h"
+#include "topology.h"
+#include "journal.h"
+#include "arena.h"
 
-#define MAIN_FIFO "tmp/main_fifo"
 #define MAX 1024
+#define MAX_EVENTS 64 // Events handled in each iteration of the loop
+#define MAX_FILTERS 64 // Filters the server can be configured with
+#define FILTER_BUCKETS 128 // Buckets of the filters hash table, a power of two above MAX_FILTERS
+#define MAX_CHAIN 32 // Filters a request can apply
+#define MAX_BRANCHES (2 * PROTOCOL_MAX_OUTPUTS) // Branches of the tree of a request with several outputs
+#define MAX_STAGES (3 * MAX_CHAIN + 3 * MAX_BRANCHES + 1) // Processes of a pipeline, with a decoder and an encoder around
+                                                         // each raw part and taps, or a fan-out ending each branch
+#define TRANSFORM_FILTERS 5 // Index of the first filter among the strings of a transform message
+#define MAX_FIELDS (TRANSFORM_FILTERS + PROTOCOL_MAX_OUTPUTS * (MAX_CHAIN + 2)) // Strings of a transform message
+#define FACTOR_TOLERANCE 0.01 // Relative error under which two gain or tempo factors are taken as equal
+
+#define MAX_PRIORITY 9 // Highest priority level a client can ask for
+#define PRIORITY_WEIGHT 10 // Seconds of waiting that one priority level is worth
+#define FAIR_SHARE_WEIGHT 5 // Seconds of waiting lost for each running request of the same client
+#define AGING_LIMIT 30 // Seconds after which a waiting request reserves the filters it needs
+#define TAP_BLOCK 65536 // Bytes a tap passes on at once
+#define TAP_UNCACHED 2 // Exit status of a tap that passed its stream on without keeping a copy
+#define DECODED_PATH "tmp/task%d.pcm" // Decoded source of a request split in segments
+#define SEGMENT_PATH "tmp/task%d-%d.pcm" // Output of a segment, before it's joined
+#define REPLY_TIMEOUT 1 // Seconds a reply may wait for a client that doesn't read its connection
+#define PREALLOCATE_SLACK 1.1 // Factor over the estimated size of an output that is preallocated
+#define ADAPT_OVERLOAD 1.25 // Runnable threads per core above which the limits of the busy filters shrink
+#define ADAPT_DECREASE 0.75 // Factor a limit is multiplied by when the host is overloaded
+#define ADAPT_TOLERANCE 0.05 // Relative drop of throughput after a raise that undoes it
+#define REQUEST_ARENA 4096 // Bytes of the arena of a request, enough for its paths and the names of its filters
+#define MAX_POOLED 256 // Requests kept once they end, with their arenas, for the next ones
+#define ADAPT_SMOOTHING 0.5 // Weight of the last interval in the smoothed throughput of a filter
 
 int task = 1;
+pid_t stage_group = 0; // Process group the next stage joins, 0 for a group of its own
+
+/**
+ * @brief Settings that don't belong to a filter, given by "key=value" lines in the config file
+*/
+struct settings {
+
+    char * decoder; // Command that turns its input into raw PCM for the built-in filters
+    char * encoder; // Command that turns raw PCM back into the output format
+    int pcm_rate;
+    int pcm_channels;
+    int raw_pipeline; // If true, filters that accept raw PCM exchange it instead of encoded audio
+    int optimize; // If true, chains are simplified before they run
+    char * cache_dir; // Directory of the output cache, no cache if NULL
+    long long cache_size; // Bytes above which the least recently used outputs leave the cache
+    int cache_by_content; // If true, sources are identified by their contents instead of inode, size and mtime
+    long long prefix_cache_size; // Bytes of intermediate streams kept in the cache, none if 0
+    long long segment_threshold; // Sources with at least these bytes are split in segments, none if 0
+    int segments; // Segments a source is split in, the number of cores if 0
+    int segment_overlap; // Milliseconds of warm-up for filters without declared effects
+    int worker_pool; // If true, built-in and persistent filters run in resident workers
+    char * metrics_file; // Exposition file with the metrics of the jobs, none if NULL
+    char * job_log; // File where a JSON line is appended for each job, none if NULL
+    int adapt_interval; // Milliseconds between adjustments of the limits of the filters, fixed at their maximum if 0
+    double cpu_budget; // Cores the filters of all the running stages may take together, no budget if 0
+    int affinity; // If true, the stages of a pipeline are pinned to nearby cores
+    long long prefetch_size; // Bytes of the sources of the first waiting requests read ahead, none if 0
+    int preallocate; // If true, outputs are preallocated with their estimated size
+    char * window_decoder; // Command that decodes from AURRAS_FROM seconds of its input, for AURRAS_LENGTH seconds
+                           // if set, for previews. If NULL, they're cut from the output of the decoder
+    int preview_slots; // Instances of each filter above its limit, and outside the budget, only previews can use
+    int max_queue; // Requests that can wait at once, the ones that arrive above it are rejected, no cap if 0
+    char * journal; // Journal of the requests sent by name, replayed when the server starts, none if NULL
+    char * socket; // Socket the clients connect to, the status, metrics and journal are next to it by default
+    char * coordinator; // Socket of the coordinator this instance shares its work through, none if NULL
+
+} settings = {
+    .decoder = "ffmpeg -hide_banner -loglevel panic -i /dev/stdin -f f32le -ac 2 -ar 44100 pipe:1",
+    .encoder = "ffmpeg -hide_banner -loglevel panic -f f32le -ac 2 -ar 44100 -i pipe:0 -f mp3 pipe:1",
+    .pcm_rate = 44100,
+    .pcm_channels = 2,
+    .raw_pipeline = 0,
+    .optimize = 1,
+    .cache_dir = NULL,
+    .cache_size = 1LL << 30,
+    .cache_by_content = 0,
+    .prefix_cache_size = 0,
+    .segment_threshold = 0,
+    .segments = 0,
+    .segment_overlap = 100,
+    .worker_pool = 1,
+    .metrics_file = MAIN_SOCKET ".metrics",
+    .job_log = NULL,
+    .adapt_interval = 1000,
+    .cpu_budget = 0,
+    .affinity = 1,
+    .prefetch_size = 64LL << 20,
+    .preallocate = 1,
+    .window_decoder = "ffmpeg -hide_banner -loglevel panic -ss $AURRAS_FROM ${AURRAS_LENGTH:+-t $AURRAS_LENGTH} -i /dev/stdin -f f32le -ac 2 -ar 44100 pipe:1",
+    .preview_slots = 1,
+    .max_queue = 0,
+    .journal = MAIN_SOCKET ".journal",
+    .socket = MAIN_SOCKET,
+    .coordinator = NULL
+};
+
+int epoll_fd = -1; // Epoll instance of the main loop, which also watches the control sockets of the workers
+CACHE cache = NULL;
+CACHE prefixes = NULL; // Streams between the stages of a pipeline, by source and chain prefix
+METRICS metrics = NULL; // Latency and resources of the jobs that ended
+STATUS * status = NULL; // Segment where the status is published, next to the socket
+TOPOLOGY topology = NULL; // Cores the stages are placed on, NULL if they aren't pinned
+JOURNAL journal = NULL; // Requests sent by name that didn't end, NULL without a journal
+char socket_path[MAX]; // Absolute path of the socket, as other instances are told
+char advertised[sizeof(CAPACITY) + MAX_FILTERS * sizeof(CAPACITY_FILTER)]; // Last capacity sent to the coordinator
+uint32_t advertised_length = 0;
+char scratch[PROTOCOL_MAX_PAYLOAD]; // Payloads and replies the server builds, one at a time
+
+/**
+ * @brief What the server found in the journal when it started, for the status
+*/
+struct recovery {
+
+    double seconds; // Time the replay took
+    int replayed; // Requests rebuilt
+    int resumed; // Segments of them that ended before, and didn't run again
+    int redone; // Segments of them that ran again, and those of them that weren't split
+
+} recovery;
+
+struct timespec adapted; // When the limits of the filters were last adjusted
+
+/**
+ * @brief Parses a size in bytes, with an optional K, M or G suffix
+ * @param value String with the size
+ * @return Size in bytes
+*/
+long long parse_size(char * value) {
+
+    char * suffix;
+    long long size = strtoll(value, &suffix, 10);
+    switch (*suffix) {
+        case 'G': case 'g': size <<= 10; // fall through
+        case 'M': case 'm': size <<= 10; // fall through
+        case 'K': case 'k': size <<= 10; break;
+        default: break;
+    }
+
+    return size;
+
+}
+
+/**
+ * @brief Replaces a setting that is a string, freeing its previous value
+ * @param setting Setting
+ * @param value New value
+ * @param optional If true, an empty value leaves the setting unset
+*/
+void set_string(char ** setting, char * value, int optional) {
+
+    free(*setting);
+    *setting = optional && !*value ? NULL : strdup(value);
+
+}
+
+/**
+ * @brief Copies the defaults of the settings that are strings, so that every one of them can be freed
+ * once it's replaced
+*/
+void own_settings() {
+
+    char ** strings[] = { &settings.decoder, &settings.encoder, &settings.cache_dir, &settings.metrics_file,
+                          &settings.job_log, &settings.window_decoder, &settings.journal, &settings.socket,
+                          &settings.coordinator };
+
+    int n = sizeof(strings) / sizeof(strings[0]);
+    for (int i = 0; i < n; i++)
+        if (*strings[i]) *strings[i] = strdup(*strings[i]);
+
+}
+
+/**
+ * @brief Changes a setting of the server
+ * @param key Name of the setting
+ * @param value New value
+ * @return 0 if changed, -1 if the setting doesn't exist
+*/
+int set_setting(char * key, char * value) {
+
+    int ret = 0;
+
+    if (!strcmp(key, "decoder")) set_string(&settings.decoder, value, 0);
+    else if (!strcmp(key, "encoder")) set_string(&settings.encoder, value, 0);
+    else if (!strcmp(key, "pcm_rate")) settings.pcm_rate = atoi(value);
+    else if (!strcmp(key, "pcm_channels")) settings.pcm_channels = atoi(value);
+    else if (!strcmp(key, "pipeline")) {
+        if (!strcmp(value, "raw")) settings.raw_pipeline = 1;
+        else if (!strcmp(value, "encoded")) settings.raw_pipeline = 0;
+        else ret = -1;
+    }
+    else if (!strcmp(key, "optimize")) settings.optimize = atoi(value);
+    else if (!strcmp(key, "cache_dir")) set_string(&settings.cache_dir, value, 0);
+    else if (!strcmp(key, "cache_size")) settings.cache_size = parse_size(value);
+    else if (!strcmp(key, "prefix_cache_size")) settings.prefix_cache_size = parse_size(value);
+    else if (!strcmp(key, "segment_threshold")) settings.segment_threshold = parse_size(value);
+    else if (!strcmp(key, "segments")) settings.segments = atoi(value);
+    else if (!strcmp(key, "segment_overlap")) settings.segment_overlap = atoi(value);
+    else if (!strcmp(key, "worker_pool")) settings.worker_pool = atoi(value);
+    else if (!strcmp(key, "metrics_file")) set_string(&settings.metrics_file, value, 1);
+    else if (!strcmp(key, "job_log")) set_string(&settings.job_log, value, 1);
+    else if (!strcmp(key, "adapt_interval")) settings.adapt_interval = atoi(value);
+    else if (!strcmp(key, "cpu_budget")) settings.cpu_budget = atof(value);
+    else if (!strcmp(key, "affinity")) settings.affinity = atoi(value);
+    else if (!strcmp(key, "prefetch_size")) settings.prefetch_size = parse_size(value);
+    else if (!strcmp(key, "preallocate")) settings.preallocate = atoi(value);
+    else if (!strcmp(key, "window_decoder")) set_string(&settings.window_decoder, value, 1);
+    else if (!strcmp(key, "preview_slots")) settings.preview_slots = atoi(value);
+    else if (!strcmp(key, "max_queue")) settings.max_queue = atoi(value);
+    else if (!strcmp(key, "journal")) set_string(&settings.journal, value, 1);
+    else if (!strcmp(key, "coordinator")) set_string(&settings.coordinator, value, 1);
+    else if (!strcmp(key, "socket")) {
+        // The files named after the socket follow it, unless they were set
+        char * path;
+        set_string(&settings.socket, value, 0);
+        if (settings.metrics_file && !strcmp(settings.metrics_file, MAIN_SOCKET ".metrics") && asprintf(&path, "%s.metrics", value) >= 0) {
+            free(settings.metrics_file);
+            settings.metrics_file = path;
+        }
+        if (settings.journal && !strcmp(settings.journal, MAIN_SOCKET ".journal") && asprintf(&path, "%s.journal", value) >= 0) {
+            free(settings.journal);
+            settings.journal = path;
+        }
+    }
+    else if (!strcmp(key, "cache_key")) {
+        if (!strcmp(value, "content")) settings.cache_by_content = 1;
+        else if (!strcmp(value, "stat")) settings.cache_by_content = 0;
+        else ret = -1;
+    }
+    else ret = -1;
+
+    return ret;
+
+}
+
+/**
+ * @brief Resident process that runs the stages of one filter, one at a time, so they don't pay for a fork and exec
+*/
+typedef struct worker {
+
+    pid_t pid; // 0 if it isn't running
+    int fd; // Control socket, -1 if it isn't running
+    struct requests * r; // Request whose stage it runs, NULL while idle
+    int stage; // Index of the stage in the request
+    int stale; // If true, its filter changed on a reload and it's closed once its job ends
+
+} WORKER;
+
+/**
+ * @brief Struct with information for each filter 
+*/
+typedef struct filter {
+
+    char * filter_name;
+    char * filter_path;
+    int max; // Most instances it can run, the ceiling of its limit
+    int floor; // Fewest instances its limit goes down to
+    int limit; // Instances it's allowed to run at the moment, adjusted to the load of the host
+    int completed; // Stages that ended since the limit was last adjusted
+    double rate; // Stages that ended per second, smoothed over the last adjustments
+    int grew; // If true, the limit was raised in the last adjustment
+    int removed; // If true, it left the config file on a reload and only requests that have it use it
+    double cost; // Cores a stage of the filter takes, against the budget
+    EFFECT effect; // What the filter does, for the built-in engine
+    int builtin; // If true, the filter runs in the built-in engine instead of its executable
+    int raw_io; // If true, the executable reads and writes a raw PCM stream
+    char * commutes; // Names of the filters it can swap places with, separated by '|', or "*"
+    unsigned long long commutes_mask; // Same filters, as a bit per id
+    int persistent; // If true, the executable follows the persistent filter protocol of protocol.h
+    WORKER * workers; // Pool of workers, NULL if the filter doesn't use one
+    int n_workers; // Slots of the pool, which only grows
+
+} FILTER;
+
+/**
+ * @brief Registry of the filters, each one identified by its position in the arrays
+*/
+typedef struct filters {
+
+    FILTER filter[MAX_FILTERS];
+    int usage[MAX_FILTERS];
+    int reserved[MAX_FILTERS]; // Instances held for a starving request during a dispatch
+    double cost_used; // Cores taken by the filters of the running stages
+    double cost_reserved; // Cores held for starving requests during a dispatch
+    int n_filters;
+    int buckets[FILTER_BUCKETS]; // Hash table from the name to the id of a filter, plus 1
+
+}* FILTERS;
+
+/**
+ * @brief Hashes the name of a filter (FNV-1a)
+ * @param filter_name Name of the filter
+ * @return Hash of the name
+*/
+unsigned int hash_filter(char * filter_name) {
+
+    unsigned int hash = 2166136261u;
+    for (; *filter_name; filter_name++) {
+        hash ^= (unsigned char) *filter_name;
+        hash *= 16777619u;
+    }
+
+    return hash;
+
+}
+
+/**
+ * @brief Returns the id of a filter from its name
+ * @param filters Struct with all the filters
+ * @param filter_name Name of the filter
+ * @return Id of the filter, or -1 if it doesn't exist
+*/
+int filter_id(FILTERS filters, char * filter_name) {
+
+    // Linear probing until the filter or an empty bucket is found
+    unsigned int bucket = hash_filter(filter_name) & (FILTER_BUCKETS - 1);
+    for (; filters->buckets[bucket]; bucket = (bucket + 1) & (FILTER_BUCKETS - 1)) {
+
+        int id = filters->buckets[bucket] - 1;
+        if (!strcmp(filter_name, filters->filter[id].filter_name)) return id;
+
+    }
+
+    return -1;
+
+}
+
+/**
+ * @brief Adds a filter to the struct of filters
+ * @param f Struct to add to
+ * @param filter_name Name of the filter
+ * @param filter_path Path to the executable of the filter
+ * @param max Maximum of instances of usage of the filter 
+ * @return Id of the filter, or -1 if it can't be added
+*/
+int add_filter(FILTERS f, char * filter_name, char * filter_path, int max) {
+
+    if (f->n_filters == MAX_FILTERS || filter_id(f, filter_name) >= 0) return -1;
+
+    int id = f->n_filters++;
+    f->filter[id].filter_name = strdup(filter_name);
+    f->filter[id].filter_path = strdup(filter_path);
+
+    f->filter[id].max = max;
+    f->filter[id].floor = 1;
+    f->filter[id].limit = max;
+    f->filter[id].completed = 0;
+    f->filter[id].rate = 0;
+    f->filter[id].grew = 0;
+    f->filter[id].removed = 0;
+    f->filter[id].cost = 1;
+    f->filter[id].effect.type = EFFECT_NONE;
+    f->filter[id].builtin = 0;
+    f->filter[id].raw_io = 0;
+    f->filter[id].commutes = NULL;
+    f->filter[id].commutes_mask = 0;
+    f->filter[id].persistent = 0;
+    f->filter[id].workers = NULL;
+    f->filter[id].n_workers = 0;
+    f->usage[id] = 0;
+    f->reserved[id] = 0;
+
+    // Places the filter in the first empty bucket
+    unsigned int bucket = hash_filter(filter_name) & (FILTER_BUCKETS - 1);
+    while (f->buckets[bucket]) bucket = (bucket + 1) & (FILTER_BUCKETS - 1);
+    f->buckets[bucket] = id + 1;
+
+    return id;
+
+}
+
+/**
+ * @brief Sets an option given after the maximum of a filter in the config file
+ * @param f Struct with the filters
+ * @param id Id of the filter
+ * @param option Option, as "key=value"
+ * @return 0 if set, -1 if invalid
+*/
+int set_filter_option(FILTERS f, int id, char * option) {
+
+    FILTER * filter = &f->filter[id];
+    char * value = strchr(option, '=');
+    if (!value) return -1;
+    *value++ = '\0';
+
+    int ret = 0;
+    if (!strcmp(option, "engine")) {
+
+        if (!strcmp(value, "builtin")) filter->builtin = 1;
+        else if (!strcmp(value, "external")) filter->builtin = 0;
+        else ret = -1;
+
+    }
+    else if (!strcmp(option, "io")) {
+
+        if (!strcmp(value, "raw")) filter->raw_io = 1;
+        else if (!strcmp(value, "encoded")) filter->raw_io = 0;
+        else ret = -1;
+
+    }
+    else if (!strcmp(option, "persistent")) {
+
+        if (!strcmp(value, "yes")) filter->persistent = 1;
+        else if (!strcmp(value, "no")) filter->persistent = 0;
+        else ret = -1;
+
+    }
+    else if (!strcmp(option, "commutes")) {
+        free(filter->commutes);
+        filter->commutes = strdup(value);
+    }
+    else if (!strcmp(option, "min")) filter->floor = atoi(value);
+    else if (!strcmp(option, "cost")) {
+        filter->cost = atof(value);
+        if (filter->cost < 0) ret = -1;
+    }
+    else ret = dsp_parse_effect(&filter->effect, option, value);
+
+    return ret;
+
+}
+
+/**
+ * @brief Keeps the limit of a filter between its floor and its maximum, or at its maximum if limits aren't adjusted
+ * @param filter Filter
+*/
+void clamp_limit(FILTER * filter) {
+
+    if (filter->floor < 1) filter->floor = 1;
+    if (filter->floor > filter->max) filter->floor = filter->max;
+
+    if (!settings.adapt_interval || filter->limit > filter->max) filter->limit = filter->max;
+    if (filter->limit < filter->floor) filter->limit = filter->floor;
+
+}
+
+/**
+ * @brief Resolves the names of the filters each filter commutes with, once all of them exist
+ * @param f Struct with the filters
+*/
+void resolve_commutes(FILTERS f) {
+
+    for (int id = 0; id < f->n_filters; id++) {
+
+        f->filter[id].commutes_mask = 0;
+        if (!f->filter[id].commutes) continue;
+        if (!strcmp(f->filter[id].commutes, "*")) {
+            f->filter[id].commutes_mask = ~0ULL;
+            continue;
+        }
+
+        // The names are kept, so they're resolved again on a reload
+        char * commutes = strdup(f->filter[id].commutes), * save;
+        for (char * name = strtok_r(commutes, "|", &save); name; name = strtok_r(NULL, "|", &save)) {
+            int other = filter_id(f, name);
+            if (other >= 0 && !f->filter[other].removed) f->filter[id].commutes_mask |= 1ULL << other;
+            else fprintf(stderr, "Filter %s: commutes with unknown filter %s\n", f->filter[id].filter_name, name);
+        }
+        free(commutes);
+
+    }
+
+}
+
+/**
+ * @brief Configures the server with the config file and the path to the filters_folder
+ * @param config_filename File with the information necessary
+ * @param filters_folder Path to the filters folder
+ * @returns Struct with the filters struct configured, NULL if the config file can't be read
+*/
+FILTERS configure(char * config_filename, char * filters_folder) {
+
+    // Open the configuration file
+    int fd = open(config_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("open");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    // Reads the whole file, so no line is split between reads
+    char * buffer = malloc(st.st_size + 1);
+    ssize_t total = 0, bytes_read;
+    while (total < st.st_size && (bytes_read = read(fd, buffer + total, st.st_size - total)) > 0)
+        total += bytes_read;
+    buffer[total] = '\0';
+    close(fd);
+
+    FILTERS f = calloc(1, sizeof(struct filters));
+    char * save_line, * save; // Necessary for strtok_r usage
+    for (char * line = strtok_r(buffer, "\n", &save_line); line; line = strtok_r(NULL, "\n", &save_line)) {
+
+        // Lines like "key=value" are settings of the server
+        char * value = strchr(line, '=');
+        if (value && value < line + strcspn(line, " ")) {
+            *value++ = '\0';
+            if (set_setting(line, value) < 0) fprintf(stderr, "Unknown setting %s\n", line);
+            continue;
+        }
+
+        char * filter_name = strtok_r(line, " ", &save);
+        char * filter_executable = strtok_r(NULL, " ", &save);
+        char * filter_max = strtok_r(NULL, " ", &save);
+        if (!filter_name || !filter_executable || !filter_max) continue;
+
+        // Adds a filter to the struct
+        char filter_path[MAX];
+        snprintf(filter_path, MAX, "%s/%s", filters_folder, filter_executable);
+        int id = add_filter(f, filter_name, filter_path, atoi(filter_max));
+        if (id < 0) {
+            fprintf(stderr, "Filter %s: duplicated or too many filters\n", filter_name);
+            continue;
+        }
+
+        for (char * option = strtok_r(NULL, " ", &save); option; option = strtok_r(NULL, " ", &save))
+            if (set_filter_option(f, id, option) < 0)
+                fprintf(stderr, "Filter %s: invalid option %s\n", filter_name, option);
+
+        // Only filters with a known effect can run in the built-in engine
+        if (f->filter[id].builtin && f->filter[id].effect.type == EFFECT_NONE) {
+            fprintf(stderr, "Filter %s: no effect for the built-in engine, using %s\n", filter_name, f->filter[id].filter_path);
+            f->filter[id].builtin = 0;
+        }
+
+    }
+
+    free(buffer);
+
+    // Limits start at a filter per core, which the load of the host then adjusts
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int id = 0; id < f->n_filters; id++) {
+        f->filter[id].limit = cores;
+        clamp_limit(&f->filter[id]);
+    }
+    resolve_commutes(f);
+
+    return f;
+}
+
+/**
+ * @brief Gets if the stages of a filter run in its pool of workers
+ * @param filter Filter
+*/
+int pooled(FILTER * filter) {
+
+    return settings.worker_pool && (filter->builtin || filter->persistent);
+
+}
+
+/**
+ * @brief Frees a filters struct
+ * @param filters Struct with the filters
+*/
+void free_filters(FILTERS filters) {
+
+    for (int i = 0; i < filters->n_filters; i++) {
+
+        free(filters->filter[i].filter_name);
+        free(filters->filter[i].filter_path);
+        free(filters->filter[i].commutes);
+
+        // Workers exit once their control socket ends
+        WORKER * workers = filters->filter[i].workers;
+        for (int j = 0; workers && j < filters->filter[i].n_workers; j++)
+            if (workers[j].fd >= 0) close(workers[j].fd);
+        free(workers);
+
+    }
+    free(filters);
+
+}
+
+/**
+ * @brief Kinds of process in a pipeline
+*/
+typedef enum stage_type {
+
+    STAGE_EXTERNAL, // Executable of a filter
+    STAGE_BUILTIN, // Consecutive filters applied by the built-in engine
+    STAGE_DECODER, // Starts a raw part of the pipeline
+    STAGE_ENCODER, // Ends a raw part of the pipeline
+    STAGE_TAP, // Passes the stream on, keeping a copy in the prefix cache
+    STAGE_SLICE, // Reads the range of a segment from the decoded source
+    STAGE_STITCH, // Joins the outputs of the segments and encodes them
+    STAGE_WINDOW, // Cuts the window of a preview, with its lead-in, from the decoded source
+    STAGE_TRIM, // Leaves out the output of the lead-in of a preview
+    STAGE_FANOUT // Copies the stream to every branch that starts where its own ends
+
+} STAGE_TYPE;
+
+/**
+ * @brief Process of a pipeline and the filters it applies
+*/
+typedef struct stage {
+
+    STAGE_TYPE type;
+    int first; // Index in the chain of the first filter of the stage
+    int last; // Index in the chain after its last filter
+    int raw; // If true, the stage reads and writes raw PCM
+    pid_t pid; // 0 once it was collected
+    int status; // Exit status, once it was collected
+    double seconds; // Seconds since the pipeline started until the stage ended
+    int tapped; // If true, the stage writes a new entry of the prefix cache
+    double cost; // Cores its filters take against the budget while it runs
+    int worker; // If true, it runs as a job of a worker, outside the process group of its request
+
+} STAGE;
+
+/**
+ * @brief Part of a long source that runs as its own pipeline, in frames of the decoded source
+*/
+typedef struct segment {
+
+    long long from; // First frame read, before the segment starts to warm up the filters
+    long long to; // Frame after the last one read
+    long long skip; // Output frames of the warm-up, left out
+    long long keep; // Output frames of the segment itself, -1 for all of them
+    int overlap; // Output frames after the kept ones crossfaded with the next segment, 0 for an exact join
+
+} SEGMENT;
+
+/**
+ * @brief Part of the tree of a request with several outputs: filters applied after the ones of its parent,
+ * ending in an output or in a fan-out to the branches that start from it
+*/
+typedef struct branch {
+
+    int first; // Index in the chain of its first filter
+    int last; // Index in the chain after its last filter
+    int parent; // Index of the branch it starts from, -1 for the trunk
+    char * output_path; // Output it ends in, NULL if it fans out
+    int fd_output; // That output while the request is handled, -1 otherwise
+    int first_stage; // Index of its first stage, once planned
+    int n_stages; // Stages of its own, including the fan-out
+
+} BRANCH;
+
+/**
+ * @brief Output a client asked for and the filters that produce it, before the outputs are made a tree
+*/
+typedef struct variant {
+
+    char * output;
+    int n_filters;
+    int chain[MAX_CHAIN];
+
+} VARIANT;
+
+/**
+ * @brief Connection of a client. It stays open while the client sends messages and while any of its
+ * requests has replies left
+*/
+typedef struct connections {
+
+    int fd;
+    int refs; // Requests that reply through the connection, plus one while it's read
+    pid_t client; // Pid of the client, used for fair share
+    int fd_directory; // Directory that the names the client sends are relative to, -1 if it sent none
+    char * instance; // Socket of the instance or coordinator at the other end, NULL for a client
+    char buffer[sizeof(MESSAGE_HEADER) + PROTOCOL_MAX_PAYLOAD]; // Bytes that don't make a whole message yet
+    size_t used;
+    int fds[PROTOCOL_MAX_FDS]; // Descriptors received that no message took yet
+    int n_fds;
+    struct connections * next;
+
+} *CONNECTION;
+
+CONNECTION coordinator = NULL; // Connection to the coordinator, NULL if the instance doesn't share its work
+
+/**
+ * @brief Releases a reference to a connection, which is closed with the last one
+ * @param c Connection
+*/
+void release_connection(CONNECTION c) {
+
+    if (--c->refs) return;
+
+    close(c->fd);
+    free(c->instance);
+    if (c->fd_directory >= 0) close(c->fd_directory);
+    for (int i = 0; i < c->n_fds; i++) close(c->fds[i]);
+    free(c);
+
+}
+
+/**
+ * @brief Struct that hold the information about the requests in the server
+*/
+typedef struct requests {
+
+    ARENA arena; // Memory of its paths, filter names, tree and segments, released at once when it ends
+    char * source_path;
+    char * output_path;
+    pid_t client; // Pid of the client, used for fair share
+    int fd_source; // Source and output the client sent, -1 for segments, which use their paths
+    int fd_output;
+    int by_name; // If true, the client sent the paths of the files, opened while the request is handled
+    int priority;
+    struct timespec arrival;
+    double deadline; // Seconds after its arrival when it's dropped if it didn't end, 0 for none
+    int task;
+    int n_typed;
+    int typed[MAX_CHAIN]; // Id of each filter, as the client sent them
+    int n_filters;
+    int chain[MAX_CHAIN]; // Id of each filter that is applied, after the chain is optimized
+    int n_branches;
+    BRANCH * branches; // Tree whose branches hold ranges of the chain, for several outputs. NULL for one output
+    int n_uses;
+    int uses[MAX_CHAIN][2]; // Each distinct filter of the chain and how many stages use it
+    int n_stages;
+    STAGE stages[MAX_STAGES];
+    int first; // Index in the chain where the pipeline starts, after a cached prefix
+    char prefix_keys[MAX_CHAIN][CACHE_KEY_SIZE]; // Key of the stream after each prefix, empty if there's no stage boundary
+    int prefix_raw[MAX_CHAIN]; // If true, the stream after the prefix is raw PCM
+    unsigned int prefix_generation; // Generation of the prefix cache when the prefix was searched
+    struct timespec admitted; // Zero until the request is taken from the pending requests
+    struct timespec started; // Zero until the request starts
+    struct timespec spawned; // Zero until its stages were started
+    USAGE usage; // Resources of the stages that ended, and of its segments
+    int stages_run; // Stages that ended, and of its segments
+    long long bytes_in; // Size of the source, -1 if it isn't a regular file
+    long long prefetched; // Bytes of the source read ahead while it waited, 0 if none
+    int preallocated; // If true, its output was preallocated and is trimmed to what was written once it ends
+    int preview; // If true, only a window of the source is transformed, and it's admitted as a preview
+    double start; // Window of a preview in seconds of the source, with a duration of 0 until its end
+    double duration;
+    SEGMENT window; // The same window in frames of the decoded source, with the lead-in of the filters, once planned
+    char * chain_name; // Names of the filters the client asked for, for the metrics
+    cpu_set_t cpus; // Cores its stages are pinned to
+    int domain; // Domain of those cores, -1 if its stages aren't pinned
+    int running; // Number of stages still running
+    int failed; // If true, a stage couldn't start or ended with an error
+    int exit_status; // Of the first stage that failed, 128 plus the signal if one killed it
+    int cancelled; // If true, the client cancelled the request, or it was dropped
+    int expired; // If true, it was dropped because its deadline passed
+    int rejected; // If true, it arrived when the queue was full
+    pid_t pgid; // Process group of the stages it started itself, 0 until the first one starts
+    int journaled; // If true, the journal has it until it ends
+    int replayed; // If true, it was rebuilt from the journal when the server started
+    CONNECTION peer; // Instance it was lent to, NULL while it's handled here
+    char key[CACHE_KEY_SIZE]; // Key of the output in the cache, empty without cache
+    struct requests * followers; // Identical requests waiting for this one to end
+    struct requests * parent; // Request this one is a segment of, NULL otherwise
+    int segment; // Index of the segment in its parent
+    int n_segments; // Segments the request is split in, 0 if it runs as a single pipeline
+    int segments_left; // Segments that didn't end yet
+    SEGMENT * segments; // Range of each segment, once the source is decoded
+    CONNECTION connection; // Connection the replies go to, NULL for segments
+    uint32_t tag; // Identifier the client gave the request
+    struct requests * next;
+
+} *REQUEST;
+
+REQUEST lent = NULL; // Requests lent to other instances, until they end there
+REQUEST pool = NULL; // Requests that ended, whose memory the next ones reuse
+int n_pooled = 0;
+int n_requests = 0; // Requests and segments in memory, whatever their state
+
+/**
+ * @brief Adds a branch to the tree of a request, with the filters that all its variants apply next, and then
+ * the branches of the variants that go on: one per filter they continue with, plus one per variant that ends
+ * there. The chain gets the filters of each branch in the order they are added, parents first
+ * @param r Request
+ * @param variants Outputs the client asked for
+ * @param members Indexes of the variants that share the branch
+ * @param n Number of variants that share it
+ * @param depth Filters of the variants before the branch
+ * @param parent Index of the branch it starts from, -1 for the trunk
+ * @return 0 on success, -1 if the tree doesn't fit in the request
+*/
+int grow_branch(REQUEST r, VARIANT variants[], int members[], int n, int depth, int parent) {
+
+    if (r->n_branches == MAX_BRANCHES) return -1;
+
+    int b = r->n_branches++;
+    BRANCH * branch = &r->branches[b];
+    branch->first = r->n_filters;
+    branch->parent = parent;
+    branch->output_path = n == 1 ? arena_strdup(r->arena, variants[members[0]].output) : NULL;
+    branch->fd_output = -1;
+    branch->first_stage = 0;
+    branch->n_stages = 0;
+
+    int shared = 1;
+    while (shared) {
+        VARIANT * v = &variants[members[0]];
+        for (int i = 0; shared && i < n; i++)
+            shared = depth < variants[members[i]].n_filters && variants[members[i]].chain[depth] == v->chain[depth];
+        if (shared && r->n_filters == MAX_CHAIN) return -1;
+        if (shared) r->chain[r->n_filters++] = v->chain[depth++];
+    }
+    branch->last = r->n_filters;
+
+    for (int i = 0; n > 1 && i < n; i++) {
+
+        VARIANT * v = &variants[members[i]];
+        if (depth == v->n_filters) {
+            if (grow_branch(r, variants, &members[i], 1, depth, b) < 0) return -1;
+            continue;
+        }
+
+        // The variants that go on with the same filter are grouped with the first of them
+        int group[n], size = 0, seen = 0;
+        for (int j = 0; j < n; j++) {
+            VARIANT * other = &variants[members[j]];
+            if (depth == other->n_filters || other->chain[depth] != v->chain[depth]) continue;
+            if (j < i) seen = 1;
+            group[size++] = members[j];
+        }
+        if (!seen && grow_branch(r, variants, group, size, depth, b) < 0) return -1;
+
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Takes a request from the pool, or allocates one with its arena if the pool is empty.
+ * Only its arena is set
+ * @return The request
+*/
+REQUEST alloc_request() {
+
+    REQUEST r = pool;
+    if (r) {
+        pool = r->next;
+        n_pooled--;
+    }
+    else {
+        r = malloc(sizeof(struct requests));
+        r->arena = arena_new(REQUEST_ARENA);
+    }
+    n_requests++;
+
+    return r;
+
+}
+
+/**
+ * @brief Creates a request from a transform message sent by a client
+ * @param fields Strings of the message: source, output, priority, window, deadline and the filters, then the other outputs
+ * @param n_fields Number of strings, at least TRANSFORM_FILTERS
+ * @param filters Struct with the filters
+ * @return The new request, without filters if it's invalid
+*/
+REQUEST new_request(char * fields[], int n_fields, FILTERS filters) {
+
+    REQUEST r = alloc_request();
+
+    r->source_path = arena_strdup(r->arena, fields[0]);
+    r->output_path = arena_strdup(r->arena, fields[1]);
+    r->client = 0;
+    r->task = task++;
+    r->fd_source = -1;
+    r->fd_output = -1;
+    r->by_name = 0;
+    r->running = 0;
+    r->failed = 0;
+    r->exit_status = 0;
+    r->cancelled = 0;
+    r->expired = 0;
+    r->rejected = 0;
+    r->pgid = 0;
+    r->journaled = 0;
+    r->replayed = 0;
+    r->peer = NULL;
+    memset(&r->admitted, 0, sizeof(r->admitted));
+    memset(&r->started, 0, sizeof(r->started));
+    memset(&r->spawned, 0, sizeof(r->spawned));
+    memset(&r->usage, 0, sizeof(r->usage));
+    r->stages_run = 0;
+    r->bytes_in = -1;
+    r->prefetched = 0;
+    r->preallocated = 0;
+    CPU_ZERO(&r->cpus);
+    r->domain = -1;
+    r->first = 0;
+    r->key[0] = '\0';
+    memset(r->prefix_keys, 0, sizeof(r->prefix_keys));
+    r->prefix_generation = 0;
+    r->followers = NULL;
+    r->parent = NULL;
+    r->n_segments = 0;
+    r->segments_left = 0;
+    r->segments = NULL;
+    r->connection = NULL;
+    r->tag = 0;
+    r->next = NULL;
+
+    // The priority is limited to the valid levels
+    r->priority = atoi(fields[2]);
+    if (r->priority < 0) r->priority = 0;
+    if (r->priority > MAX_PRIORITY) r->priority = MAX_PRIORITY;
+
+    // A window, as "start:duration", makes the request a preview
+    char * duration = strchr(fields[3], ':');
+    r->start = atof(fields[3]);
+    r->duration = duration ? atof(duration + 1) : 0;
+    if (r->start < 0) r->start = 0;
+    if (r->duration < 0) r->duration = 0;
+    r->preview = r->start > 0 || r->duration > 0;
+    memset(&r->window, 0, sizeof(r->window));
+
+    r->deadline = atof(fields[4]);
+    if (r->deadline < 0) r->deadline = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &r->arrival);
+
+    // Compiles the chain to filter ids once. The chains of other outputs are separated by " | " in its name
+    int length = 0;
+    for (int i = TRANSFORM_FILTERS; i < n_fields; i++) length += strlen(fields[i]) + 2;
+    r->chain_name = arena_alloc(r->arena, length + 1);
+    r->chain_name[0] = '\0';
+    for (int i = TRANSFORM_FILTERS; i < n_fields; i++) {
+        if (i > TRANSFORM_FILTERS) strcat(r->chain_name, " ");
+        if (!*fields[i]) {
+            strcat(r->chain_name, "|");
+            i++;
+        }
+        else strcat(r->chain_name, fields[i]);
+    }
+    r->n_typed = 0;
+    r->n_uses = 0;
+    r->n_stages = 0;
+    r->n_branches = 0;
+    r->branches = NULL;
+
+    VARIANT variants[PROTOCOL_MAX_OUTPUTS];
+    int n_variants = 1, valid = 1;
+    variants[0].output = fields[1];
+    variants[0].n_filters = 0;
+    for (int i = TRANSFORM_FILTERS; valid && i < n_fields; i++) {
+
+        // Another output, which needs a name and filters like the first one
+        if (!*fields[i]) {
+            valid = n_variants < PROTOCOL_MAX_OUTPUTS && i + 1 < n_fields && *fields[i + 1] && variants[n_variants - 1].n_filters;
+            if (!valid) fprintf(stderr, "Task #%d: too many outputs or an output without filters\n", r->task);
+            variants[n_variants].output = fields[++i];
+            variants[n_variants++].n_filters = 0;
+            continue;
+        }
+
+        char * filter = fields[i];
+        int id = filter_id(filters, filter);
+        VARIANT * v = &variants[n_variants - 1];
+        if (id < 0 || filters->filter[id].removed || v->n_filters == MAX_CHAIN) {
+            fprintf(stderr, "Task #%d: unknown filter or too many filters at \"%s\"\n", r->task, filter);
+            valid = 0;
+        }
+        else v->chain[v->n_filters++] = id;
+
+    }
+
+    if (valid && n_variants > 1 && r->preview) {
+        fprintf(stderr, "Task #%d: previews have a single output\n", r->task);
+        valid = 0;
+    }
+
+    if (valid && n_variants == 1) {
+        memcpy(r->typed, variants[0].chain, variants[0].n_filters * sizeof(int));
+        r->n_typed = variants[0].n_filters;
+    }
+    else if (valid && variants[n_variants - 1].n_filters) {
+
+        // Several outputs make a tree, whose filters are the chain and run as they were sent
+        int members[PROTOCOL_MAX_OUTPUTS];
+        for (int i = 0; i < n_variants; i++) members[i] = i;
+        r->branches = arena_alloc(r->arena, MAX_BRANCHES * sizeof(BRANCH));
+        r->n_filters = 0;
+        if (grow_branch(r, variants, members, n_variants, 0, -1) == 0) {
+            memcpy(r->typed, r->chain, r->n_filters * sizeof(int));
+            r->n_typed = r->n_filters;
+        }
+        else fprintf(stderr, "Task #%d: the outputs need more than %d filters\n", r->task, MAX_CHAIN);
+
+    }
+
+    // Until it's optimized, the chain is applied as it was sent
+    memcpy(r->chain, r->typed, r->n_typed * sizeof(int));
+    r->n_filters = r->n_typed;
+
+    return r;
+}
+
+/**
+ * @brief Counts the stages of each distinct filter of the chain of a request, after its cached prefix
+ * @param r Request
+*/
+void count_uses(REQUEST r) {
+
+    r->n_uses = 0;
+    for (int j = r->first; j < r->n_filters; j++) {
+
+        int id = r->chain[j], i;
+        for (i = 0; i < r->n_uses && r->uses[i][0] != id; i++);
+        if (i == r->n_uses) {
+            r->uses[r->n_uses][0] = id;
+            r->uses[r->n_uses++][1] = 0;
+        }
+        r->uses[i][1]++;
+
+    }
+
+}
+
+/**
+ * @brief Gets if two factors are equal, within FACTOR_TOLERANCE
+*/
+int same_factor(double a, double b) {
+
+    return fabs(a - b) <= FACTOR_TOLERANCE * fabs(b);
+
+}
+
+/**
+ * @brief Gets the factor a filter applies, if it's of the given kind
+ * @param filter Filter
+ * @param type EFFECT_GAIN or EFFECT_TEMPO
+ * @return Factor, or 0 if the filter isn't of that kind
+*/
+double filter_factor(FILTER * filter, EFFECT_TYPE type) {
+
+    if (filter->effect.type != type) return 0;
+
+    return type == EFFECT_GAIN ? filter->effect.gain : filter->effect.tempo;
+
+}
+
+/**
+ * @brief Gets if two filters give the same result in either order, as declared in the config file
+*/
+int filters_commute(FILTERS filters, int a, int b) {
+
+    return (filters->filter[a].commutes_mask >> b & 1) || (filters->filter[b].commutes_mask >> a & 1);
+
+}
+
+/**
+ * @brief Removes filters from the chain of a request
+ * @param r Request
+ * @param i Index of the first filter to remove
+ * @param n Number of filters to remove
+*/
+void remove_filters(REQUEST r, int i, int n) {
+
+    memmove(r->chain + i, r->chain + i + n, (r->n_filters - i - n) * sizeof(int));
+    r->n_filters -= n;
+
+}
+
+/**
+ * @brief Gets the samples a filter of the chain of a request would process at another place of the chain,
+ * relative to those of the source: the speed-ups before it make them fewer, the slow-downs more
+ * @param r Request
+ * @param filters Struct with the filters
+ * @param i Index of the filter
+ * @param place Index the filter would have once moved there
+ * @return Samples per sample of the source
+*/
+double samples_at(REQUEST r, FILTERS filters, int i, int place) {
+
+    double samples = 1;
+    for (int j = 0; j < (place > i ? place + 1 : place); j++) {
+        double tempo = j == i ? 0 : filter_factor(&filters->filter[r->chain[j]], EFFECT_TEMPO);
+        if (tempo) samples /= tempo;
+    }
+
+    return samples;
+
+}
+
+/**
+ * @brief Simplifies the chain of a request with the factors and commutations declared for the filters:
+ * gains and tempo changes that undo each other are dropped, consecutive ones are folded into a filter
+ * with their product when one exists, and gains move, across the filters they commute with, to where
+ * they process the fewest samples
+ * @param r Request
+ * @param filters Struct with the filters
+*/
+void optimize_chain(REQUEST r, FILTERS filters) {
+
+    EFFECT_TYPE kinds[] = { EFFECT_GAIN, EFFECT_TEMPO };
+    int changed = 1;
+
+    // Each change drops a filter or makes a gain process fewer samples, so no change is undone
+    while (changed) {
+
+        changed = 0;
+
+        // Filters that do nothing are dropped
+        for (int i = 0; i < r->n_filters; i++)
+            for (int k = 0; k < 2; k++)
+                if (same_factor(filter_factor(&filters->filter[r->chain[i]], kinds[k]), 1)) {
+                    remove_filters(r, i--, 1);
+                    changed = 1;
+                    break;
+                }
+
+        // Consecutive filters of the same kind are folded
+        for (int i = 0; i + 1 < r->n_filters; i++)
+            for (int k = 0; k < 2; k++) {
+
+                double a = filter_factor(&filters->filter[r->chain[i]], kinds[k]);
+                double b = filter_factor(&filters->filter[r->chain[i + 1]], kinds[k]);
+                if (!a || !b) continue;
+
+                if (same_factor(a * b, 1)) {
+                    remove_filters(r, i, 2);
+                    changed = 1;
+                    break;
+                }
+
+                int id;
+                for (id = 0; id < filters->n_filters; id++)
+                    if (!filters->filter[id].removed && same_factor(filter_factor(&filters->filter[id], kinds[k]), a * b)) break;
+                if (id < filters->n_filters) {
+                    r->chain[i] = id;
+                    remove_filters(r, i + 1, 1);
+                    changed = 1;
+                    break;
+                }
+
+            }
+
+        // A gain only moves to a place where it processes clearly fewer samples, the nearest of the best ones
+        for (int i = 0; !changed && i < r->n_filters; i++) {
+
+            int gain = r->chain[i];
+            if (!filter_factor(&filters->filter[gain], EFFECT_GAIN)) continue;
+
+            int first = i, last = i;
+            while (first > 0 && filters_commute(filters, gain, r->chain[first - 1])) first--;
+            while (last + 1 < r->n_filters && filters_commute(filters, gain, r->chain[last + 1])) last++;
+
+            double current = samples_at(r, filters, i, i), least = current;
+            int best = i;
+            for (int place = first; place <= last; place++) {
+                double samples = samples_at(r, filters, i, place);
+                if (samples >= current * (1 - FACTOR_TOLERANCE)) continue;
+                if (best == i || (same_factor(samples, least) ? abs(place - i) < abs(best - i) : samples < least)) {
+                    best = place;
+                    least = samples;
+                }
+            }
+
+            if (best > i) memmove(r->chain + i, r->chain + i + 1, (best - i) * sizeof(int));
+            if (best < i) memmove(r->chain + best + 1, r->chain + best, (i - best) * sizeof(int));
+            r->chain[best] = gain;
+            changed = best != i;
+
+        }
+
+    }
+
+}
+
+/**
+ * @brief Adds a request to the requests struct
+ * @param r Struct with the requests
+ * @param new Request to append
+*/
+void add_request(REQUEST * r, REQUEST new) {
+
+    // Appends the request
+    while (*r) r = &(*r)->next;
+    *r = new;
+
+}
+
+/**
+ * @brief Frees a request, whose memory goes back to the pool at once unless the pool is full
+ * @param r Request
+*/
+void free_request(REQUEST r) {
+
+    if (r->connection) release_connection(r->connection);
+    if (r->fd_source >= 0) close(r->fd_source);
+    if (r->fd_output >= 0) close(r->fd_output);
+    for (int b = 0; b < r->n_branches; b++)
+        if (r->branches[b].fd_output >= 0) close(r->branches[b].fd_output);
+
+    n_requests--;
+    if (n_pooled == MAX_POOLED) {
+        arena_free(r->arena);
+        free(r);
+        return;
+    }
+    arena_reset(r->arena);
+    r->next = pool;
+    pool = r;
+    n_pooled++;
+
+}
+
+/**
+ * @brief Gets the filters that produce an output of a request with several outputs, from the trunk of its tree
+ * @param r Request
+ * @param b Index of the branch that ends in the output
+ * @param path Where to place the index in the chain of each filter
+ * @return Number of filters
+*/
+int branch_path(REQUEST r, int b, int path[]) {
+
+    int n = 0;
+    for (int p = b; p >= 0; p = r->branches[p].parent) n += r->branches[p].last - r->branches[p].first;
+
+    // Each branch goes before the ones of its children
+    int end = n;
+    for (int p = b; p >= 0; p = r->branches[p].parent)
+        for (int i = r->branches[p].last - 1; i >= r->branches[p].first; i--) path[--end] = i;
+
+    return n;
+
+}
+
+/**
+ * @brief Describes what a task does, for the status
+ * @param r Request
+ * @param f Struct with the filters
+ * @param buffer Where to write the description
+ * @param size Size of the buffer
+*/
+void describe_task(REQUEST r, FILTERS f, char * buffer, int size) {
+
+    int length = 0;
+    buffer[0] = '\0';
+
+    if (r->parent) {
+        snprintf(buffer, size, "segment %d/%d", r->segment + 1, r->parent->n_segments);
+        return;
+    }
+
+    // Each output with its filters, and how many of them run once for several outputs
+    if (r->branches) {
+        int path[MAX_CHAIN * PROTOCOL_MAX_OUTPUTS], applied = 0;
+        length += snprintf(buffer + length, size - length, "transform %s", r->source_path);
+        for (int b = 0; b < r->n_branches && length < size; b++) {
+            if (!r->branches[b].output_path) continue;
+            int n = branch_path(r, b, path);
+            applied += n;
+            length += snprintf(buffer + length, size - length, "%s %s", applied > n ? " |" : "", r->branches[b].output_path);
+            for (int i = 0; i < n && length < size; i++)
+                length += snprintf(buffer + length, size - length, " %s", f->filter[r->chain[path[i]]].filter_name);
+        }
+        if (length < size) snprintf(buffer + length, size - length, " (shared: %d filters run for %d)", r->n_filters, applied);
+        return;
+    }
+
+    // The plan that runs when the chain was optimized
+    length += snprintf(buffer + length, size - length, "transform %s %s", r->source_path, r->output_path);
+    for (int i = 0; i < r->n_typed && length < size; i++)
+        length += snprintf(buffer + length, size - length, " %s", f->filter[r->typed[i]].filter_name);
+
+    int optimized = r->n_filters != r->n_typed || memcmp(r->chain, r->typed, r->n_filters * sizeof(int));
+    if (optimized && length < size) {
+        length += snprintf(buffer + length, size - length, " (plan:");
+        for (int i = 0; i < r->n_filters && length < size; i++)
+            length += snprintf(buffer + length, size - length, " %s", f->filter[r->chain[i]].filter_name);
+        if (!r->n_filters && length < size) length += snprintf(buffer + length, size - length, " transcode");
+        if (length < size) length += snprintf(buffer + length, size - length, ")");
+    }
+    if (r->preview && length < size)
+        length += snprintf(buffer + length, size - length, r->duration > 0 ? " (preview from %gs for %gs)" : " (preview from %gs)",
+                                                                          r->start, r->duration);
+    if (r->first && length < size)
+        length += snprintf(buffer + length, size - length, " (cached prefix: %d filters)", r->first);
+    if (r->n_segments && length < size)
+        snprintf(buffer + length, size - length, r->segments ? " (segments: %d/%d left)" : " (decoding to split in %d segments)",
+                                 r->segments ? r->segments_left : r->n_segments, r->n_segments);
+
+}
+
+/**
+ * @brief Lists a task in the status segment, if there's room for it
+ * @param r Request
+ * @param state TASK_STATE
+ * @param f Struct with the filters
+*/
+void publish_task(REQUEST r, TASK_STATE state, FILTERS f) {
+
+    if (status->n_tasks == STATUS_MAX_TASKS) return;
+
+    STATUS_TASK * t = &status->tasks[status->n_tasks++];
+    t->task = r->task;
+    t->state = state;
+    t->priority = r->priority;
+    t->arrival = r->arrival.tv_sec + r->arrival.tv_nsec / 1e9;
+    t->started = r->started.tv_sec + r->started.tv_nsec / 1e9;
+    t->domain = r->domain;
+    if (r->domain >= 0) topology_format(&r->cpus, t->cpus, STATUS_CPUS);
+    else t->cpus[0] = '\0';
+    describe_task(r, f, t->line, STATUS_LINE);
+
+}
+
+/**
+ * @brief Publishes the status of the server in its segment, where clients read it without a message
+ * @param pending Struct with the pending requests
+ * @param running Struct with the running requests
+ * @param f Struct with the filters
+*/
+void publish_status(REQUEST pending, REQUEST running, FILTERS f) {
+
+    status_begin(status);
+
+    status->n_running = status->n_waiting = status->n_tasks = 0;
+    for (REQUEST r = running; r; r = r->next, status->n_running++) publish_task(r, TASK_RUNNING, f);
+
+    int queued[MAX_FILTERS] = { 0 };
+    for (REQUEST r = pending; r; r = r->next, status->n_waiting++) {
+        publish_task(r, TASK_WAITING, f);
+        for (int i = 0; i < r->n_uses; i++) queued[r->uses[i][0]]++;
+    }
+
+    // Filters that left the config file aren't shown, even while requests still use them
+    status->budget = settings.cpu_budget;
+    status->budget_used = f->cost_used;
+    status->replay_seconds = recovery.seconds;
+    status->replayed = recovery.replayed;
+    status->resumed = recovery.resumed;
+    status->redone = recovery.redone;
+    struct mallinfo2 heap = mallinfo2();
+    status->n_requests = n_requests;
+    status->n_pooled = n_pooled;
+    status->heap = heap.uordblks + heap.hblkhd;
+    status->n_filters = 0;
+    for (int i = 0; i < f->n_filters; i++) {
+
+        if (f->filter[i].removed) continue;
+        STATUS_FILTER * filter = &status->filters[status->n_filters++];
+        snprintf(filter->name, STATUS_NAME, "%s", f->filter[i].filter_name);
+        filter->running = f->usage[i];
+        filter->limit = f->filter[i].limit;
+        filter->max = f->filter[i].max;
+        filter->queued = queued[i];
+        filter->warm = f->filter[i].workers && pooled(&f->filter[i]) ? 0 : -1;
+        for (int j = 0; filter->warm >= 0 && j < f->filter[i].n_workers; j++)
+            filter->warm += f->filter[i].workers[j].fd >= 0 && !f->filter[i].workers[j].stale;
+
+    }
+
+    int length = 0;
+    status->text[0] = '\0';
+    if (cache) length += cache_status(cache, "Cache", status->text, STATUS_TEXT);
+    if (prefixes && length < STATUS_TEXT) length += cache_status(prefixes, "Prefix cache", status->text + length, STATUS_TEXT - length);
+    int n_lent = 0;
+    for (REQUEST r = lent; r; r = r->next) n_lent++;
+    if (n_lent && length < STATUS_TEXT) snprintf(status->text + length, STATUS_TEXT - length, "Lent to other instances: %d jobs\n", n_lent);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    status->updated = now.tv_sec + now.tv_nsec / 1e9;
+
+    status_end(status);
+
+}
+
+/**
+ * @brief Closes the files of a request sent by name until it's handled again
+ * @param r Request
+*/
+void detach_files(REQUEST r) {
+
+    if (!r->by_name || r->fd_source < 0) return;
+
+    close(r->fd_source);
+    if (r->fd_output >= 0) close(r->fd_output);
+    r->fd_source = -1;
+    r->fd_output = -1;
+    for (int b = 0; b < r->n_branches; b++)
+        if (r->branches[b].fd_output >= 0) {
+            close(r->branches[b].fd_output);
+            r->branches[b].fd_output = -1;
+        }
+
+}
+
+/**
+ * @brief Opens the files of a request that the client sent by name, relative to the directory it sent, or as
+ * they are for one replayed from the journal. Such requests only hold their files while they're handled, so a
+ * batch that waits holds no descriptors
+ * @param r Request
+ * @return 0 on success, -1 on error
+*/
+int attach_files(REQUEST r) {
+
+    if (!r->by_name || r->fd_source >= 0) return 0;
+
+    int directory = r->connection ? r->connection->fd_directory : AT_FDCWD;
+    if ((r->fd_source = openat(directory, r->source_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(r->source_path);
+        return -1;
+    }
+
+    // A tree has an output at the end of some of its branches instead
+    for (int b = 0; b < r->n_branches; b++) {
+        BRANCH * branch = &r->branches[b];
+        if (!branch->output_path) continue;
+        if ((branch->fd_output = openat(directory, branch->output_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+            perror(branch->output_path);
+            detach_files(r);
+            return -1;
+        }
+    }
+    if (r->branches) return 0;
+
+    if ((r->fd_output = openat(directory, r->output_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        perror(r->output_path);
+        close(r->fd_source);
+        r->fd_source = -1;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Opens the source and the output of a request. The ones a client sent are duplicated,
+ * so the request keeps them if it runs again
+ * @param r Request
+ * @param fd_source Where to place the source
+ * @param fd_output Where to place the output, -1 for a tree, whose outputs stay in its branches
+ * @return 0 on success, -1 on error
+*/
+int open_files(REQUEST r, int * fd_source, int * fd_output) {
+
+    if (attach_files(r) < 0) return -1;
+    if (r->fd_source >= 0) {
+        *fd_source = fcntl(r->fd_source, F_DUPFD_CLOEXEC, 0);
+        *fd_output = r->branches ? -1 : fcntl(r->fd_output, F_DUPFD_CLOEXEC, 0);
+    }
+    else {
+        *fd_source = open(r->source_path, O_RDONLY | O_CLOEXEC);
+        *fd_output = open(r->output_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    }
+
+    if (*fd_source < 0 || (*fd_output < 0 && !r->branches)) {
+        perror("open source or output");
+        if (*fd_source >= 0) close(*fd_source);
+        if (*fd_output >= 0) close(*fd_output);
+        return -1;
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Asks the kernel to read the start of the source of a waiting request, so its first stage doesn't stall on
+ * the disk once it starts. A source sent by name is only opened for it
+ * @param r Request
+ * @param budget Bytes that can be read ahead
+ * @return Bytes asked for
+*/
+long long prefetch_source(REQUEST r, long long budget) {
+
+    if (r->parent || budget <= 0) return 0;
+
+    int fd = r->fd_source;
+    int directory = r->connection ? r->connection->fd_directory : AT_FDCWD;
+    if (fd < 0 && r->by_name) fd = openat(directory, r->source_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    long long bytes = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        bytes = st.st_size < budget ? st.st_size : budget;
+        if (posix_fadvise(fd, 0, bytes, POSIX_FADV_WILLNEED)) bytes = 0;
+    }
+    if (fd != r->fd_source) close(fd);
+
+    r->prefetched = bytes;
+    return bytes;
+
+}
+
+/**
+ * @brief Reserves the blocks of an empty output for its estimated size, the size of the source changed by the tempo
+ * of the chain, so it doesn't grow one write at a time. Its size is left as it is
+ * @param r Request
+ * @param fd_output Output
+ * @param filters Struct with the filters
+*/
+void preallocate_output(REQUEST r, int fd_output, FILTERS filters) {
+
+    struct stat st;
+    if (!settings.preallocate || r->preview || r->bytes_in <= 0 || fstat(fd_output, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size 
+                              || lseek(fd_output, 0, SEEK_CUR) != 0)
+        return;
+
+    double duration = 1;
+    for (int i = 0; i < r->n_filters; i++) {
+        double tempo = filter_factor(&filters->filter[r->chain[i]], EFFECT_TEMPO);
+        if (tempo > 0) duration /= tempo;
+    }
+
+    // File systems without fallocate simply grow the output as before
+    r->preallocated = fallocate(fd_output, FALLOC_FL_KEEP_SIZE, 0, r->bytes_in * duration * PREALLOCATE_SLACK) == 0;
+
+}
+
+/**
+ * @brief Frees the blocks a preallocated output didn't use, if nothing but the request wrote to it
+ * @param r Request that ended
+*/
+void trim_output(REQUEST r) {
+
+    struct stat st;
+    off_t written = lseek(r->fd_output, 0, SEEK_CUR);
+    if (written >= 0 && fstat(r->fd_output, &st) == 0 && st.st_size == written && ftruncate(r->fd_output, written) < 0)
+        perror("trim output");
+    r->preallocated = 0;
+
+}
+
+/**
+ * @brief Gets if the output of a request can be cached and shared: both its source and its output
+ * are regular files, and the output can be read back
+ * @param r Request
+ * @return 1 if cacheable, 0 if not
+*/
+int cacheable(REQUEST r) {
+
+    struct stat source, output;
+
+    return fstat(r->fd_source, &source) == 0 && S_ISREG(source.st_mode) && 
+           fstat(r->fd_output, &output) == 0 && S_ISREG(output.st_mode) && 
+           (fcntl(r->fd_output, F_GETFL) & O_ACCMODE) == O_RDWR;
+
+}
+
+/**
+ * @brief Gets the cores the filters of a request take at most, as many instances of each as it can run
+ * @param filters Struct with the filters
+ * @param r Request
+ * @return Cores against the budget
+*/
+double request_cost(FILTERS filters, REQUEST r) {
+
+    double cost = 0;
+    for (int i = 0; i < r->n_uses; i++) {
+        int id = r->uses[i][0], needed = r->uses[i][1];
+        cost += filters->filter[id].cost * (needed < filters->filter[id].limit ? needed : filters->filter[id].limit);
+    }
+
+    return cost;
+
+}
+
+/**
+ * @brief Gets if all the filters of a request can be used at the moment, besides the reserved ones.
+ * Previews are short, so they're a class of their own: they may also take the preview slots above
+ * the limits, and aren't held back by the budget
+ * @param filters Struct with the filters
+ * @param r Request to check
+ * @return 1 if valid, 0 if not valid
+*/
+int valid_request(FILTERS filters, REQUEST r) {
+
+    int ret = 1;
+    for (int i = 0; ret && i < r->n_uses; i++) {
+
+        int id = r->uses[i][0], needed = r->uses[i][1];
+        int limit = filters->filter[id].limit;
+
+        // A chain that needs more than the limit runs when the filter is free
+        if (needed > limit) needed = limit;
+        if (r->preview) limit += settings.preview_slots;
+        if (filters->usage[id] + filters->reserved[id] + needed > limit) ret = 0;
+
+    }
+
+    // A request that costs more than the whole budget runs once nothing else takes it
+    if (ret && !r->preview && settings.cpu_budget > 0 && filters->cost_used > 0
+            && filters->cost_used + filters->cost_reserved + request_cost(filters, r) > settings.cpu_budget)
+        ret = 0;
+
+    return ret;
+
+}
+
+/**
+ * @brief Prepares a new process to execute a stage of a pipeline
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+*/
+void setup_stage(int fd_in, int fd_out) {
+
+    // The server blocks SIGCHLD and SIGHUP to read them from a signalfd. A stage dies with the server,
+    // so a server started again doesn't share the outputs of its requests with the stages of the last one
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    // The stages of a request share a process group, so what they start is killed with them
+    setpgid(0, stage_group);
+
+    // dup2 redirects input and output, every other descriptor is close-on-exec
+    if (fd_in >= 0) dup2(fd_in, STDIN_FILENO);
+    dup2(fd_out, STDOUT_FILENO);
+
+}
+
+/**
+ * @brief Creates a process that executes one stage of a pipeline
+ * @param filter_exec Executable path of the filter
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_stage(char * filter_exec, int fd_in, int fd_out) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(fd_in, fd_out);
+
+        // Executes filter
+        execlp(filter_exec, filter_exec, NULL);
+        perror("execlp");
+        _exit(1);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Creates a process that executes a shell command, like the decoder or the encoder
+ * @param command Command to execute
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_command(char * command, int fd_in, int fd_out) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(fd_in, fd_out);
+
+        execl("/bin/sh", "sh", "-c", command, NULL);
+        perror("execl");
+        _exit(1);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Applies consecutive built-in filters in a single pass: the input is decoded once,
+ * goes through every effect in memory and is encoded once
+ * @param effects Effects of the filters, in order
+ * @param n_effects Number of effects
+ * @param raw If true, the input and the output are already raw PCM streams
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @return Exit status, 0 on success
+*/
+int run_builtin(EFFECT * effects[], int n_effects, int raw, int fd_in, int fd_out) {
+
+    // Inside a raw part of the pipeline there's nothing to decode or encode
+    if (raw) {
+
+        int rate, channels;
+        if (dsp_read_header(fd_in, &rate, &channels) < 0 || dsp_write_header(fd_out, rate, channels) < 0) {
+            fprintf(stderr, "built-in filters: invalid raw PCM stream\n");
+            return 1;
+        }
+
+        DSP_CHAIN chain = dsp_chain_new(effects, n_effects, rate, channels);
+        int ret = dsp_run(chain, fd_in, fd_out);
+        dsp_chain_free(chain);
+        return ret < 0;
+
+    }
+
+    int decoded[2], encoded[2];
+    if (pipe2(decoded, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    if (pipe2(encoded, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(decoded[0]);
+        close(decoded[1]);
+        return 1;
+    }
+
+    pid_t decoder = spawn_command(settings.decoder, fd_in, decoded[1]);
+    pid_t encoder = spawn_command(settings.encoder, encoded[0], fd_out);
+    close(decoded[1]);
+    close(encoded[0]);
+
+    DSP_CHAIN chain = dsp_chain_new(effects, n_effects, settings.pcm_rate, settings.pcm_channels);
+    int ret = dsp_run(chain, decoded[0], encoded[1]);
+    dsp_chain_free(chain);
+    close(decoded[0]);
+    close(encoded[1]);
+
+    // Fails if any of the three parts failed
+    int status;
+    if (decoder < 0 || waitpid(decoder, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) ret = -1;
+    if (encoder < 0 || waitpid(encoder, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) ret = -1;
+    return ret < 0;
+
+}
+
+/**
+ * @brief Creates a process that applies consecutive built-in filters in a single pass
+ * @param effects Effects of the filters, in order
+ * @param n_effects Number of effects
+ * @param raw If true, the input and the output are already raw PCM streams
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_builtin(EFFECT * effects[], int n_effects, int raw, int fd_in, int fd_out) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        // Without an exec the descriptors of the server stay open, and a copy of the pipe it writes to
+        // would keep it blocked after its reader ended
+        // It keeps the name of the server, so a SIGHUP sent to every aurrasd is only the server's
+        setup_stage(fd_in, fd_out);
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        signal(SIGHUP, SIG_IGN);
+        _exit(run_builtin(effects, n_effects, raw, STDIN_FILENO, STDOUT_FILENO));
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Converts the resources given by getrusage or wait4
+ * @param ru Resources
+ * @param usage Where to place them
+*/
+void usage_of(struct rusage * ru, USAGE * usage) {
+
+    usage->user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    usage->system = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    usage->max_rss = ru->ru_maxrss;
+    usage->in_blocks = ru->ru_inblock;
+    usage->out_blocks = ru->ru_oublock;
+
+}
+
+/**
+ * @brief Adds resources to a total, whose max_rss is the largest of them
+ * @param total Total
+ * @param usage Resources to add
+*/
+void add_usage(USAGE * total, USAGE * usage) {
+
+    total->user += usage->user;
+    total->system += usage->system;
+    if (usage->max_rss > total->max_rss) total->max_rss = usage->max_rss;
+    total->in_blocks += usage->in_blocks;
+    total->out_blocks += usage->out_blocks;
+
+}
+
+/**
+ * @brief Loop of a worker of the built-in engine, which runs each job sent through its control socket.
+ * The payload of a job has the ids of its filters, and its state field tells if the streams are raw
+ * @param fd_control Control socket
+ * @param filters Struct with the filters
+*/
+void run_worker(int fd_control, FILTERS filters) {
+
+    char buffer[sizeof(MESSAGE_HEADER) + MAX_CHAIN * sizeof(int)];
+    ssize_t bytes_read;
+    int fds[2], n_fds = 0;
+    while ((bytes_read = receive_bytes(fd_control, buffer, sizeof(buffer), fds, &n_fds, 2, 0)) > 0 || errno == EINTR) {
+
+        MESSAGE_HEADER header;
+        char * payload;
+        int status = 1;
+        USAGE usage = { 0 };
+        if (bytes_read > 0 && parse_message(buffer, bytes_read, &header, &payload) > 0 && header.type == MESSAGE_JOB && n_fds == 2) {
+
+            int ids[MAX_CHAIN], n_effects = header.length / sizeof(int);
+            EFFECT * effects[MAX_CHAIN];
+            memcpy(ids, payload, n_effects * sizeof(int));
+            for (int i = 0; i < n_effects; i++) effects[i] = &filters->filter[ids[i]].effect;
+
+            // What the job took is what the worker and the decoder and encoder it waited for took meanwhile
+            struct rusage before[2], after[2];
+            getrusage(RUSAGE_SELF, &before[0]);
+            getrusage(RUSAGE_CHILDREN, &before[1]);
+            status = run_builtin(effects, n_effects, header.state, fds[0], fds[1]);
+            getrusage(RUSAGE_SELF, &after[0]);
+            getrusage(RUSAGE_CHILDREN, &after[1]);
+            for (int i = 0; i < 2; i++) {
+                USAGE start, end;
+                usage_of(&before[i], &start);
+                usage_of(&after[i], &end);
+                usage.user += end.user - start.user;
+                usage.system += end.system - start.system;
+                if (end.max_rss > usage.max_rss) usage.max_rss = end.max_rss;
+                usage.in_blocks += end.in_blocks - start.in_blocks;
+                usage.out_blocks += end.out_blocks - start.out_blocks;
+            }
+
+        }
+
+        // The streams are closed before the answer, so the next stage sees their end
+        for (int i = 0; i < n_fds; i++) close(fds[i]);
+        n_fds = 0;
+        if (bytes_read > 0 && send_message(fd_control, MESSAGE_STATE, status, 0, (char *) &usage, sizeof(usage), NULL, 0) < 0) break;
+
+    }
+
+    _exit(0);
+
+}
+
+/**
+ * @brief Starts a worker of a filter: a fork of the server for the built-in engine, or the executable
+ * of a persistent filter. Its control socket is watched by the main loop for the end of its jobs
+ * @param filters Struct with the filters
+ * @param id Id of the filter
+ * @param w Slot of the worker in the pool
+ * @return 0 on success, -1 on error
+*/
+int spawn_worker(FILTERS filters, int id, WORKER * w) {
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    FILTER * filter = &filters->filter[id];
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+        // A resident worker keeps no descriptor of the server, like the pipes of other requests
+        if (dup2(sv[1], WORKER_FD) < 0) _exit(1);
+        fcntl(WORKER_FD, F_SETFD, 0);
+        close_range(WORKER_FD + 1, ~0U, 0);
+
+        if (filter->builtin) {
+            signal(SIGPIPE, SIG_IGN);
+            signal(SIGHUP, SIG_IGN);
+            run_worker(WORKER_FD, filters);
+        }
+
+        char fd_str[12];
+        snprintf(fd_str, sizeof(fd_str), "%d", WORKER_FD);
+        setenv(WORKER_FD_ENV, fd_str, 1);
+        signal(SIGPIPE, SIG_DFL);
+        execl(filter->filter_path, filter->filter_path, NULL);
+        perror("execl");
+        _exit(1);
+
+    }
+
+    close(sv[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+
+    w->pid = pid;
+    w->fd = sv[0];
+    w->r = NULL;
+    w->stale = 0;
+    struct epoll_event event = { .events = EPOLLIN };
+    event.data.fd = w->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->fd, &event);
+
+    return 0;
+
+}
+
+/**
+ * @brief Pre-forks the pools of workers, with a slot for each instance a filter can run and as many workers
+ * as its limit. Pools that already exist grow to a new maximum and get the workers they lack
+ * @param filters Struct with the filters
+*/
+void start_workers(FILTERS filters) {
+
+    for (int id = 0; id < filters->n_filters; id++) {
+
+        FILTER * filter = &filters->filter[id];
+        if (!pooled(filter) || filter->removed) continue;
+
+        // Slots never shrink, since a worker past a lowered maximum may still be running a job
+        if (filter->n_workers < filter->max) {
+            filter->workers = realloc(filter->workers, filter->max * sizeof(WORKER));
+            for (int i = filter->n_workers; i < filter->max; i++) {
+                filter->workers[i].pid = 0;
+                filter->workers[i].fd = -1;
+                filter->workers[i].r = NULL;
+                filter->workers[i].stale = 0;
+            }
+            filter->n_workers = filter->max;
+        }
+
+        int warm = 0;
+        for (int i = 0; i < filter->n_workers; i++) warm += filter->workers[i].fd >= 0 && !filter->workers[i].stale;
+        for (int i = 0; warm < filter->limit && i < filter->n_workers; i++)
+            if (!filter->workers[i].pid && spawn_worker(filters, id, &filter->workers[i]) == 0) warm++;
+
+    }
+
+}
+
+/**
+ * @brief Retires the workers of a filter: idle ones exit now, busy ones once their job ends
+ * @param filter Filter
+*/
+void retire_workers(FILTER * filter) {
+
+    for (int i = 0; i < filter->n_workers; i++) {
+
+        WORKER * w = &filter->workers[i];
+        if (w->fd < 0) continue;
+        if (w->r) w->stale = 1;
+        else {
+            close(w->fd);
+            w->fd = -1;
+        }
+
+    }
+
+}
+
+/**
+ * @brief Takes the definition of a filter from the same filter in a new configuration
+ * @param filter Filter that is kept
+ * @param new Filter of the new configuration, left without the strings it gives away
+ * @return 1 if its processes must change, 0 otherwise
+*/
+int update_filter(FILTER * filter, FILTER * new) {
+
+    int changed = strcmp(filter->filter_path, new->filter_path) || filter->builtin != new->builtin 
+               || filter->raw_io != new->raw_io || filter->persistent != new->persistent 
+               || memcmp(&filter->effect, &new->effect, sizeof(EFFECT));
+
+    free(filter->filter_path);
+    free(filter->commutes);
+    filter->filter_path = new->filter_path;
+    filter->commutes = new->commutes;
+    new->filter_path = new->commutes = NULL;
+
+    filter->max = new->max;
+    filter->floor = new->floor;
+    filter->cost = new->cost;
+    filter->effect = new->effect;
+    filter->builtin = new->builtin;
+    filter->raw_io = new->raw_io;
+    filter->persistent = new->persistent;
+    filter->removed = 0;
+    clamp_limit(filter);
+
+    return changed;
+
+}
+
+/**
+ * @brief Reads the config file and the filters folder again, without touching the requests. Filters keep
+ * their ids, which requests hold: new ones are added, and the ones that left are only hidden from new
+ * requests. Pools whose filter changed are replaced, their busy workers once their job ends. The cache,
+ * the metrics and the use of pools stay as the server started
+ * @param filters Struct with the filters
+ * @param config_filename File with the configuration
+ * @param filters_folder Path to the filters folder
+*/
+void reload(FILTERS filters, char * config_filename, char * filters_folder) {
+
+    // The config file may replace the strings that stay as they were, so it's given copies of them
+    struct settings kept = settings;
+    char ** fixed[] = { &settings.cache_dir, &settings.metrics_file, &settings.job_log, &settings.journal,
+                        &settings.socket, &settings.coordinator };
+    int n_fixed = sizeof(fixed) / sizeof(fixed[0]);
+    for (int i = 0; i < n_fixed; i++)
+        if (*fixed[i]) *fixed[i] = strdup(*fixed[i]);
+
+    FILTERS new = configure(config_filename, filters_folder);
+    for (int i = 0; i < n_fixed; i++) free(*fixed[i]);
+
+    settings.cache_dir = kept.cache_dir;
+    settings.cache_size = kept.cache_size;
+    settings.cache_by_content = kept.cache_by_content;
+    settings.prefix_cache_size = kept.prefix_cache_size;
+    settings.worker_pool = kept.worker_pool;
+    settings.metrics_file = kept.metrics_file;
+    settings.job_log = kept.job_log;
+    settings.journal = kept.journal;
+    settings.socket = kept.socket;
+    settings.coordinator = kept.coordinator;
+    if (!new) {
+        fprintf(stderr, "Reload: keeping the configuration\n");
+        return;
+    }
+    if (!settings.segments) settings.segments = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int id = 0; id < filters->n_filters; id++) filters->filter[id].removed = 1;
+
+    // Built-in workers are forks of the server, with the effects of every filter as they were
+    int builtin_changed = 0;
+    for (int i = 0; i < new->n_filters; i++) {
+
+        FILTER * filter = &new->filter[i];
+        int id = filter_id(filters, filter->filter_name);
+        if (id < 0 && (id = add_filter(filters, filter->filter_name, filter->filter_path, filter->max)) >= 0)
+            filters->filter[id].limit = filter->limit;
+        if (id < 0) {
+            fprintf(stderr, "Filter %s: too many filters\n", filter->filter_name);
+            continue;
+        }
+
+        int was_builtin = filters->filter[id].builtin;
+        if (update_filter(&filters->filter[id], filter)) {
+            builtin_changed |= was_builtin || filters->filter[id].builtin;
+            retire_workers(&filters->filter[id]);
+        }
+
+    }
+    free_filters(new);
+
+    for (int id = 0; id < filters->n_filters; id++) {
+        FILTER * filter = &filters->filter[id];
+        if (filter->removed || (builtin_changed && filter->builtin)) retire_workers(filter);
+    }
+    resolve_commutes(filters);
+    start_workers(filters);
+
+}
+
+/**
+ * @brief Finds a worker by its pid or by its control socket
+ * @param filters Struct with the filters
+ * @param pid Pid of the worker, 0 to find it by its socket
+ * @param fd Control socket of the worker
+ * @return Worker, NULL if there's none
+*/
+WORKER * find_worker(FILTERS filters, pid_t pid, int fd) {
+
+    for (int id = 0; id < filters->n_filters; id++) {
+        WORKER * workers = filters->filter[id].workers;
+        for (int i = 0; workers && i < filters->filter[id].n_workers; i++)
+            if (pid ? workers[i].pid == pid : (fd >= 0 && workers[i].fd == fd)) return &workers[i];
+    }
+
+    return NULL;
+
+}
+
+/**
+ * @brief Creates a process that decodes its input into a raw PCM stream
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @param window Window of the input to decode with the window decoder, NULL to decode all of it
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_decoder(int fd_in, int fd_out, SEGMENT * window) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(fd_in, fd_out);
+
+        // The window decoder seeks by itself, told where in the environment
+        char * command = settings.decoder;
+        if (window) {
+            char value[32];
+            snprintf(value, sizeof(value), "%.6f", (double) window->from / settings.pcm_rate);
+            setenv("AURRAS_FROM", value, 1);
+            snprintf(value, sizeof(value), "%.6f", (double) (window->to - window->from) / settings.pcm_rate);
+            if (window->to >= 0) setenv("AURRAS_LENGTH", value, 1);
+            command = settings.window_decoder;
+        }
+
+        // The header goes first, the decoder writes the samples after it
+        if (dsp_write_header(STDOUT_FILENO, settings.pcm_rate, settings.pcm_channels) < 0) _exit(1);
+        execl("/bin/sh", "sh", "-c", command, NULL);
+        perror("execl");
+        _exit(1);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Creates a process that encodes a raw PCM stream into the output format
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_encoder(int fd_in, int fd_out) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(fd_in, fd_out);
+
+        // Consumes the header, the encoder reads the samples after it
+        int rate, channels;
+        if (dsp_read_header(STDIN_FILENO, &rate, &channels) < 0) {
+            fprintf(stderr, "encoder: invalid raw PCM stream\n");
+            _exit(1);
+        }
+        if (rate != settings.pcm_rate || channels != settings.pcm_channels)
+            fprintf(stderr, "encoder: stream has %d Hz and %d channels, expected %d Hz and %d channels\n",
+                                rate, channels, settings.pcm_rate, settings.pcm_channels);
+
+        execl("/bin/sh", "sh", "-c", settings.encoder, NULL);
+        perror("execl");
+        _exit(1);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Creates a process that passes a stream on to the next stage and writes a copy of it,
+ * with tee and splice the stream never goes through user space
+ * @param fd_in File descriptor to use as input, a pipe
+ * @param fd_out File descriptor to use as output, a pipe
+ * @param fd_copy Where to write the copy, -1 to only pass the stream on
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_tap(int fd_in, int fd_out, int fd_copy) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(fd_in, fd_out);
+
+        int copied = fd_copy >= 0;
+        char buffer[TAP_BLOCK];
+        ssize_t n;
+        while ((n = tee(STDIN_FILENO, STDOUT_FILENO, TAP_BLOCK, 0)) > 0) {
+
+            // The bytes duplicated to the next stage are then taken out of the input
+            while (n > 0 && copied) {
+                ssize_t moved = splice(STDIN_FILENO, NULL, fd_copy, NULL, n, SPLICE_F_MOVE);
+                if (moved <= 0) copied = 0;
+                else n -= moved;
+            }
+            while (n > 0) {
+                ssize_t discarded = read(STDIN_FILENO, buffer, n < TAP_BLOCK ? n : TAP_BLOCK);
+                if (discarded <= 0) _exit(1);
+                n -= discarded;
+            }
+
+        }
+
+        if (n < 0) {
+            perror("tee");
+            _exit(1);
+        }
+        _exit(copied ? 0 : TAP_UNCACHED);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Creates a process that reads a range of frames of a decoded source, as a raw PCM stream
+ * @param fd_in Decoded source, a raw PCM file
+ * @param fd_out File descriptor to use as output
+ * @param from First frame of the range
+ * @param to Frame after the last one of the range
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_slice(int fd_in, int fd_out, long long from, long long to) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(fd_in, fd_out);
+
+        int rate, channels;
+        if (dsp_read_header(STDIN_FILENO, &rate, &channels) < 0 || dsp_write_header(STDOUT_FILENO, rate, channels) < 0) {
+            fprintf(stderr, "slice: invalid raw PCM file\n");
+            _exit(1);
+        }
+
+        // The range goes from the file to the pipe without a copy in user space
+        long long frame = sizeof(float) * channels;
+        loff_t offset = sizeof(PCM_HEADER) + from * frame;
+        long long left = (to - from) * frame;
+        ssize_t moved = 1;
+        while (left > 0 && (moved = splice(STDIN_FILENO, &offset, STDOUT_FILENO, NULL, 
+                                           left < TAP_BLOCK ? left : TAP_BLOCK, SPLICE_F_MOVE)) > 0)
+            left -= moved;
+
+        if (moved < 0) perror("splice");
+        _exit(moved < 0);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Creates a process that cuts a part of a raw PCM stream: it leaves out some frames and passes on the ones
+ * after them. What follows is read to its end if asked, or else the process ends and so may the one writing it
+ * @param fd_in File descriptor to use as input, a pipe
+ * @param fd_out File descriptor to use as output, a pipe
+ * @param skip Frames left out
+ * @param keep Frames passed on after them, -1 for all of them
+ * @param drain If true, the rest of the input is read and left out too
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_cut(int fd_in, int fd_out, long long skip, long long keep, int drain) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(fd_in, fd_out);
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        signal(SIGHUP, SIG_IGN);
+
+        int rate, channels;
+        if (dsp_read_header(STDIN_FILENO, &rate, &channels) < 0 || dsp_write_header(STDOUT_FILENO, rate, channels) < 0) {
+            fprintf(stderr, "cut: invalid raw PCM stream\n");
+            _exit(1);
+        }
+
+        long long frame = sizeof(float) * channels, left;
+        char buffer[TAP_BLOCK];
+        ssize_t n = 1;
+        for (left = skip * frame; left > 0 && (n = read(STDIN_FILENO, buffer, left < TAP_BLOCK ? left : TAP_BLOCK)) > 0;)
+            left -= n;
+        for (left = keep < 0 ? LLONG_MAX : keep * frame; n > 0 && left > 0 &&
+             (n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, left < TAP_BLOCK ? left : TAP_BLOCK, SPLICE_F_MOVE)) > 0;)
+            left -= n;
+        while (drain && n > 0 && (n = read(STDIN_FILENO, buffer, TAP_BLOCK)) > 0);
+
+        if (n < 0) perror("cut");
+        _exit(n < 0);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Writes bytes to a file descriptor
+ * @return 0 on success, -1 on error
+*/
+int write_bytes(int fd, char * bytes, long long n) {
+
+    while (n > 0) {
+        ssize_t written = write(fd, bytes, n);
+        if (written <= 0) return -1;
+        bytes += written;
+        n -= written;
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Stops copying a stream to an output of a fan-out
+ * @param fd_outs Outputs of the fan-out
+ * @param i Index of the output
+ * @param alive Outputs that are still copied to
+*/
+void drop_output(int fd_outs[], int i, int * alive) {
+
+    close(fd_outs[i]);
+    fd_outs[i] = -1;
+    (*alive)--;
+
+}
+
+/**
+ * @brief Copies a stream to several outputs. Each chunk of a pipe is duplicated with tee to every output but the last,
+ * which then takes it out of the input with splice, so it never goes through user space. A chunk that an output
+ * only took part of, or that goes to a file, is read once and written where it's missing. An output whose reader
+ * ended is dropped and the others go on
+ * @param fd_in Input
+ * @param fd_outs Outputs, -1 for one that couldn't be opened
+ * @param n_outs Number of outputs
+ * @return Exit status, 0 if every output got the whole stream
+*/
+int run_fanout(int fd_in, int fd_outs[], int n_outs) {
+
+    struct stat st;
+    int in_pipe = fstat(fd_in, &st) == 0 && S_ISFIFO(st.st_mode);
+    int out_pipe[n_outs], alive = 0, failed = 0;
+    for (int i = 0; i < n_outs; i++) {
+        if (fd_outs[i] >= 0) alive++;
+        else failed = 1;
+        out_pipe[i] = fd_outs[i] >= 0 && fstat(fd_outs[i], &st) == 0 && S_ISFIFO(st.st_mode);
+    }
+
+    char buffer[TAP_BLOCK];
+    ssize_t written[n_outs], n, moved;
+    while (alive) {
+
+        int last = n_outs - 1;
+        while (fd_outs[last] < 0) last--;
+        memset(written, 0, sizeof(written));
+
+        // The chunk waiting in the pipe is duplicated without taking it
+        n = TAP_BLOCK;
+        int copy = !in_pipe || !out_pipe[last];
+        if (in_pipe) {
+
+            struct pollfd p = { fd_in, POLLIN, 0 };
+            int available = 0;
+            if (poll(&p, 1, -1) < 0) {
+                if (errno == EINTR) continue;
+                perror("poll");
+                return 1;
+            }
+            if (ioctl(fd_in, FIONREAD, &available) < 0 || !available) break;
+            if (available < n) n = available;
+
+            for (int i = 0; i < last; i++) {
+                if (fd_outs[i] < 0) continue;
+                if (!out_pipe[i] || (written[i] = tee(fd_in, fd_outs[i], n, 0)) < n) copy = 1;
+                if (written[i] < 0) {
+                    drop_output(fd_outs, i, &alive);
+                    failed = 1;
+                }
+            }
+
+        }
+
+        if (!copy) {
+            while (n > 0 && (moved = splice(fd_in, NULL, fd_outs[last], NULL, n, SPLICE_F_MOVE)) > 0) n -= moved;
+            if (n > 0) {
+                drop_output(fd_outs, last, &alive);
+                failed = 1;
+            }
+            while (n > 0 && (moved = read(fd_in, buffer, n)) > 0) n -= moved;
+            continue;
+        }
+
+        if ((n = read(fd_in, buffer, n)) <= 0) {
+            if (n < 0) perror("read");
+            failed |= n < 0;
+            break;
+        }
+        for (int i = 0; i <= last; i++)
+            if (fd_outs[i] >= 0 && write_bytes(fd_outs[i], buffer + written[i], n - written[i]) < 0) {
+                drop_output(fd_outs, i, &alive);
+                failed = 1;
+            }
+
+    }
+
+    return failed;
+
+}
+
+/**
+ * @brief Creates a process that copies a stream to several outputs
+ * @param fd_in File descriptor to use as input
+ * @param fd_outs File descriptors to use as outputs, -1 for one that couldn't be opened
+ * @param n_outs Number of outputs
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_fanout(int fd_in, int fd_outs[], int n_outs) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        // The first output is stdout and the others follow stderr. They're moved above their places first,
+        // so none is overwritten, and then nothing else of the server stays open
+        int outs[n_outs], moved[n_outs];
+        for (int i = 1; i < n_outs; i++) moved[i] = fd_outs[i] >= 0 ? fcntl(fd_outs[i], F_DUPFD, STDERR_FILENO + n_outs) : -1;
+        setup_stage(fd_in, fd_outs[0]);
+        outs[0] = fd_outs[0] >= 0 ? STDOUT_FILENO : -1;
+        for (int i = 1; i < n_outs; i++) outs[i] = moved[i] >= 0 ? dup2(moved[i], STDERR_FILENO + i) : -1;
+        close_range(STDERR_FILENO + n_outs, ~0U, 0);
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        _exit(run_fanout(STDIN_FILENO, outs, n_outs));
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Writes frames to a file descriptor
+ * @return 0 on success, -1 on error
+*/
+int write_frames(int fd, float * frames, long long n, int channels) {
+
+    return write_bytes(fd, (char *) frames, n * channels * sizeof(float));
+
+}
+
+/**
+ * @brief Crossfades the end of a segment with the start of the next one, where they match best
+ * @param r Request split in segments
+ * @param i Index of the segment that ends
+ * @param fd Output of the segment that ends
+ * @param at Frame of that output where the join is
+ * @param fd_out Where to write the crossfade
+ * @param channels Channels of the outputs
+ * @return Frames of the next segment already written, 0 if they're joined without a crossfade, -1 on error
+*/
+long long join_segments(REQUEST r, int i, int fd, long long at, int fd_out, int channels) {
+
+    SEGMENT * next = &r->segments[i + 1];
+    int frames = r->segments[i].overlap;
+    int search = DSP_JOIN_SEARCH * settings.pcm_rate;
+    if (next->skip < search) return 0;
+
+    char path[MAX];
+    snprintf(path, MAX, SEGMENT_PATH, r->task, i + 1);
+    int fd_next = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd_next < 0) return 0;
+
+    long long frame = sizeof(float) * channels;
+    size_t tail_size = frames * frame, head_size = (frames + 2 * search) * frame;
+    float * tail = malloc(tail_size), * head = malloc(head_size);
+    long long shift = 0;
+
+    // Segments whose output is too short for a crossfade are joined as they are. A failed read is negative,
+    // and only compared as a size once it isn't
+    ssize_t tail_read = pread(fd, tail, tail_size, sizeof(PCM_HEADER) + at * frame);
+    ssize_t head_read = tail_read >= 0 && (size_t) tail_read == tail_size ?
+                        pread(fd_next, head, head_size, sizeof(PCM_HEADER) + (next->skip - search) * frame) : -1;
+    if (head_read >= 0 && (size_t) head_read == head_size) {
+        int offset = dsp_join(tail, head, frames, search, channels);
+        shift = write_frames(fd_out, tail, frames, channels) < 0 ? -1 : offset - search + frames;
+    }
+
+    free(tail);
+    free(head);
+    close(fd_next);
+
+    return shift;
+
+}
+
+/**
+ * @brief Creates a process that joins the outputs of the segments of a request in order,
+ * leaving out their warm-up, and encodes them once
+ * @param r Request split in segments
+ * @param fd_out File descriptor to use as output
+ * @return Pid of the new process, or -1 on error
+*/
+pid_t spawn_stitch(REQUEST r, int fd_out) {
+
+    pid_t pid = fork();
+    if (pid == 0) {
+
+        setup_stage(-1, fd_out);
+
+        int pcm[2];
+        if (pipe2(pcm, O_CLOEXEC) < 0) {
+            perror("pipe");
+            _exit(1);
+        }
+        pid_t encoder = spawn_encoder(pcm[0], STDOUT_FILENO);
+        close(pcm[0]);
+
+        int ret = dsp_write_header(pcm[1], settings.pcm_rate, settings.pcm_channels);
+        long long shift = 0; // Frames of the segment already written by a crossfade
+        for (int i = 0; ret == 0 && i < r->n_segments; i++) {
+
+            char path[MAX];
+            snprintf(path, MAX, SEGMENT_PATH, r->task, i);
+            int rate, channels, fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || dsp_read_header(fd, &rate, &channels) < 0) {
+                fprintf(stderr, "stitch: invalid segment %s\n", path);
+                ret = -1;
+                break;
+            }
+
+            SEGMENT * segment = &r->segments[i];
+            long long frame = sizeof(float) * channels;
+            loff_t offset = sizeof(PCM_HEADER) + (segment->skip + shift) * frame;
+            long long left = segment->keep < 0 ? LLONG_MAX : (segment->keep - shift) * frame;
+            ssize_t moved = 1;
+            while (left > 0 && (moved = splice(fd, &offset, pcm[1], NULL, 
+                                               left < TAP_BLOCK ? left : TAP_BLOCK, SPLICE_F_MOVE)) > 0)
+                left -= moved;
+            if (moved < 0) ret = -1;
+
+            shift = 0;
+            if (ret == 0 && segment->overlap && i + 1 < r->n_segments)
+                ret = (shift = join_segments(r, i, fd, segment->skip + segment->keep, pcm[1], channels)) < 0 ? -1 : 0;
+            close(fd);
+
+        }
+        close(pcm[1]);
+
+        int status;
+        if (encoder < 0 || waitpid(encoder, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) ret = -1;
+        _exit(ret < 0);
+
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+
+}
+
+/**
+ * @brief Gets how much of the source the filters of a request need before a point to give there the output
+ * they give on the whole source
+ * @param r Request
+ * @param filters Struct with the filters
+ * @param tempo Where to place the product of the tempo changes of the chain
+ * @param exact Where to place if that output is exactly the same, rather than close to it
+ * @return Frames of the source
+*/
+long long chain_warmup(REQUEST r, FILTERS filters, double * tempo, int * exact) {
+
+    double warmup = 0;
+    *tempo = 1;
+    *exact = 1;
+    for (int i = 0; i < r->n_filters; i++) {
+        EFFECT * e = &filters->filter[r->chain[i]].effect;
+        double seconds = dsp_warmup(e);
+        warmup += (seconds < 0 ? settings.segment_overlap / 1000.0 : seconds) * *tempo;
+        if (e->type == EFFECT_TEMPO) *tempo *= e->tempo;
+        if (e->type != EFFECT_GAIN && e->type != EFFECT_ECHO) *exact = 0;
+    }
+
+    return ceil(warmup * settings.pcm_rate);
+
+}
+
+/**
+ * @brief Places the window of a preview in frames of the decoded source. It starts early enough for the filters
+ * to warm up, and that part of the output is left out
+ * @param r Preview
+ * @param filters Struct with the filters
+*/
+void plan_window(REQUEST r, FILTERS filters) {
+
+    double tempo;
+    int exact;
+    long long lead_in = chain_warmup(r, filters, &tempo, &exact);
+    long long start = llround(r->start * settings.pcm_rate);
+
+    SEGMENT * w = &r->window;
+    w->from = start > lead_in ? start - lead_in : 0;
+    w->to = r->duration > 0 ? start + llround(r->duration * settings.pcm_rate) : -1;
+    w->skip = llround(start / tempo) - llround(w->from / tempo);
+    w->keep = r->duration > 0 ? llround(w->to / tempo) - llround(start / tempo) : -1;
+    w->overlap = 0;
+
+}
+
+/**
+ * @brief Adds a stage to the pipeline of a request
+ * @param r Request
+ * @param type Kind of stage
+ * @param first Index in the chain of its first filter
+ * @param last Index in the chain after its last filter
+ * @param raw If true, the stage reads and writes raw PCM
+*/
+void add_stage(REQUEST r, STAGE_TYPE type, int first, int last, int raw) {
+
+    STAGE * s = &r->stages[r->n_stages++];
+    s->type = type;
+    s->first = first;
+    s->last = last;
+    s->raw = raw;
+    s->pid = 0;
+    s->status = 0;
+    s->seconds = 0;
+    s->tapped = 0;
+    s->cost = 0;
+    s->worker = 0;
+
+}
+
+/**
+ * @brief Splits the chain of a request in stages, from the end of its cached prefix. Consecutive built-in
+ * filters share one stage, and in a raw pipeline the filters that accept raw PCM are wrapped by a single
+ * decoder and encoder. Stage boundaries whose stream isn't cached yet get a tap
+ * @param r Request
+ * @param filters Struct with the filters
+*/
+void plan_stages(REQUEST r, FILTERS filters) {
+
+    r->n_stages = 0;
+    int raw = r->first ? r->prefix_raw[r->first] : 0;
+
+    // A segment reads its range of the decoded source, and stays raw until its parent joins it
+    if (r->parent) {
+        add_stage(r, STAGE_SLICE, 0, 0, 1);
+        raw = 1;
+    }
+
+    // A preview cuts its window from the decoded source, and its lead-in is left out on raw PCM once filtered
+    else if (r->preview) {
+        plan_window(r, filters);
+        add_stage(r, STAGE_DECODER, 0, 0, 1);
+        add_stage(r, STAGE_WINDOW, 0, 0, 1);
+        raw = 1;
+    }
+
+    for (int i = r->first; i < r->n_filters; i++) {
+
+        if (i > r->first && prefixes && *r->prefix_keys[i] && !cache_contains(prefixes, r->prefix_keys[i]))
+            add_stage(r, STAGE_TAP, i, i, r->prefix_raw[i]);
+
+        FILTER * filter = &filters->filter[r->chain[i]];
+        int accepts_raw = (settings.raw_pipeline || r->parent || r->preview) && (filter->builtin || filter->raw_io);
+
+        // Encoded audio only changes to raw PCM and back where the contract of the filters changes
+        if (accepts_raw && !raw) add_stage(r, STAGE_DECODER, i, i, 1);
+        else if (!accepts_raw && raw) add_stage(r, STAGE_ENCODER, i, i, 1);
+        raw = accepts_raw;
+
+        STAGE * previous = r->n_stages ? &r->stages[r->n_stages - 1] : NULL;
+        if (filter->builtin && previous && previous->type == STAGE_BUILTIN && previous->last == i) previous->last++;
+        else add_stage(r, filter->builtin ? STAGE_BUILTIN : STAGE_EXTERNAL, i, i + 1, raw);
+
+    }
+
+    if (r->preview) {
+        if (!raw) add_stage(r, STAGE_DECODER, r->n_filters, r->n_filters, 1);
+        add_stage(r, STAGE_TRIM, r->n_filters, r->n_filters, 1);
+        add_stage(r, STAGE_ENCODER, r->n_filters, r->n_filters, 1);
+    }
+    else if (raw && !r->parent) add_stage(r, STAGE_ENCODER, r->n_filters, r->n_filters, 1);
+
+    // A chain optimized away still converts the source to the output format
+    if (!r->n_filters && !r->preview) {
+        add_stage(r, STAGE_DECODER, 0, 0, 1);
+        add_stage(r, STAGE_ENCODER, 0, 0, 1);
+    }
+
+}
+
+/**
+ * @brief Splits the tree of a request with several outputs in stages, branch by branch like plan_stages does a chain.
+ * A branch that others start from ends in a fan-out, after a decoder if any of them takes raw PCM, so the stream
+ * is decoded once for all of them. Every output ends encoded
+ * @param r Request
+ * @param filters Struct with the filters
+*/
+void plan_tree(REQUEST r, FILTERS filters) {
+
+    r->n_stages = 0;
+    int raw_end[MAX_BRANCHES]; // If true, the stream at the end of the branch is raw PCM
+
+    for (int b = 0; b < r->n_branches; b++) {
+
+        BRANCH * branch = &r->branches[b];
+        int raw = branch->parent >= 0 ? raw_end[branch->parent] : 0;
+        branch->first_stage = r->n_stages;
+
+        for (int i = branch->first; i < branch->last; i++) {
+
+            FILTER * filter = &filters->filter[r->chain[i]];
+            int accepts_raw = settings.raw_pipeline && (filter->builtin || filter->raw_io);
+            if (accepts_raw && !raw) add_stage(r, STAGE_DECODER, i, i, 1);
+            else if (!accepts_raw && raw) add_stage(r, STAGE_ENCODER, i, i, 1);
+            raw = accepts_raw;
+
+            // Built-in filters share a stage within the branch
+            STAGE * previous = r->n_stages > branch->first_stage ? &r->stages[r->n_stages - 1] : NULL;
+            if (filter->builtin && previous && previous->type == STAGE_BUILTIN && previous->last == i) previous->last++;
+            else add_stage(r, filter->builtin ? STAGE_BUILTIN : STAGE_EXTERNAL, i, i + 1, raw);
+
+        }
+
+        if (branch->output_path && raw) add_stage(r, STAGE_ENCODER, branch->last, branch->last, 1);
+        else if (!branch->output_path) {
+            for (int c = b + 1; !raw && settings.raw_pipeline && c < r->n_branches; c++) {
+                if (r->branches[c].parent != b || r->branches[c].first == r->branches[c].last) continue;
+                FILTER * next = &filters->filter[r->chain[r->branches[c].first]];
+                if (next->builtin || next->raw_io) {
+                    add_stage(r, STAGE_DECODER, branch->last, branch->last, 1);
+                    raw = 1;
+                }
+            }
+            add_stage(r, STAGE_FANOUT, branch->last, branch->last, raw);
+        }
+
+        raw_end[b] = raw;
+        branch->n_stages = r->n_stages - branch->first_stage;
+
+    }
+
+}
+
+/**
+ * @brief Gets in how many segments a request is split, from the size of its source and the filters it applies
+ * @param r Request
+ * @param filters Struct with the filters
+ * @return Number of segments, 0 if it runs as a single pipeline
+*/
+int count_segments(REQUEST r, FILTERS filters) {
+
+    struct stat st;
+    if (!settings.segment_threshold || !r->n_filters || r->parent || r->first || r->branches || r->preview || fstat(r->fd_source, &st) < 0 
+                                                                          || st.st_size < settings.segment_threshold)
+        return 0;
+
+    // Segments are cut and joined on raw PCM, and no filter runs more of them at once than its limit
+    int n = settings.segments;
+    for (int i = 0; i < r->n_filters; i++) {
+        FILTER * filter = &filters->filter[r->chain[i]];
+        if (!filter->builtin && !filter->raw_io) return 0;
+        if (filter->limit < n) n = filter->limit;
+    }
+
+    return n > 1 ? n : 0;
+
+}
+
+/**
+ * @brief Starts decoding the source of a request that is split in segments to a file, without any filter
+ * @param r Request
+ * @param fd_source Source file
+ * @param fd_output Output, only written when the segments are joined
+ * @return 0 if the decoder started or the source was decoded before, -1 otherwise
+*/
+int start_decoding(REQUEST r, int fd_source, int fd_output) {
+
+    close(fd_output);
+
+    // A request replayed from the journal keeps the source it decoded before the crash
+    char path[MAX];
+    struct stat st;
+    snprintf(path, MAX, DECODED_PATH, r->task);
+    JOURNAL_JOB * job = r->journaled ? journal_find(journal, r->task) : NULL;
+    if (job && job->decoded >= 0 && job->n_segments == r->n_segments && stat(path, &st) == 0 && st.st_size == job->decoded) {
+        close(fd_source);
+        return 0;
+    }
+
+    int fd_decoded = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd_decoded < 0) {
+        perror("open decoded source");
+        close(fd_source);
+        return -1;
+    }
+
+    add_stage(r, STAGE_DECODER, 0, 0, 1);
+    r->stages[0].pid = spawn_decoder(fd_source, fd_decoded, NULL);
+    if (r->stages[0].pid > 0) r->running++;
+    else r->stages[0].pid = 0;
+    r->pgid = r->stages[0].pid;
+
+    close(fd_source);
+    close(fd_decoded);
+
+    return r->running ? 0 : -1;
+
+}
+
+/**
+ * @brief Sends a stage to an idle worker of its filter, starting one where a worker died
+ * @param filters Struct with the filters
+ * @param r Request
+ * @param i Index of the stage
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @return Pid of the worker, or -1 if the stage has to run as a process of its own
+*/
+pid_t run_job(FILTERS filters, REQUEST r, int i, int fd_in, int fd_out) {
+
+    STAGE * stage = &r->stages[i];
+    int id = r->chain[stage->first];
+    FILTER * filter = &filters->filter[id];
+    if (!filter->workers || !pooled(filter) || filter->removed || (stage->type == STAGE_EXTERNAL && !filter->persistent)) return -1;
+
+    WORKER * w = NULL;
+    for (int j = 0; !w && j < filter->n_workers; j++)
+        if (filter->workers[j].fd >= 0 && !filter->workers[j].r && !filter->workers[j].stale) w = &filter->workers[j];
+    for (int j = 0; !w && j < filter->n_workers; j++)
+        if (!filter->workers[j].pid && spawn_worker(filters, id, &filter->workers[j]) == 0) w = &filter->workers[j];
+    if (!w) return -1;
+
+    // The built-in engine needs the filters of the stage and whether its streams are raw
+    int fds[2] = { fd_in, fd_out };
+    int raw = stage->type == STAGE_BUILTIN && stage->raw;
+    uint32_t length = stage->type == STAGE_BUILTIN ? (stage->last - stage->first) * sizeof(int) : 0;
+    if (send_message(w->fd, MESSAGE_JOB, r->task, raw, (char *) (r->chain + stage->first), length, fds, 2) < 0) {
+        perror("worker");
+        return -1;
+    }
+
+    w->r = r;
+    w->stage = i;
+    return w->pid;
+
+}
+
+/**
+ * @brief Starts a planned stage of a request, as a job of a worker or a process of its own
+ * @param r Request
+ * @param i Index of the stage
+ * @param filters Struct with the filters
+ * @param fd_in File descriptor to use as input
+ * @param fd_out File descriptor to use as output
+ * @return Pid of the stage, or -1 on error
+*/
+pid_t spawn_planned(REQUEST r, int i, FILTERS filters, int fd_in, int fd_out) {
+
+    STAGE * stage = &r->stages[i];
+    EFFECT * effects[MAX_CHAIN];
+    pid_t pid;
+    stage_group = r->pgid;
+    switch (stage->type) {
+        case STAGE_BUILTIN:
+            if ((pid = run_job(filters, r, i, fd_in, fd_out)) > 0) {
+                stage->worker = 1;
+                break;
+            }
+            for (int j = stage->first; j < stage->last; j++) effects[j - stage->first] = &filters->filter[r->chain[j]].effect;
+            pid = spawn_builtin(effects, stage->last - stage->first, stage->raw, fd_in, fd_out);
+            break;
+        case STAGE_DECODER: // Only the first decoder of a preview seeks
+            pid = spawn_decoder(fd_in, fd_out, r->preview && !i && settings.window_decoder ? &r->window : NULL);
+            break;
+        case STAGE_WINDOW: // After the window decoder, the stream starts at the window
+            pid = spawn_cut(fd_in, fd_out, settings.window_decoder ? 0 : r->window.from,
+                            r->window.to < 0 ? -1 : r->window.to - r->window.from, 0);
+            break;
+        case STAGE_TRIM:
+            pid = spawn_cut(fd_in, fd_out, r->window.skip, r->window.keep, 1);
+            break;
+        case STAGE_ENCODER:
+            pid = spawn_encoder(fd_in, fd_out);
+            break;
+        case STAGE_SLICE:
+            pid = spawn_slice(fd_in, fd_out, r->parent->segments[r->segment].from, r->parent->segments[r->segment].to);
+            break;
+        case STAGE_TAP: {
+            int fd_copy = cache_create(prefixes, r->prefix_keys[stage->first]);
+            pid = spawn_tap(fd_in, fd_out, fd_copy);
+            if (fd_copy >= 0) {
+                close(fd_copy);
+                if (pid > 0) stage->tapped = 1;
+                else cache_abort(prefixes, r->prefix_keys[stage->first]);
+            }
+            break;
+        }
+        default:
+            if ((pid = run_job(filters, r, i, fd_in, fd_out)) > 0) {
+                stage->worker = 1;
+                break;
+            }
+            pid = spawn_stage(filters->filter[r->chain[stage->first]].filter_path, fd_in, fd_out);
+            break;
+    }
+    stage_group = 0;
+
+    return pid;
+
+}
+
+/**
+ * @brief Accounts for a stage that started: its filters are in use while it runs, against their limits and
+ * the budget, and it's pinned to the cores of its request. A worker is pinned again for each job. A process
+ * of its own joins the process group of the request, which the first one leads
+ * @param r Request
+ * @param i Index of the stage, whose pid is cleared if it didn't start
+ * @param filters Struct with the filters
+*/
+void count_stage(REQUEST r, int i, FILTERS filters) {
+
+    STAGE * stage = &r->stages[i];
+    if (stage->pid <= 0) {
+        stage->pid = 0;
+        return;
+    }
+
+    for (int j = stage->first; j < stage->last; j++) {
+        filters->usage[r->chain[j]]++;
+        stage->cost += filters->filter[r->chain[j]].cost;
+    }
+    filters->cost_used += stage->cost;
+    if (!stage->worker) {
+        if (!r->pgid) r->pgid = stage->pid;
+        setpgid(stage->pid, r->pgid);
+    }
+    if (r->domain >= 0) {
+        sched_setaffinity(stage->pid, sizeof(r->cpus), &r->cpus);
+        topology_load(topology, &r->cpus, 1);
+    }
+    r->running++;
+
+}
+
+/**
+ * @brief Starts the stages of a request with several outputs. Each branch reads through a pipe from the fan-out
+ * that ends its parent, and the last stage of a branch with an output writes it. A branch without stages of its
+ * own has its output written by the fan-out
+ * @param r Request, with its tree planned
+ * @param filters Struct with the filters
+ * @param fd_source Source, taken by the tree
+ * @return 0 if the stages started, -1 otherwise
+*/
+int start_tree(REQUEST r, FILTERS filters, int fd_source) {
+
+    int fd_branch[MAX_BRANCHES]; // Where each branch reads from, -1 until the fan-out before it starts
+    fd_branch[0] = fd_source;
+    for (int b = 1; b < r->n_branches; b++) fd_branch[b] = -1;
+
+    for (int b = 0; b < r->n_branches; b++) {
+
+        BRANCH * branch = &r->branches[b];
+        int fd_in = fd_branch[b], end = branch->first_stage + branch->n_stages;
+        for (int i = branch->first_stage; fd_in >= 0 && i < end; i++) {
+
+            STAGE * stage = &r->stages[i];
+            int pipe_fds[2] = { -1, -1 };
+            if (stage->type == STAGE_FANOUT) {
+
+                int fd_outs[PROTOCOL_MAX_OUTPUTS], n_outs = 0;
+                for (int c = b + 1; c < r->n_branches; c++) {
+                    if (r->branches[c].parent != b) continue;
+                    int fds[2] = { -1, -1 };
+                    if (!r->branches[c].n_stages) fds[1] = fcntl(r->branches[c].fd_output, F_DUPFD_CLOEXEC, 0);
+                    else if (pipe2(fds, O_CLOEXEC) < 0) perror("pipe");
+                    fd_branch[c] = fds[0];
+                    fd_outs[n_outs++] = fds[1];
+                }
+
+                stage->pid = spawn_fanout(fd_in, fd_outs, n_outs);
+                for (int j = 0; j < n_outs; j++) if (fd_outs[j] >= 0) close(fd_outs[j]);
+
+            }
+            else {
+
+                if (i == end - 1) pipe_fds[1] = fcntl(branch->fd_output, F_DUPFD_CLOEXEC, 0);
+                else if (pipe2(pipe_fds, O_CLOEXEC) < 0) perror("pipe");
+                if (pipe_fds[1] < 0) {
+                    close(fd_in);
+                    fd_in = -1;
+                    break;
+                }
+
+                stage->pid = spawn_planned(r, i, filters, fd_in, pipe_fds[1]);
+                close(pipe_fds[1]);
+
+            }
+
+            count_stage(r, i, filters);
+            close(fd_in);
+            fd_in = pipe_fds[0];
+
+        }
+
+        if (fd_in >= 0) close(fd_in);
+
+    }
+
+    return r->running ? 0 : -1;
+
+}
+
+/**
+ * @brief Starts the pipeline of filters of a request
+ * @param r Request to start
+ * @param filters Struct with the filters
+ * @return 0 if the pipeline started, -1 otherwise
+*/
+int start_request(REQUEST r, FILTERS filters) {
+
+    int fd_source, fd_output;
+    if (open_files(r, &fd_source, &fd_output) < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd_source, &st) == 0 && S_ISREG(st.st_mode)) r->bytes_in = st.st_size;
+    if (r->fd_output >= 0) preallocate_output(r, fd_output, filters);
+
+    // Starts from the stream of a cached prefix. Without one, the longest is looked up to count the miss
+    int fd_prefix = -1, k = r->first;
+    if (prefixes && !k) for (k = r->n_filters - 1; k > 0 && !*r->prefix_keys[k]; k--);
+    if (k > 0) fd_prefix = cache_lookup(prefixes, r->prefix_keys[k]);
+
+    // If the prefix left the cache, the whole chain runs
+    r->first = fd_prefix >= 0 ? k : 0;
+    if (fd_prefix >= 0) {
+        close(fd_source);
+        fd_source = fd_prefix;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &r->started);
+    r->n_stages = 0;
+    r->pgid = 0;
+    CPU_ZERO(&r->cpus);
+    r->domain = -1;
+
+    // Long sources are decoded first, then split in segments that run in parallel
+    if ((r->n_segments = count_segments(r, filters))) return start_decoding(r, fd_source, fd_output);
+
+    if (r->branches) plan_tree(r, filters);
+    else plan_stages(r, filters);
+
+    // The stages share a core each among the least loaded of one cache domain, so the streams between them stay in it
+    if (topology && settings.affinity) r->domain = topology_place(topology, r->n_stages, &r->cpus);
+
+    if (r->branches) return start_tree(r, filters, fd_source);
+
+    // Each stage reads from the previous one through a pipe
+    int fd_in = fd_source;
+    for (int i = 0; i < r->n_stages; i++) {
+
+        int pipe_fds[2] = { -1, fd_output };
+        if (i < r->n_stages - 1 && pipe2(pipe_fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            break;
+        }
+
+        r->stages[i].pid = spawn_planned(r, i, filters, fd_in, pipe_fds[1]);
+        count_stage(r, i, filters);
+
+        close(fd_in);
+        if (pipe_fds[1] != fd_output) close(pipe_fds[1]);
+        fd_in = pipe_fds[0];
+
+    }
+
+    if (fd_in >= 0) close(fd_in);
+    close(fd_output);
+
+    return r->running ? 0 : -1;
+
+}
+
+/**
+ * @brief Gets the seconds elapsed since a moment
+ * @param since Moment, in CLOCK_MONOTONIC
+*/
+double seconds_since(struct timespec * since) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+
+}
+
+/**
+ * @brief Tells the client of a request its new state. A client that doesn't read its connection
+ * makes the reply fail after REPLY_TIMEOUT instead of blocking the server
+ * @param r Request
+ * @param state New state
+ * @return 0 on success, -1 if the client couldn't be told
+*/
+int reply(REQUEST r, REQUEST_STATE state) {
+
+    if (!r->connection) return 0;
+    if (state == STATE_PROCESSING) return send_message(r->connection->fd, MESSAGE_STATE, r->tag, state, NULL, 0, NULL, 0);
+
+    // The end of a request carries its exit status and how long it waited and ran
+    COMPLETION completion = { r->exit_status, 0, seconds_since(&r->arrival), 0, r->usage.user + r->usage.system };
+    if (r->started.tv_sec || r->started.tv_nsec) {
+        completion.running = seconds_since(&r->started);
+        completion.queued -= completion.running;
+    }
+
+    return send_message(r->connection->fd, MESSAGE_STATE, r->tag, state, (char *) &completion, sizeof(completion), NULL, 0);
+
+}
+
+/**
+ * @brief Gets the seconds between two moments
+ * @param from First moment, in CLOCK_MONOTONIC
+ * @param to Second moment
+*/
+double seconds_between(struct timespec * from, struct timespec * to) {
+
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+
+}
+
+/**
+ * @brief Records what a request that ended took in the metrics. Segments count in their parent
+ * @param r Request that ended
+ * @param result "done", "failed", "cancelled", "expired", "rejected" or "cached"
+*/
+void record_metrics(REQUEST r, char * result) {
+
+    if (!metrics || r->parent) return;
+
+    JOB_METRICS job = { r->task, r->chain_name, r->source_path, r->output_path, result, r->exit_status,
+                        { -1, -1, -1, -1 }, r->stages_run, r->usage, r->bytes_in, -1 };
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    job.seconds[PHASE_TOTAL] = seconds_between(&r->arrival, &now);
+    if (r->admitted.tv_sec || r->admitted.tv_nsec) {
+        job.seconds[PHASE_QUEUED] = seconds_between(&r->arrival, &r->admitted);
+        job.seconds[PHASE_SPAWN] = seconds_between(&r->admitted, &r->spawned);
+        job.seconds[PHASE_RUN] = seconds_between(&r->spawned, &now);
+    }
+    else job.seconds[PHASE_QUEUED] = job.seconds[PHASE_TOTAL];
+
+    struct stat st;
+    if (r->fd_output >= 0 && fstat(r->fd_output, &st) == 0 && S_ISREG(st.st_mode)) job.bytes_out = st.st_size;
+
+    metrics_record(metrics, &job);
+
+}
+
+/**
+ * @brief Informs the client that a request ended and frees it
+ * @param r Request that ended
+*/
+void finish_request(REQUEST r) {
+
+    // A request that ends well without being admitted was served from the cache
+    int admitted = r->admitted.tv_sec || r->admitted.tv_nsec;
+    record_metrics(r, r->rejected ? "rejected" : r->expired ? "expired" : r->cancelled ? "cancelled" :
+                      r->failed ? "failed" : admitted ? "done" : "cached");
+
+    // Writes that the request was finalized
+    reply(r, r->rejected ? STATE_REJECTED : r->expired ? STATE_EXPIRED : r->cancelled ? STATE_CANCELLED :
+             r->failed ? STATE_FAILED : STATE_DONE);
+    if (r->journaled) journal_end(journal, r->task);
+    free_request(r);
+
+}
+
+/**
+ * @brief Describes what the planned chain of a request does, including the versions of its filters
+ * and the settings that change the output, for the key of the output in the cache
+ * @param r Request
+ * @param filters Struct with the filters
+ * @param n Number of filters to describe, from the start of the chain
+ * @param buffer Where to write
+ * @param size Size of the buffer
+*/
+void describe_chain(REQUEST r, FILTERS filters, int n, char * buffer, int size) {
+
+    int length = snprintf(buffer, size, "%d|%s|%s|%d|%d", settings.raw_pipeline, settings.decoder, settings.encoder, 
+                                                                    settings.pcm_rate, settings.pcm_channels);
+
+    for (int i = 0; i < n && length < size; i++) {
+
+        FILTER * filter = &filters->filter[r->chain[i]];
+        if (filter->builtin) {
+            EFFECT * e = &filter->effect;
+            length += snprintf(buffer + length, size - length, "|%s:builtin:%d:%g:%g:%g:%g", filter->filter_name, 
+                                                        e->type, e->gain, e->tempo, e->in_gain, e->out_gain);
+            for (int j = 0; j < e->n_taps && length < size; j++)
+                length += snprintf(buffer + length, size - length, ":%g/%g", e->delays[j], e->decays[j]);
+        }
+        else {
+            // The executable is identified by its size and modification time
+            struct stat st;
+            if (stat(filter->filter_path, &st) < 0) memset(&st, 0, sizeof(st));
+            length += snprintf(buffer + length, size - length, "|%s:%s:%d:%lld:%lld.%09ld", filter->filter_name, 
+                                filter->filter_path, filter->raw_io, (long long) st.st_size, 
+                                (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        }
+
+    }
+
+}
+
+/**
+ * @brief Builds the keys of the output of a request and of the stream after each stage boundary of its chain
+ * @param r Request
+ * @param filters Struct with the filters
+ * @param source_id Identifier of the source, from cache_source
+*/
+void key_request(REQUEST r, FILTERS filters, char * source_id) {
+
+    char description[MAX * 4];
+    describe_chain(r, filters, r->n_filters, description, sizeof(description));
+
+    // A preview is cached by its window, and its streams aren't the prefixes of the whole source
+    if (r->preview) {
+        int length = strlen(description);
+        snprintf(description + length, sizeof(description) - length, "|window|%.6f|%.6f|%s", r->start, r->duration,
+                                                       settings.window_decoder ? settings.window_decoder : "");
+    }
+    cache_key(r->key, source_id, description);
+    if (!prefixes || r->preview) return;
+
+    // The format of the stream is part of the key, so a prefix always restarts the same pipeline
+    plan_stages(r, filters);
+    for (int i = 0; i < r->n_stages; i++) {
+
+        STAGE * stage = &r->stages[i];
+        int k = stage->last;
+        if ((stage->type != STAGE_EXTERNAL && stage->type != STAGE_BUILTIN) || k == r->n_filters) continue;
+
+        describe_chain(r, filters, k, description, sizeof(description));
+        int length = strlen(description);
+        snprintf(description + length, sizeof(description) - length, "|prefix|%d", stage->raw);
+        cache_key(r->prefix_keys[k], source_id, description);
+        r->prefix_raw[k] = stage->raw;
+
+    }
+    r->n_stages = 0;
+
+}
+
+/**
+ * @brief Starts a request after the longest prefix of its chain whose stream is cached,
+ * the filters of the prefix aren't admitted
+ * @param r Pending request
+*/
+void find_prefix(REQUEST r) {
+
+    // Nothing changes until an entry is added or removed
+    if (!prefixes || r->prefix_generation == cache_generation(prefixes)) return;
+    r->prefix_generation = cache_generation(prefixes);
+
+    int first = 0;
+    for (int k = r->n_filters - 1; !first && k > 0; k--)
+        if (*r->prefix_keys[k] && cache_contains(prefixes, r->prefix_keys[k])) first = k;
+
+    if (first != r->first) {
+        r->first = first;
+        count_uses(r);
+    }
+
+}
+
+/**
+ * @brief Finds a request with the given cache key
+ * @param r Struct with the requests
+ * @param key Key to find
+ * @return The request, or NULL if none has the key
+*/
+REQUEST find_key(REQUEST r, char * key) {
+
+    while (r && strcmp(r->key, key)) r = r->next;
+
+    return r;
+
+}
+
+/**
+ * @brief Tells the client of a request whose output is already in place that it's done,
+ * the request never uses any filter
+ * @param r Request
+*/
+void serve_request(REQUEST r) {
+
+    reply(r, STATE_PROCESSING);
+    finish_request(r);
+
+}
+
+/**
+ * @brief Removes the files of a request split in segments
+ * @param r Request
+*/
+void remove_segments(REQUEST r) {
+
+    char path[MAX];
+    snprintf(path, MAX, DECODED_PATH, r->task);
+    unlink(path);
+    for (int i = 0; i < r->n_segments; i++) {
+        snprintf(path, MAX, SEGMENT_PATH, r->task, i);
+        unlink(path);
+    }
+
+}
+
+/**
+ * @brief Ends a request whose stages all ended: its output is cached and the identical requests that
+ * waited for it are served with it, or go back to the pending requests if it failed
+ * @param r Request that ended
+ * @param pending Pointer to the struct with the pending requests
+*/
+void complete_request(REQUEST r, REQUEST * pending) {
+
+    if (r->n_segments) remove_segments(r);
+    if (r->preallocated) trim_output(r);
+    if (cache && *r->key && !r->failed) cache_store(cache, r->key, r->fd_output);
+
+    // The streams kept by taps are worth the time their prefix took
+    for (int i = 0; i < r->n_stages; i++) {
+        STAGE * stage = &r->stages[i];
+        if (!stage->tapped) continue;
+        if (!r->failed && !stage->status) cache_commit(prefixes, r->prefix_keys[stage->first], stage->seconds);
+        else cache_abort(prefixes, r->prefix_keys[stage->first]);
+    }
+
+    REQUEST leader = NULL;
+    while (r->followers) {
+
+        REQUEST follower = r->followers;
+        r->followers = follower->next;
+        follower->next = NULL;
+
+        // If the output didn't stay in the cache, it's copied directly
+        if (!r->failed && attach_files(follower) == 0 &&
+                          (cache_fetch(cache, follower->key, follower->fd_output) == 0 || 
+                           cache_copy(r->fd_output, follower->fd_output) == 0))
+            serve_request(follower);
+        else if (!leader && pending) {
+            leader = follower;
+            add_request(pending, leader);
+        }
+        else if (leader) {
+            follower->next = leader->followers;
+            leader->followers = follower;
+        }
+        else finish_request(follower);
+
+    }
+
+    finish_request(r);
+
+}
+
+/**
+ * @brief Records in the journal that the source of a request was decoded, or that one of its segments ended,
+ * once the file is on storage, so a server started again after a crash resumes it from there
+ * @param r Request
+ * @param segment Segment that ended, -1 for the decoded source
+*/
+void checkpoint(REQUEST r, int segment) {
+
+    char path[MAX];
+    if (segment < 0) snprintf(path, MAX, DECODED_PATH, r->task);
+    else snprintf(path, MAX, SEGMENT_PATH, r->task, segment);
+
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    int synced = fdatasync(fd) == 0 && fstat(fd, &st) == 0;
+    close(fd);
+    if (!synced) return;
+
+    if (segment < 0) journal_decode(journal, r->task, st.st_size, r->n_segments);
+    else journal_segment(journal, r->task, segment, r->segments[segment].from, r->segments[segment].to);
+
+}
+
+/**
+ * @brief Tells if a segment of a request replayed from the journal ended before the crash, with the same
+ * range and its output still there
+ * @param r Request
+ * @param segment Segment
+ * @return 1 if it ended, 0 if it has to run
+*/
+int checkpointed(REQUEST r, int segment) {
+
+    JOURNAL_JOB * job = r->journaled ? journal_find(journal, r->task) : NULL;
+    if (!job) return 0;
+
+    char path[MAX];
+    snprintf(path, MAX, SEGMENT_PATH, r->task, segment);
+    for (int i = 0; i < job->n_checkpoints; i++) {
+        JOURNAL_CHECKPOINT * c = &job->checkpoints[i];
+        if (c->segment == segment && c->from == r->segments[segment].from && c->to == r->segments[segment].to)
+            return access(path, F_OK) == 0;
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Splits a request whose source was decoded in segments, which go to the pending requests.
+ * Each segment reads some input before its range, enough for the filters to give the same output
+ * there as on the whole source, and that part of its output is left out when they're joined
+ * @param r Request
+ * @param pending Pointer to the struct with the pending requests
+ * @param filters Struct with the filters
+ * @return 0 if split, -1 on error
+*/
+int split_request(REQUEST r, REQUEST * pending, FILTERS filters) {
+
+    char path[MAX];
+    struct stat st;
+    snprintf(path, MAX, DECODED_PATH, r->task);
+    long long frame = sizeof(float) * settings.pcm_channels;
+    if (stat(path, &st) < 0 || st.st_size <= (off_t) sizeof(PCM_HEADER)) return -1;
+    long long frames = (st.st_size - sizeof(PCM_HEADER)) / frame;
+
+    // Warm-up and output positions are counted in frames of the source, through the tempo changes
+    double tempo;
+    int exact;
+    long long warmup_frames = chain_warmup(r, filters, &tempo, &exact);
+
+    // Without exact joins, segments go on past their range to be crossfaded with the next one
+    int overlap = exact ? 0 : DSP_CROSSFADE * settings.pcm_rate;
+    long long lead_out = exact ? 0 : ceil((DSP_CROSSFADE + DSP_JOIN_SEARCH) * tempo * settings.pcm_rate) + warmup_frames;
+
+    long long length = (frames + r->n_segments - 1) / r->n_segments;
+    if (length < 1) length = 1;
+    r->segments = arena_alloc(r->arena, r->n_segments * sizeof(SEGMENT));
+    int n = 0;
+    for (long long start = 0; start < frames && n < r->n_segments; start += length, n++) {
+
+        SEGMENT * segment = &r->segments[n];
+        long long end = start + length < frames ? start + length : frames;
+        segment->from = start > warmup_frames ? start - warmup_frames : 0;
+        segment->to = end + lead_out < frames ? end + lead_out : frames;
+        segment->skip = llround(start / tempo) - llround(segment->from / tempo);
+        segment->keep = end < frames ? llround(end / tempo) - llround(start / tempo) : -1;
+        segment->overlap = overlap;
+
+    }
+    r->n_segments = n;
+    r->segments_left = n;
+    if (!n) return -1;
+
+    // Segments are scheduled like any request, with the priority and the age of their parent.
+    // The ones that ended before a crash aren't
+    for (int i = 0; i < n; i++) {
+
+        if (checkpointed(r, i)) {
+            r->segments_left--;
+            recovery.resumed++;
+            continue;
+        }
+        if (r->replayed) recovery.redone++;
+
+        REQUEST s = alloc_request();
+        ARENA arena = s->arena;
+        *s = *r;
+        s->arena = arena;
+        s->source_path = arena_strdup(arena, path);
+        char output_path[MAX];
+        snprintf(output_path, MAX, SEGMENT_PATH, r->task, i);
+        s->output_path = arena_strdup(arena, output_path);
+        s->fd_source = -1;
+        s->fd_output = -1;
+        s->by_name = 0;
+        s->connection = NULL;
+        s->journaled = 0;
+        s->replayed = 0;
+        s->key[0] = '\0';
+        memset(s->prefix_keys, 0, sizeof(s->prefix_keys));
+        s->followers = NULL;
+        s->parent = r;
+        s->segment = i;
+        s->n_segments = 0;
+        s->segments_left = 0;
+        s->segments = NULL;
+        s->n_stages = 0;
+        memset(&s->usage, 0, sizeof(s->usage));
+        s->stages_run = 0;
+        s->prefetched = 0;
+        s->preallocated = 0;
+        s->chain_name = NULL;
+        s->next = NULL;
+        add_request(pending, s);
+
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Joins the segments of a running request once they all ended, or completes it if any failed.
+ * The decoded source is only kept while a crash could need it again
+ * @param r Request
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+*/
+void stitch_request(REQUEST r, REQUEST * pending, REQUEST * running) {
+
+    char path[MAX];
+    snprintf(path, MAX, DECODED_PATH, r->task);
+    if (!r->journaled) unlink(path);
+
+    if (!r->failed) {
+        int fd_output = fcntl(r->fd_output, F_DUPFD_CLOEXEC, 0);
+        if (fd_output < 0) perror("output");
+        else {
+            add_stage(r, STAGE_STITCH, r->n_filters, r->n_filters, 1);
+            STAGE * stage = &r->stages[r->n_stages - 1];
+            stage->pid = spawn_stitch(r, fd_output);
+            if (stage->pid > 0) r->running++;
+            else stage->pid = 0;
+            r->pgid = stage->pid;
+            close(fd_output);
+        }
+    }
+
+    if (!r->running) {
+        r->failed = 1;
+        REQUEST * tmp = running;
+        while (*tmp != r) tmp = &(*tmp)->next;
+        *tmp = r->next;
+        complete_request(r, pending);
+    }
+
+}
+
+/**
+ * @brief Ends a segment. Once every segment of its parent ended, they're joined into the output,
+ * and if any failed the parent fails too
+ * @param r Segment that ended
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+*/
+void end_segment(REQUEST r, REQUEST * pending, REQUEST * running) {
+
+    REQUEST parent = r->parent;
+    if (!r->failed && parent->journaled) checkpoint(parent, r->segment);
+    if (r->failed && !parent->failed) {
+        parent->failed = 1;
+        parent->exit_status = r->exit_status;
+    }
+    add_usage(&parent->usage, &r->usage);
+    parent->stages_run += r->stages_run;
+    parent->segments_left--;
+    finish_request(r);
+
+    // Segments of a failed request that didn't start yet aren't run
+    if (parent->failed)
+        for (REQUEST * tmp = pending; *tmp;) {
+            REQUEST s = *tmp;
+            if (s->parent != parent) tmp = &s->next;
+            else {
+                *tmp = s->next;
+                parent->segments_left--;
+                finish_request(s);
+            }
+        }
+
+    if (!parent->segments_left) stitch_request(parent, pending, running);
+
+}
+
+/**
+ * @brief Reserves the filters a request needs, so requests with lower scores can't take them
+ * @param filters Struct with the filters
+ * @param r Request that is starving
+*/
+void reserve_filters(FILTERS filters, REQUEST r) {
+
+    for (int i = 0; i < r->n_uses; i++) {
+
+        int id = r->uses[i][0], needed = r->uses[i][1];
+        if (needed > filters->filter[id].limit) needed = filters->filter[id].limit;
+        filters->reserved[id] += needed;
+
+    }
+    filters->cost_reserved += request_cost(filters, r);
+
+}
+
+/**
+ * @brief Starts a request, moving it to the running requests
+ * @param r Request to start
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
+*/
+void admit_request(REQUEST r, REQUEST * pending, REQUEST * running, FILTERS filters) {
+
+    // Informs the client that the request is processing, a client that's gone can't be informed.
+    // It only hears of segments through their parent
+    clock_gettime(CLOCK_MONOTONIC, &r->admitted);
+    if (reply(r, STATE_PROCESSING) < 0 || start_request(r, filters) < 0) r->failed = 1;
+    clock_gettime(CLOCK_MONOTONIC, &r->spawned);
+    if (r->replayed && !r->n_segments) recovery.redone++;
+
+    // A request resumed from the journal has its source decoded already, and maybe all of its segments
+    if (!r->failed && r->n_segments && !r->running && split_request(r, pending, filters) < 0) r->failed = 1;
+
+    // Stages that did start still hold their filters until collected
+    if (r->failed && !r->running)
+        complete_request(r, pending);
+    else {
+        r->next = *running;
+        *running = r;
+        if (r->n_segments && !r->running && !r->segments_left) stitch_request(r, pending, running);
+    }
+
+}
+
+/**
+ * @brief Pending request and the score it has in a dispatch
+*/
+typedef struct candidate {
+
+    REQUEST r;
+    double waited; // Seconds since the request arrived
+    double score;
+
+} CANDIDATE;
+
+/**
+ * @brief Orders candidates from the highest to the lowest score, the oldest first on ties, with previews before the rest
+ * @param a First candidate
+ * @param b Second candidate
+ * @return Negative if a goes first, positive if b goes first
+*/
+int compare_candidates(const void * a, const void * b) {
+
+    const CANDIDATE * x = a, * y = b;
+    if (x->r->preview != y->r->preview) return y->r->preview - x->r->preview;
+    if (x->score != y->score) return x->score < y->score ? 1 : -1;
+    return x->r->task - y->r->task;
+
+}
+
+/**
+ * @brief Starts every pending request whose filters are available, the ones with higher scores first
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
+*/
+void dispatch_requests(REQUEST * pending, REQUEST * running, FILTERS filters) {
+
+    int n_pending = 0;
+    for (REQUEST r = *pending; r; r = r->next) n_pending++;
+    if (!n_pending) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Scores each request by its waiting time and priority, minus the share its client already has
+    CANDIDATE candidates[n_pending];
+    int i = 0;
+    for (REQUEST r = *pending; r; r = r->next, i++) {
+
+        double waited = (now.tv_sec - r->arrival.tv_sec) + (now.tv_nsec - r->arrival.tv_nsec) / 1e9;
+        int client_running = 0;
+        for (REQUEST tmp = *running; tmp; tmp = tmp->next)
+            if (tmp->client == r->client) client_running++;
+
+        candidates[i].r = r;
+        candidates[i].waited = waited;
+        candidates[i].score = waited + r->priority * PRIORITY_WEIGHT - client_running * FAIR_SHARE_WEIGHT;
+
+    }
+    qsort(candidates, n_pending, sizeof(CANDIDATE), compare_candidates);
+
+    memset(filters->reserved, 0, sizeof(filters->reserved));
+    filters->cost_reserved = 0;
+
+    // Sources of the waiting requests are read ahead in the order they're started, within the budget
+    long long prefetch_left = settings.prefetch_size;
+    for (REQUEST r = *pending; r; r = r->next) prefetch_left -= r->prefetched;
+
+    // Any request that fits is started, even if requests before it are waiting for their filters
+    int n_admitted = 0;
+    for (i = 0; i < n_pending; i++) {
+
+        REQUEST r = candidates[i].r;
+        find_prefix(r);
+
+        if (valid_request(filters, r)) {
+
+            REQUEST * tmp = pending;
+            while (*tmp != r) tmp = &(*tmp)->next;
+            *tmp = r->next;
+            r->next = NULL;
+
+            admit_request(r, pending, running, filters);
+            n_admitted++;
+
+        }
+        else {
+            if (candidates[i].waited >= AGING_LIMIT) reserve_filters(filters, r);
+            if (!r->prefetched) prefetch_left -= prefetch_source(r, prefetch_left);
+        }
+
+    }
+
+    // A request resumed from the journal adds its segments as it starts, they're tried in another pass
+    int n_left = 0;
+    for (REQUEST r = *pending; r; r = r->next) n_left++;
+    if (n_left > n_pending - n_admitted) dispatch_requests(pending, running, filters);
+
+}
+
+/**
+ * @brief Reads how many threads of the host are runnable, besides the server
+ * @return Runnable threads, -1 if unknown
+*/
+int runnable_threads(void) {
+
+    FILE * f = fopen("/proc/stat", "re");
+    if (!f) return -1;
+
+    char line[MAX];
+    int runnable = -1;
+    while (runnable < 0 && fgets(line, sizeof(line), f))
+        if (sscanf(line, "procs_running %d", &runnable) == 1) runnable--;
+    fclose(f);
+
+    return runnable;
+
+}
+
+/**
+ * @brief Adjusts the limit of each filter, with additive increase and multiplicative decrease. A filter that
+ * requests wait for gets another instance, unless its throughput dropped since the last one it got, which is
+ * taken back. Filters in use lose a share of their limit while the host has more runnable threads than cores
+ * can take, since more instances would only make them compete
+ * @param filters Struct with the filters
+ * @param pending Struct with the pending requests
+ * @return Milliseconds until the next adjustment, -1 if limits aren't adjusted
+*/
+int adapt_limits(FILTERS filters, REQUEST pending) {
+
+    if (!settings.adapt_interval) return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = seconds_between(&adapted, &now);
+    if (elapsed * 1000 < settings.adapt_interval) return settings.adapt_interval - elapsed * 1000 + 1;
+    adapted = now;
+
+    // A filter is short if a waiting request needs more instances than its limit leaves
+    int short_of[MAX_FILTERS] = { 0 };
+    for (REQUEST r = pending; r; r = r->next)
+        for (int i = 0; i < r->n_uses; i++) {
+            int id = r->uses[i][0], needed = r->uses[i][1];
+            if (needed > filters->filter[id].limit) needed = filters->filter[id].limit;
+            if (filters->usage[id] + needed > filters->filter[id].limit) short_of[id] = 1;
+        }
+
+    int runnable = runnable_threads();
+    int overloaded = runnable > ADAPT_OVERLOAD * sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int id = 0; id < filters->n_filters; id++) {
+
+        FILTER * filter = &filters->filter[id];
+        double rate = ADAPT_SMOOTHING * filter->completed / elapsed + (1 - ADAPT_SMOOTHING) * filter->rate;
+        int limit = filter->limit;
+
+        if (overloaded && filters->usage[id]) limit *= ADAPT_DECREASE;
+        else if (short_of[id]) limit += filter->grew && rate < filter->rate * (1 - ADAPT_TOLERANCE) ? -1 : 1;
+
+        filter->grew = limit > filter->limit;
+        filter->limit = limit;
+        clamp_limit(filter);
+        filter->completed = 0;
+        filter->rate = rate;
+
+    }
+
+    return settings.adapt_interval;
+
+}
+
+/**
+ * @brief Ends a stage of a running request, and the request with its last stage
+ * @param link Pointer to the link to the request among the running requests
+ * @param i Index of the stage
+ * @param status Status of the stage, as given by waitpid
+ * @param usage Resources the stage took, NULL if unknown
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
+*/
+void end_stage(REQUEST * link, int i, int status, USAGE * usage, REQUEST * pending, REQUEST * running, FILTERS filters) {
+
+    REQUEST r = *link;
+    STAGE * stage = &r->stages[i];
+    stage->pid = 0;
+    if (usage) add_usage(&r->usage, usage);
+    r->stages_run++;
+    stage->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    stage->seconds = seconds_since(&r->started);
+
+    // A tap that couldn't keep its copy still passed the stream on, and the decoder of a preview
+    // is cut short by its window
+    int cut = stage->type == STAGE_DECODER && i + 1 < r->n_stages && r->stages[i + 1].type == STAGE_WINDOW &&
+              ((WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE) || stage->status == 128 + SIGPIPE);
+    if (stage->status && !cut && !(stage->type == STAGE_TAP && stage->status == TAP_UNCACHED)) {
+        if (!r->failed) r->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        r->failed = 1;
+    }
+    for (int j = stage->first; j < stage->last; j++) {
+        filters->usage[r->chain[j]]--;
+        filters->filter[r->chain[j]].completed++;
+    }
+    filters->cost_used -= stage->cost;
+    if (filters->cost_used < 1e-9) filters->cost_used = 0;
+    if (r->domain >= 0) topology_load(topology, &r->cpus, -1);
+
+    // The request ends when its last stage does, unless its source was decoded to be split
+    if (--r->running == 0) {
+        if (r->n_segments && !r->segments && !r->failed) {
+            if (r->journaled) checkpoint(r, -1);
+            if (split_request(r, pending, filters) < 0) r->failed = 1;
+        }
+        if (!r->segments_left || r->failed) {
+            *link = r->next;
+            if (r->parent) end_segment(r, pending, running);
+            else complete_request(r, pending);
+        }
+    }
+
+}
 
 /**
- * @brief Struct with information for each filter 
+ * @brief Ends the stage a worker was running, if any
+ * @param w Worker
+ * @param status Status of the stage, as given by waitpid
+ * @param usage Resources the stage took, NULL if unknown
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
 */
-typedef struct filters {
+void end_job(WORKER * w, int status, USAGE * usage, REQUEST * pending, REQUEST * running, FILTERS filters) {
 
-    char * filter_name;
-    char * filter_path;
-    int usage;
-    int max;
-    struct filters * next;
+    if (!w->r) return;
 
-}* FILTERS;
+    REQUEST * link = running;
+    while (*link != w->r) link = &(*link)->next;
+    w->r = NULL;
+
+    // A worker of a filter that changed exits once its socket ends, and is collected like any other
+    if (w->stale && w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    end_stage(link, w->stage, status, usage, pending, running, filters);
+
+}
 
 /**
- * @brief Adds a filter to the struct of filters
- * @param f Struct to add to
- * @param filter_name Name of the filter
- * @param filter_exec Name of the executable to the filter
- * @param max Maximum of instances of usage of the filter 
- * @param filters_folder Path to the filters folder
+ * @brief Reads the answer of a worker to its job. A worker that hung up or broke the protocol is killed,
+ * and its stage ends once it's collected
+ * @param w Worker
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
 */
-void add_filter(FILTERS * f, char * filter_name, char * filter_exec, int max, char * filters_folder) {
+void read_worker(WORKER * w, REQUEST * pending, REQUEST * running, FILTERS filters) {
 
-    // Find last position of the struct to append
-    while (*f) f = &(*f)->next;
-    *f = malloc(sizeof(struct filters));
-    (*f)->filter_name = filter_name;
+    char buffer[sizeof(MESSAGE_HEADER) + sizeof(USAGE)];
+    int n_fds = 0;
+    ssize_t bytes_read = receive_bytes(w->fd, buffer, sizeof(buffer), NULL, &n_fds, 0, MSG_DONTWAIT);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) return;
 
-    // Creates the path to the executable of the filter
-    char * filter_path = malloc(MAX);
-    snprintf(filter_path, MAX, "%s/%s", filters_folder, filter_exec);
-    (*f)->filter_path = filter_path;
+    MESSAGE_HEADER header;
+    char * payload;
+    if (bytes_read <= 0 || parse_message(buffer, bytes_read, &header, &payload) <= 0 || header.type != MESSAGE_STATE) {
+        close(w->fd);
+        w->fd = -1;
+        kill(w->pid, SIGKILL);
+        return;
+    }
 
-    (*f)->max = max;
-    (*f)->usage = 0;
-    (*f)->next = NULL;
+    // Resources are only known if the worker sent them
+    USAGE usage;
+    int known = header.length == sizeof(USAGE);
+    if (known) memcpy(&usage, payload, sizeof(USAGE));
+    end_job(w, W_EXITCODE(header.tag & 0xff, 0), known ? &usage : NULL, pending, running, filters);
 
 }
 
 /**
- * @brief Configures the server with the config file and the path to the filters_folder
- * @param config_filename File with the information necessary
- * @param filters_folder Path to the filters folder
- * @returns Struct with the filters struct configured
+ * @brief Collects the stages that ended, and the workers that died
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
 */
-FILTERS configure(char * config_filename, char * filters_folder) {
+void collect_stages(REQUEST * pending, REQUEST * running, FILTERS filters) {
+
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+
+        // A worker is started again when it's needed. What it took over its life isn't its job's
+        WORKER * w = find_worker(filters, pid, -1);
+        if (w) {
+            if (w->fd >= 0) close(w->fd);
+            w->fd = -1;
+            w->pid = 0;
+            end_job(w, status, NULL, pending, running, filters);
+            continue;
+        }
+
+        USAGE usage;
+        usage_of(&ru, &usage);
+
+        for (REQUEST * tmp = running; *tmp; tmp = &(*tmp)->next) {
+
+            REQUEST r = *tmp;
+            int i;
+            for (i = 0; i < r->n_stages && r->stages[i].pid != pid; i++);
+            if (i == r->n_stages) continue;
+
+            end_stage(tmp, i, status, &usage, pending, running, filters);
+            break;
+
+        }
 
-    // Open the configuration file
-    int fd = open(config_filename, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        exit(1);
     }
 
-    FILTERS f = NULL;
-    char * buffer = malloc(MAX);
-    char *save; // Necessary for strtok_r usage
-    while (read(fd, buffer, MAX) > 0) {
-        
-        char * filter_name = strtok_r(buffer, " ", &save);  
-        while (filter_name) {
+}
+
+/**
+ * @brief Writes a request sent by name to the journal, with its paths made absolute, so a server started
+ * again after a crash can run it without its client
+ * @param r Request
+ * @param c Connection of the client
+ * @param fields Strings of the message
+ * @param n_fields Number of strings
+*/
+void journal_request(REQUEST r, CONNECTION c, char * fields[], int n_fields) {
+
+    char link[64], directory[MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", c->fd_directory);
+    ssize_t n = readlink(link, directory, MAX - 1);
+    if (n <= 0) return;
+    directory[n] = '\0';
 
-            char * filter_executable = strdup(strtok_r(NULL, " ", &save));
-            int filter_max = atoi(strtok_r(NULL, "\n", &save));
-            // Adds a filter to the struct
-            add_filter(&f, strdup(filter_name), filter_executable, filter_max, filters_folder);
-            filter_name = strtok_r(NULL, " ", &save);
+    // The source, the first output and the output after each empty string are paths
+    char * payload = scratch;
+    uint32_t length = 0;
+    int valid = 1;
+    for (int i = 0; valid && i < n_fields; i++) {
 
+        char path[MAX];
+        int is_path = i < 2 || (i > TRANSFORM_FILTERS && !*fields[i - 1]);
+        if (is_path && fields[i][0] != '/') {
+            valid = snprintf(path, MAX, "%s/%s", directory, fields[i]) < MAX;
+            valid = valid && pack_string(payload, &length, path) == 0;
         }
-      
+        else valid = pack_string(payload, &length, fields[i]) == 0;
+
     }
 
-    close(fd);
-    free(buffer);
+    if (valid && journal_accept(journal, r->task, payload, length) == 0) r->journaled = 1;
 
-    return f;
 }
 
 /**
- * @brief Frees a filters struct
+ * @brief Adds a transform sent by a client to the requests. Its files are the descriptors sent with it,
+ * or names relative to the directory the client sent, which are only opened while the request is handled
+ * @param c Connection of the client
+ * @param tag Identifier the client gave the request
+ * @param fields Strings of the message
+ * @param n_fields Number of strings
+ * @param fds Descriptors sent with the message, taken by the request
+ * @param n_fds Number of descriptors, 0 or 2
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Struct with the running requests
  * @param filters Struct with the filters
 */
-void free_filters(FILTERS filters) {
+void add_transform(CONNECTION c, uint32_t tag, char * fields[], int n_fields, int fds[], int n_fds, 
+                   REQUEST * pending, REQUEST running, FILTERS filters) {
 
-    while (filters) {
+    REQUEST r = new_request(fields, n_fields, filters);
+    r->client = c->client;
+    r->connection = c;
+    r->tag = tag;
+    c->refs++;
+    if (n_fds == 2) {
+        r->fd_source = fds[0];
+        r->fd_output = fds[1];
+    }
+    else r->by_name = 1;
+
+    // Over the cap, a request is turned away before any work is done for it. Segments don't count
+    int n_waiting = 0;
+    for (REQUEST tmp = *pending; tmp; tmp = tmp->next) n_waiting += !tmp->parent;
+    if (settings.max_queue > 0 && n_waiting >= settings.max_queue) {
+        r->failed = 1;
+        r->rejected = 1;
+        finish_request(r);
+        return;
+    }
+
+    // Requests with unknown filters, or whose files can't be opened, are ended right away. Trees are sent by name
+    if (!r->n_typed || (r->branches && !r->by_name) || (r->by_name && (c->fd_directory < 0 || attach_files(r) < 0))) {
+        r->failed = 1;
+        finish_request(r);
+        return;
+    }
+    if (journal && r->by_name) journal_request(r, c, fields, n_fields);
+
+    // A tree runs as it was sent and isn't cached, its branches share their filters instead
+    if (settings.optimize && !r->branches) optimize_chain(r, filters);
+    count_uses(r);
+
+    char source_id[CACHE_KEY_SIZE];
+    if (!cache || r->branches || !cacheable(r) || cache_source(source_id, r->fd_source, settings.cache_by_content) < 0) {
+        detach_files(r);
+        add_request(pending, r);
+        return;
+    }
 
-        FILTERS tmp = filters;
-        filters = filters->next;
-        free(tmp->filter_name);
-        free(tmp->filter_path);
-        free(tmp);
+    key_request(r, filters, source_id);
 
+    // An identical request already on its way is followed instead of run again
+    REQUEST leader = find_key(*pending, r->key);
+    if (!leader) leader = find_key(running, r->key);
+    if (leader) {
+        detach_files(r);
+        r->next = leader->followers;
+        leader->followers = r;
+    }
+    else if (cache_fetch(cache, r->key, r->fd_output) == 0) serve_request(r);
+    else {
+        detach_files(r);
+        add_request(pending, r);
     }
 
 }
 
 /**
- * @brief Counts the number of filters in a string of filters
- * @param filters String with the filters
- * @return Counts the number of filters to apply
+ * @brief Finds the request a client gave a tag to
+ * @param r Pointer to the struct with the requests
+ * @param c Connection of the client, NULL to find the task numbered by the tag instead, of any client
+ * @param tag Tag of the request
+ * @param followers If true, searches the requests that follow the ones in the struct instead
+ * @return Pointer to the link to the request, NULL if it's not there
 */
-int count_filters(char * filters) {
+REQUEST * find_tag(REQUEST * r, CONNECTION c, uint32_t tag, int followers) {
 
-    char * buffer = strdup(filters);
+    for (; *r; r = &(*r)->next) {
 
-    strtok(buffer, " ");
-    int count = 1;
+        REQUEST * found = followers ? find_tag(&(*r)->followers, c, tag, 0) : NULL;
+        if (found) return found;
+        if (followers || (*r)->parent) continue;
+        if (c ? (*r)->connection == c && (*r)->tag == tag : (*r)->task == (int) tag) return r;
 
-    while (strtok(NULL, " "))
-        count++;
+    }
 
-    free(buffer);
+    return NULL;
+
+}
+
+/**
+ * @brief Kills the stages of a request that are still running, with the processes they started
+ * @param r Request
+*/
+void kill_stages(REQUEST r) {
 
-    return count;
+    // A worker is killed with its job, the other stages with the process group they share
+    int grouped = 0;
+    for (int i = 0; i < r->n_stages; i++)
+        if (r->stages[i].pid) {
+            kill(r->stages[i].pid, SIGKILL);
+            grouped |= !r->stages[i].worker;
+        }
+    if (grouped && r->pgid) kill(-r->pgid, SIGKILL);
 
 }
 
 /**
- * @brief Returns the executable path from the filter name
- * @param filters Struct with all the filters
- * @param filter Filter name
- * @return Executable path
+ * @brief Ends a request before its time. One that waits leaves right away, one that runs has its stages killed
+ * and ends once they're collected, which gives their filters back
+ * @param link Pointer to the link to the request
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
 */
-char * finds_executable(FILTERS filters, char * filter) {
+void abort_request(REQUEST * link, REQUEST * pending, REQUEST * running) {
 
-    char * ret = NULL;
-    
-    for (; !ret && filters; filters = filters->next) {
+    REQUEST r = *link;
+    r->failed = 1;
+    r->cancelled = 1;
 
-        // If the name matches, return filter executable path
-        if (!strcmp(filter, filters->filter_name)) 
-            ret = filters->filter_path;
+    // The requests that follow one that waits go back to the pending requests
+    if (!r->admitted.tv_sec && !r->admitted.tv_nsec) {
+        *link = r->next;
+        r->next = NULL;
+        complete_request(r, pending);
+        return;
+    }
+
+    for (REQUEST s = *running; s; s = s->next)
+        if (s == r || s->parent == r) kill_stages(s);
 
+    // Segments that didn't start aren't run, and without any running the request ends here
+    for (REQUEST * tmp = pending; *tmp;) {
+        REQUEST s = *tmp;
+        if (s->parent != r) tmp = &s->next;
+        else {
+            *tmp = s->next;
+            r->segments_left--;
+            finish_request(s);
+        }
+    }
+    if (!r->running && !r->segments_left) {
+        *link = r->next;
+        complete_request(r, pending);
     }
 
-    return ret;
+}
+
+/**
+ * @brief Cancels a request of a client. A request that already ended is left alone, its end is on its way
+ * @param c Connection of the client, NULL to cancel the task numbered by the tag, of any client
+ * @param tag Tag of the request
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @return 0 if the request was cancelled, -1 if it's not there
+*/
+int cancel_request(CONNECTION c, uint32_t tag, REQUEST * pending, REQUEST * running) {
+
+    REQUEST * link = find_tag(pending, c, tag, 0);
+    if (!link) link = find_tag(pending, c, tag, 1);
+    if (!link) link = find_tag(running, c, tag, 1);
+    if (!link) link = find_tag(running, c, tag, 0);
+    if (!link) link = find_tag(&lent, c, tag, 1);
+
+    // A lent request is cancelled by the instance that runs it, its end comes back from there
+    REQUEST * lent_link = link ? NULL : find_tag(&lent, c, tag, 0);
+    if (lent_link) {
+        (*lent_link)->cancelled = 1;
+        send_message((*lent_link)->peer->fd, MESSAGE_CANCEL, (*lent_link)->task, 0, NULL, 0, NULL, 0);
+        return 0;
+    }
+    if (!link) return -1;
+
+    abort_request(link, pending, running);
+    return 0;
 
 }
 
 /**
- * @brief Changes a usage of a filter to the struct
- * @param filters Pointer to a struct with the filters
- * @param filter Name or path to the filter
- * @param bool If true, add occurance; if false, remove occurance
+ * @brief Gathers the tags of the requests of a connection that weren't cancelled yet, and of their followers
+ * @param r Struct with the requests
+ * @param c Connection
+ * @param tags Where to write the tags, with room for every request of the connection
+ * @param n Tags already written
+ * @return Tags written
 */
-void alters_usage(FILTERS * filters, char * filter, int bool) {
+int connection_tags(REQUEST r, CONNECTION c, uint32_t tags[], int n) {
 
-    int flag = 1;
-    for (; flag && *filters; filters = &(*filters)->next) 
-        if (!strcmp(filter, (*filters)->filter_name) || !strcmp(filter, (*filters)->filter_path)) {
-            if (bool) (*filters)->usage++;
-            else (*filters)->usage--;
-            flag = 0;
-        }
+    for (; r; r = r->next) {
+        if (r->connection == c && !r->cancelled) tags[n++] = r->tag;
+        n = connection_tags(r->followers, c, tags, n);
+    }
+
+    return n;
 
 }
 
 /**
- * @brief Gets if it's valid to add another usage of the filter
- * @param filters Struct with the filters
- * @param filter_exec Executable path of the filter
- * @return 1 if valid, 0 if not valid
+ * @brief Cancels every request of a client that left, since nobody is waiting for them
+ * @param c Connection of the client
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
 */
-int valid_usage(FILTERS filters, char * filter_exec) {
+void cancel_connection(CONNECTION c, REQUEST * pending, REQUEST * running) {
 
-    int ret = -1;
-    for (; ret == -1 && filters; filters = filters->next) 
-        if (!strcmp(filter_exec, filters->filter_path)) 
-            ret = filters->usage < filters->max;
-        
-    return ret;
+    // Each request holds a reference to the connection. Cancels move requests around, so they're found by tag
+    uint32_t tags[c->refs];
+    int n = connection_tags(*pending, c, tags, 0);
+    n = connection_tags(*running, c, tags, n);
+    n = connection_tags(lent, c, tags, n);
+    for (int i = 0; i < n; i++) cancel_request(c, tags[i], pending, running);
 
 }
 
 /**
- * @brief Struct that hold the information about the requests in the server
+ * @brief Finds a request whose deadline passed, and the time until the next deadline of the others
+ * @param r Pointer to the struct with the requests, whose followers are searched too
+ * @param wait Milliseconds until the next deadline, lowered by the requests that didn't expire
+ * @return Pointer to the link to the request, NULL if none expired
 */
-typedef struct requests {
+REQUEST * find_expired(REQUEST * r, int * wait) {
 
-    char * type_operation;
-    char * source_path;
-    char * output_path;
-    char * filters;
-    char * pid_str;
-    int task;
-    pid_t pid;
-    struct requests * next;
+    for (; *r; r = &(*r)->next) {
 
-} *REQUEST;
+        REQUEST * found = find_expired(&(*r)->followers, wait);
+        if (found) return found;
+        if (!(*r)->deadline || (*r)->cancelled || (*r)->parent) continue;
+
+        double left = (*r)->deadline - seconds_since(&(*r)->arrival);
+        if (left <= 0) return r;
+        int ms = ceil(left * 1e3);
+        if (*wait < 0 || ms < *wait) *wait = ms;
+
+    }
+
+    return NULL;
+
+}
 
 /**
- * @brief Adds a request to the requests struct
- * @param r Struct with the requests
- * @param request New string with the request
+ * @brief Drops the requests whose deadline passed. Waiting ones never take their filters, running ones
+ * are killed
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @return Milliseconds until the next deadline, -1 if there's none
 */
-void add_request(REQUEST * r, char * request) {
+int expire_requests(REQUEST * pending, REQUEST * running) {
 
-    // Appends the request
-    while (*r) r = &(*r)->next;
-    *r = malloc(sizeof(struct requests));
+    // Dropping a request moves others around, so they're searched again after each one
+    while (1) {
+
+        int wait = -1;
+        REQUEST * link = find_expired(pending, &wait);
+        if (!link) link = find_expired(running, &wait);
+        if (!link) return wait;
+
+        fprintf(stderr, "Task #%d: deadline of %gs passed\n", (*link)->task, (*link)->deadline);
+        (*link)->expired = 1;
+        abort_request(link, pending, running);
 
-    // Parses the request
-    char * save;
-    (*r)->type_operation = strdup(strtok_r(request, ",", &save));
-    (*r)->source_path = strdup(strtok_r(NULL, ",", &save));
-    (*r)->output_path = strdup(strtok_r(NULL, ",", &save));
-    (*r)->filters = strdup(strtok_r(NULL, ",", &save));
-    (*r)->pid_str = strdup(strtok_r(NULL, "\n", &save));
-    (*r)->task = task++;
+    }
 
-    (*r)->next = NULL;
 }
 
 /**
- * @brief Frees a struct with requests
- * @param r Struct with the requests
+ * @brief Adds a connection, whose messages are read once they arrive
+ * @param fd Socket of the connection
+ * @param epoll_fd Epoll instance where the connections are watched
+ * @param connections Pointer to the struct with the connections
+ * @return The connection
 */
-void free_request(REQUEST r) {
+CONNECTION add_connection(int fd, int epoll_fd, CONNECTION * connections) {
+
+    CONNECTION c = malloc(sizeof(struct connections));
+    c->fd = fd;
+    c->refs = 1;
+    c->fd_directory = -1;
+    c->instance = NULL;
+    c->used = 0;
+    c->n_fds = 0;
+    c->next = *connections;
+    *connections = c;
 
-    free(r->type_operation);
-    free(r->source_path);
-    free(r->output_path);
-    free(r->filters);
-    free(r->pid_str);
-    free(r);
+    // The client is known by its credentials, and replies only block for a while on a client that doesn't read
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    c->client = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 ? credentials.pid : 0;
+    struct timeval timeout = { REPLY_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct epoll_event event = { .events = EPOLLIN };
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    return c;
 
 }
 
 /**
- * @brief Loads the status of the server to a string
- * @param r Struct with the requests
- * @param f Struct with the filters
- * @return Loaded string 
+ * @brief Connects to the coordinator or to another instance, and tells it the socket of this one
+ * @param path Socket to connect to
+ * @param connections Pointer to the struct with the connections, where its replies are read
+ * @return The connection, NULL on error
 */
-char * load_status(REQUEST r, FILTERS f) {
+CONNECTION connect_instance(char * path, CONNECTION * connections) {
 
-    char * buffer = malloc(MAX);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
 
-    // Adds pending tasks
-    for (; r; r = r->next) {
+    CONNECTION c = add_connection(fd, epoll_fd, connections);
+    c->instance = strdup(path);
+    send_message(fd, MESSAGE_REGISTER, 0, 0, socket_path, strlen(socket_path) + 1, NULL, 0);
+
+    return c;
+
+}
+
+/**
+ * @brief Tells if another instance could run a waiting request: one with a single output, that wasn't lent
+ * to this instance
+ * @param r Request
+ * @return 1 if it could, 0 otherwise
+*/
+int lendable(REQUEST r) {
 
-        snprintf(buffer, MAX, "Task #%d: transform %s %s ", r->task, r->source_path, r->output_path);
-        char * aux = strdup(r->filters);
-        char * filter = strtok(aux, " ");
-        while(filter) {
+    return !r->parent && !r->branches && !(r->connection && r->connection->instance);
 
-            snprintf(buffer + strlen(buffer), MAX, "%s ", filter);
-            filter = strtok(NULL, " ");
+}
+
+/**
+ * @brief Lends the oldest waiting requests to an idle instance, as one of its clients: it gets their descriptors,
+ * and its replies are passed on to their clients. The requests keep their files until they end there
+ * @param path Socket of the instance
+ * @param n Requests to lend
+ * @param connections Pointer to the struct with the connections
+ * @param pending Pointer to the struct with the pending requests
+ * @param filters Struct with the filters
+*/
+void lend_requests(char * path, int n, CONNECTION * connections, REQUEST * pending, FILTERS filters) {
+
+    // An instance is reached through one connection, kept while this one runs
+    CONNECTION peer = *connections;
+    while (peer && (peer == coordinator || !peer->instance || strcmp(peer->instance, path))) peer = peer->next;
+    if (!peer && !(peer = connect_instance(path, connections))) return;
 
+    char * payload = scratch;
+    for (REQUEST * tmp = pending; n > 0 && *tmp;) {
+
+        REQUEST r = *tmp;
+        if (!lendable(r) || attach_files(r) < 0) {
+            tmp = &r->next;
+            continue;
         }
-        free(aux);
-        snprintf(buffer + strlen(buffer), MAX, "\n");
-        
-    }
 
-    // Adds information on usage of the filters
-    for (; f; f = f->next) 
-        snprintf(buffer + strlen(buffer), MAX, "Filter %s : %d/%d (running/max)\n", 
-                                                f->filter_name, f->usage, f->max);
+        // The deadline that's left is sent, counted from when the instance receives it
+        char priority[16], window[64] = "", deadline[32];
+        double left = r->deadline > 0 ? r->deadline - seconds_since(&r->arrival) : 0;
+        snprintf(priority, sizeof(priority), "%d", r->priority);
+        if (r->preview) snprintf(window, sizeof(window), "%.3f:%.3f", r->start, r->duration);
+        snprintf(deadline, sizeof(deadline), "%.3f", r->deadline > 0 && left < 0.001 ? 0.001 : left);
+
+        uint32_t length = 0;
+        int valid = pack_string(payload, &length, r->source_path) == 0 && pack_string(payload, &length, r->output_path) == 0 &&
+                    pack_string(payload, &length, priority) == 0 && pack_string(payload, &length, window) == 0 &&
+                    pack_string(payload, &length, deadline) == 0;
+        for (int i = 0; valid && i < r->n_typed; i++)
+            valid = pack_string(payload, &length, filters->filter[r->typed[i]].filter_name) == 0;
+
+        int fds[2] = { r->fd_source, r->fd_output };
+        if (!valid || send_message(peer->fd, MESSAGE_TRANSFORM, r->task, 0, payload, length, fds, 2) < 0) {
+            detach_files(r);
+            break;
+        }
 
-    // Adds pid of the server
-    snprintf(buffer + strlen(buffer), MAX, "Pid: %d\n", getpid());                                            
+        *tmp = r->next;
+        r->next = lent;
+        lent = r;
+        r->peer = peer;
+        peer->refs++;
+        n--;
 
-    return buffer;
+    }
 
 }
 
 /**
- * @brief Function that manages server actions
- * @param argc Number of arguments
- * @param argv Arguments 
- * @return Status
+ * @brief Passes on to its client what the instance a request was lent to replied. A request it turned away
+ * goes back to the pending requests, one that ended is completed here, where its followers wait
+ * @param link Pointer to the link to the request among the lent ones
+ * @param state State of the request
+ * @param payload Payload of the reply, a COMPLETION once it ended
+ * @param length Bytes of the payload
+ * @param pending Pointer to the struct with the pending requests
 */
-int main(int argc, char * argv[]) {
+void relay_state(REQUEST * link, int state, char * payload, uint32_t length, REQUEST * pending) {
 
-    if (argc == 3) {
+    REQUEST r = *link;
+    if (state == STATE_PROCESSING) {
+        clock_gettime(CLOCK_MONOTONIC, &r->admitted);
+        reply(r, STATE_PROCESSING);
+        return;
+    }
 
-        // Configurates the server according to the config file and filters folder path
-        char * config_filename = argv[1];
-        char * filters_folder = argv[2];
-        FILTERS filters = configure(config_filename, filters_folder);
+    *link = r->next;
+    r->next = NULL;
+    release_connection(r->peer);
+    r->peer = NULL;
+    if (state == STATE_REJECTED && !r->cancelled) {
+        memset(&r->admitted, 0, sizeof(r->admitted));
+        detach_files(r);
+        add_request(pending, r);
+        return;
+    }
 
-        // Makes client to server fifo
-        if (mkfifo(MAIN_FIFO, 0666) < 0) {
-            perror("main fifo");
-            exit(1);
+    // Its times and CPU are the ones it took there
+    COMPLETION completion = { 0 };
+    if (length >= sizeof(completion)) memcpy(&completion, payload, sizeof(completion));
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double started = now.tv_sec + now.tv_nsec / 1e9 - completion.running;
+    r->started.tv_sec = (time_t) started;
+    r->started.tv_nsec = (started - r->started.tv_sec) * 1e9;
+    r->admitted = r->spawned = r->started;
+    r->usage.user = completion.cpu;
+    r->exit_status = completion.exit_status;
+    r->failed = state != STATE_DONE;
+    r->cancelled |= state == STATE_CANCELLED;
+    r->expired = state == STATE_EXPIRED;
+    r->rejected = state == STATE_REJECTED;
+
+    complete_request(r, pending);
+
+}
+
+/**
+ * @brief Takes back the requests lent to an instance whose connection ended. They run here from the start,
+ * unless they were cancelled
+ * @param c Connection of the instance
+ * @param pending Pointer to the struct with the pending requests
+*/
+void return_lent(CONNECTION c, REQUEST * pending) {
+
+    for (REQUEST * tmp = &lent; *tmp;) {
+
+        REQUEST r = *tmp;
+        if (r->peer != c) {
+            tmp = &r->next;
+            continue;
         }
+        *tmp = r->next;
+        r->next = NULL;
+        r->peer = NULL;
+        release_connection(c);
+        memset(&r->admitted, 0, sizeof(r->admitted));
 
-        int fd = open(MAIN_FIFO, O_RDONLY);
-        if (fd < 0) {
-            perror("open");
-            exit(1);
+        if (r->cancelled) {
+            r->failed = 1;
+            complete_request(r, pending);
+            continue;
         }
-        REQUEST req = NULL, head = NULL;
-        pid_t pid;
-        
-        while (1) {
 
-            // Free any requests that have ended
-            for (REQUEST * tmp = &head; *tmp;) {
+        // The instance shared the offsets of the files, and may have written part of the output
+        lseek(r->fd_source, 0, SEEK_SET);
+        if (lseek(r->fd_output, 0, SEEK_SET) == 0 && ftruncate(r->fd_output, 0) < 0) perror("output");
+        detach_files(r);
+        add_request(pending, r);
 
-                int status;
-                if (waitpid((*tmp)->pid, &status, WNOHANG) != (*tmp)->pid) 
-                    tmp = &(*tmp)->next; 
-                else {
+    }
 
-                    REQUEST req_free = *tmp;
-                    *tmp = (*tmp)->next;
-                    char * string_filters = strdup(req_free->filters);
-                    char * filter_used = strtok(string_filters, " ");
-                    while (filter_used) {
+}
 
-                        alters_usage(&filters, filter_used, 0);
-                        filter_used = strtok(NULL, " ");
+/**
+ * @brief Tells the coordinator what this instance can take, if it changed since the last time: the free
+ * instances of each filter, and the waiting requests that another instance could run
+ * @param pending Struct with the pending requests
+ * @param running Struct with the running requests
+ * @param filters Struct with the filters
+*/
+void advertise(REQUEST pending, REQUEST running, FILTERS filters) {
 
-                    }
-                    free(string_filters);
-                    free(*tmp);
+    char payload[sizeof(advertised)];
+    CAPACITY * capacity = (CAPACITY *) payload;
+    CAPACITY_FILTER * filter = (CAPACITY_FILTER *) (payload + sizeof(CAPACITY));
+    memset(payload, 0, sizeof(payload));
 
-                }
+    int queued[MAX_FILTERS] = { 0 };
+    for (REQUEST r = pending; r; r = r->next) {
+        capacity->waiting++;
+        if (!lendable(r)) continue;
+        capacity->lendable++;
+        for (int i = 0; i < r->n_uses; i++) queued[r->uses[i][0]]++;
+    }
+    for (REQUEST r = running; r; r = r->next) capacity->running++;
 
-            }
+    // Over the budget, no filter can start
+    int full = settings.cpu_budget > 0 && filters->cost_used >= settings.cpu_budget;
+    for (int i = 0; i < filters->n_filters; i++) {
+        if (filters->filter[i].removed) continue;
+        CAPACITY_FILTER * f = &filter[capacity->n_filters++];
+        snprintf(f->name, CAPACITY_NAME, "%s", filters->filter[i].filter_name);
+        f->free = full ? 0 : filters->filter[i].limit - filters->usage[i];
+        if (f->free < 0) f->free = 0;
+        f->queued = queued[i];
+    }
 
-            // Allocates space to instructions and reads file
-            char * instruction = malloc(MAX);
-            if (read(fd, instruction, MAX) > 0) { 
-
-                if (*instruction == '1') // If it's a transform instruction, add it to the requests
-                    add_request(&req, strdup(instruction));
-                
-                else if (*instruction == '0') { // If it's a status instruction, load the status
-                        
-                    strtok(instruction, ",");
-                    char * client_path = strtok(NULL, ",");
-                    char * server_status = load_status(head, filters);
-                    // Open the server to client fifo to write in
-                    int client_fd = open(client_path, O_WRONLY, 0644);
-                    if (client_fd < 0) {
-                        perror("open client fifo");
-                        exit(1);
-                    }
-                    // Writes the server status
-                    write(client_fd, server_status, strlen(server_status));
-                    free(server_status);
-                    
-                }
+    uint32_t length = sizeof(CAPACITY) + capacity->n_filters * sizeof(CAPACITY_FILTER);
+    if (length == advertised_length && !memcmp(payload, advertised, length)) return;
+    if (send_message(coordinator->fd, MESSAGE_CAPACITY, 0, 0, payload, length, NULL, 0) < 0) return;
+    memcpy(advertised, payload, length);
+    advertised_length = length;
 
-                free(instruction);
-            }
-            else {
-                
-                close(fd);
-                fd = open(MAIN_FIFO, O_RDONLY);
-                if (fd < 0) {
-                    perror("open");
-                    exit(1);
-                }
+}
 
-            }
-       
-            while (req) { // Executes requests in line
-
-                // Opens server to client fifo
-                int fd_client = open(req->pid_str, O_WRONLY);
-                if (fd_client < 0) {
-                    perror("open");
-                    exit(1);
-                }
+/**
+ * @brief Handles one message sent by a client, which takes the descriptors sent with it
+ * @param c Connection of the client
+ * @param header Header of the message
+ * @param payload Payload of the message
+ * @param fds Descriptors sent with the message
+ * @param connections Pointer to the struct with the connections
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
+ * @return 0 on success, -1 if the message is invalid
+*/
+int handle_message(CONNECTION c, MESSAGE_HEADER * header, char * payload, int fds[], CONNECTION * connections,
+                   REQUEST * pending, REQUEST * running, FILTERS filters) {
 
-                // Counts the number of filters in the request
-                int n_filters = count_filters(req->filters);
+    char * fields[MAX_FIELDS];
+    int n_fields;
 
-                // Informs the client that the request is processing
-                write(fd_client, "1", 1);
+    switch (header->type) {
 
-                // Opens source file
-                int fd_source = open(req->source_path, O_RDONLY);
-                if (fd_source < 0) {
-                     perror("open source");
-                    _exit(1);
-                }
+        case MESSAGE_TRANSFORM:
+            n_fields = unpack_strings(payload, header->length, fields, MAX_FIELDS);
+            if (n_fields < TRANSFORM_FILTERS || (header->n_fds != 0 && header->n_fds != 2)) break;
+            add_transform(c, header->tag, fields, n_fields, fds, header->n_fds, pending, *running, filters);
+            return 0;
 
-                // Opens output file
-                int fd_output = open(req->output_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-                if (fd_output < 0) {
-                    perror("open");
-                    _exit(1);
-                }
+        case MESSAGE_STATUS: {
+            // The segment is up to date for the server, which is its only writer
+            publish_status(*pending, *running, filters);
+            int length = status_format(status, scratch, PROTOCOL_MAX_PAYLOAD);
+            send_message(c->fd, MESSAGE_STATUS_REPLY, header->tag, 0, scratch, length, NULL, 0);
+            if (header->n_fds) break;
+            return 0;
+        }
+
+        case MESSAGE_STATS: {
+            int length = metrics_report(metrics, scratch, PROTOCOL_MAX_PAYLOAD);
+            send_message(c->fd, MESSAGE_STATUS_REPLY, header->tag, 0, scratch, length > 0 ? length : 0, NULL, 0);
+            if (header->n_fds) break;
+            return 0;
+        }
 
-                char * save;
-                char * all_filters = strdup(req->filters);
-                char * filter = strtok_r(all_filters, " ", &save);
-                // Loads executable paths to the array and does active waiting if one of the filters isn't available
-                char * filters_array[n_filters];
-                for (int i = 0; i < n_filters; i++) {
+        case MESSAGE_DIRECTORY:
+            if (header->n_fds != 1) break;
+            if (c->fd_directory >= 0) close(c->fd_directory);
+            c->fd_directory = fds[0];
+            return 0;
 
-                    char * path = finds_executable(filters, filter);
-                    filters_array[i] = path;
-                    while (valid_usage(filters, path) == 0);
-                    filter = strtok_r(NULL, " ", &save);
+        case MESSAGE_CANCEL:
+            if (header->n_fds) break;
+            cancel_request(c, header->tag, pending, running);
+            return 0;
 
-                }
+        case MESSAGE_CANCEL_TASK: {
+            if (header->n_fds) break;
+            char text[64];
+            int length = snprintf(text, sizeof(text), cancel_request(NULL, header->tag, pending, running) == 0 ?
+                                  "Task #%u cancelled\n" : "No task #%u is waiting or running\n", header->tag);
+            send_message(c->fd, MESSAGE_STATUS_REPLY, header->tag, 0, text, length, NULL, 0);
+            return 0;
+        }
+
+        case MESSAGE_REGISTER:
+            // Another instance that lends its requests, which aren't lent again
+            if (header->n_fds || !header->length || payload[header->length - 1]) break;
+            free(c->instance);
+            c->instance = strdup(payload);
+            return 0;
 
-                // Adds a usage of the filter
-                for (int i = 0; i < n_filters; i++) 
-                    alters_usage(&filters, filters_array[i], 1);
+        case MESSAGE_STEAL:
+            if (c != coordinator || header->n_fds || !header->length || payload[header->length - 1]) break;
+            lend_requests(payload, header->tag, connections, pending, filters);
+            return 0;
 
-                free(all_filters);
+        case MESSAGE_STATE: {
+            // Replies of an instance to the requests lent to it, tagged by their task
+            REQUEST * link = &lent;
+            while (*link && ((*link)->peer != c || (*link)->task != (int) header->tag)) link = &(*link)->next;
+            if (header->n_fds || !*link) break;
+            relay_state(link, header->state, payload, header->length, pending);
+            return 0;
+        }
+
+    }
+
+    for (int i = 0; i < header->n_fds; i++) close(fds[i]);
+    return -1;
+
+}
+
+/**
+ * @brief Accepts every client waiting to connect, their messages are read once they arrive
+ * @param fd_listen Listening socket
+ * @param epoll_fd Epoll instance where the connections are watched
+ * @param connections Pointer to the struct with the connections
+*/
+void accept_clients(int fd_listen, int epoll_fd, CONNECTION * connections) {
+
+    int fd;
+    while ((fd = accept4(fd_listen, NULL, NULL, SOCK_CLOEXEC)) >= 0) add_connection(fd, epoll_fd, connections);
+
+}
+
+/**
+ * @brief Reads what a client, the coordinator or another instance sent and handles every whole message in it,
+ * the rest waits in the buffer of the connection for the bytes that complete it
+ * @param fd Connection of the client
+ * @param epoll_fd Epoll instance where the connections are watched
+ * @param connections Pointer to the struct with the connections
+ * @param pending Pointer to the struct with the pending requests
+ * @param running Pointer to the struct with the running requests
+ * @param filters Struct with the filters
+*/
+void read_connection(int fd, int epoll_fd, CONNECTION * connections, REQUEST * pending, REQUEST * running, FILTERS filters) {
 
-                if ((pid = fork()) == 0) {
+    CONNECTION * tmp = connections;
+    while (*tmp && (*tmp)->fd != fd) tmp = &(*tmp)->next;
+    if (!*tmp) return;
+    CONNECTION c = *tmp;
 
-                    // If it's just one filter, there's no need for using pipes to redirect input and output
-                    if (n_filters == 1) {
-                       
-                        // Creates a new process do execute the filter
-                        if (fork() == 0) {
+    // The socket blocks for replies, so it's read without waiting. The buffer always fits a whole message
+    ssize_t bytes_read = 0, size = 0;
+    int valid = 1;
+    while (valid && (bytes_read = receive_bytes(fd, c->buffer + c->used, sizeof(c->buffer) - c->used, 
+                                                c->fds, &c->n_fds, PROTOCOL_MAX_FDS, MSG_DONTWAIT)) > 0) {
 
-                            // dup2 redirects input and output
-                            dup2(fd_source, STDIN_FILENO);
-                            close(fd_source);
-                            dup2(fd_output, STDOUT_FILENO);
-                            close(fd_output);
-                            // Executes filter
-                            execlp(filters_array[0], filters_array[0], NULL);
-                            perror("execlp one filter");
-                            _exit(1);
+        c->used += bytes_read;
 
-                        }
+        // The descriptors of a message arrive with its first bytes
+        size_t offset = 0;
+        MESSAGE_HEADER header;
+        char * payload;
+        while (valid && (size = parse_message(c->buffer + offset, c->used - offset, &header, &payload)) > 0) {
 
-                    }
-                    else { // Pipes are necessary
+            if (header.n_fds > c->n_fds) valid = 0;
+            else {
+                int fds[PROTOCOL_MAX_FDS];
+                memcpy(fds, c->fds, header.n_fds * sizeof(int));
+                c->n_fds -= header.n_fds;
+                memmove(c->fds, c->fds + header.n_fds, c->n_fds * sizeof(int));
+                valid = handle_message(c, &header, payload, fds, connections, pending, running, filters) == 0;
+            }
+            offset += size;
+
+        }
+        if (size < 0) valid = 0;
+
+        c->used -= offset;
+        memmove(c->buffer, c->buffer + offset, c->used);
+
+    }
+
+    // The connection is read until the client closes it or breaks the protocol. Its requests go with it
+    if (valid && bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (!valid) send_message(fd, MESSAGE_ERROR, 0, 0, NULL, 0, NULL, 0);
+    cancel_connection(c, pending, running);
+    return_lent(c, pending);
+    if (c == coordinator) {
+        fprintf(stderr, "Coordinator: connection ended, the instance works alone\n");
+        coordinator = NULL;
+    }
 
-                        int pipes[n_filters - 1][2];
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    *tmp = c->next;
+    release_connection(c);
 
-                        // Creates the first pipe
-                        if (pipe(pipes[0]) < 0) {
-                            perror("pipe");
-                            _exit(1);
-                        }
+}
 
-                        // Creates another process
-                        if (fork() == 0) {
+/**
+ * @brief Rebuilds the requests that the journal has from before a crash. They run again without a client,
+ * resuming from the segments that ended, and aren't looked up in the cache
+ * @param pending Pointer to the struct with the pending requests
+ * @param filters Struct with the filters
+*/
+void replay_journal(REQUEST * pending, FILTERS filters) {
 
-                            // Duplicates fd_source to STDIN_FILENO
-                            dup2(fd_source, STDIN_FILENO);
-                            close(fd_source);
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
 
-                            dup2(pipes[0][1], STDOUT_FILENO);
-                            close(pipes[0][1]);
+    JOURNAL_JOB * jobs;
+    int n_jobs = journal_jobs(journal, &jobs);
+    for (int i = 0; i < n_jobs; i++)
+        if (jobs[i].task >= task) task = jobs[i].task + 1;
 
-                            // Execute the corresponding filter
-                            execlp(filters_array[0], filters_array[0], NULL);
-                            perror("execlp");
-                            _exit(1);
+    for (int i = 0; i < n_jobs; i++) {
 
-                        }
+        char * fields[MAX_FIELDS];
+        int n_fields = unpack_strings(jobs[i].payload, jobs[i].length, fields, MAX_FIELDS);
+        if (n_fields < TRANSFORM_FILTERS) {
+            journal_end(journal, jobs[i].task);
+            continue;
+        }
 
-                        close(pipes[0][1]);
+        REQUEST r = new_request(fields, n_fields, filters);
+        task--;
+        r->task = jobs[i].task;
+        r->by_name = 1;
+        r->journaled = 1;
+        r->replayed = 1;
+        recovery.replayed++;
 
-                        // Executes intermediary filters
-                        int i;
-                        for (i = 1; i < n_filters - 1; i++) {
+        // Filters may have left the config file since the crash
+        if (!r->n_typed) {
+            r->failed = 1;
+            finish_request(r);
+            continue;
+        }
+        if (settings.optimize && !r->branches) optimize_chain(r, filters);
+        count_uses(r);
+        add_request(pending, r);
 
-                            if (pipe(pipes[i]) < 0) {
-                                perror("pipe");
-                                exit(1);
-                            }
+    }
 
-                            if (fork() == 0) {
+    recovery.seconds = seconds_since(&begin);
+    if (recovery.replayed) fprintf(stderr, "Journal: %d jobs replayed in %.1f ms\n", recovery.replayed, recovery.seconds * 1000);
 
-                                close(pipes[i][0]);
+}
 
-                                dup2(pipes[i-1][0], STDIN_FILENO);
-                                close(pipes[i-1][0]);
+/**
+ * @brief Function that manages server actions
+ * @param argc Number of arguments
+ * @param argv Arguments 
+ * @return Status
+*/
+int main(int argc, char * argv[]) {
 
-                                dup2(pipes[i][1], STDOUT_FILENO);
-                                close(pipes[i][1]);
+    if (argc == 3) {
 
-                                execlp(filters_array[i], filters_array[i], NULL);
-                                perror("execlp");
-                                _exit(1);
+        // Configurates the server according to the config file and filters folder path
+        char * config_filename = argv[1];
+        char * filters_folder = argv[2];
+        own_settings();
+        FILTERS filters = configure(config_filename, filters_folder);
+        if (!filters) exit(1);
 
-                            }
+        // Outputs are only cached if the config file names a directory for them
+        if (settings.cache_dir && !(cache = cache_open(settings.cache_dir, settings.cache_size)))
+            perror("cache");
+        if (!settings.segments) settings.segments = sysconf(_SC_NPROCESSORS_ONLN);
+        metrics = metrics_open(settings.metrics_file, settings.job_log);
+        if (!(topology = topology_open())) perror("topology");
+        if (cache && settings.prefix_cache_size > 0) {
+            char directory[MAX];
+            snprintf(directory, MAX, "%s/prefixes", settings.cache_dir);
+            if (!(prefixes = cache_open(directory, settings.prefix_cache_size))) perror("prefix cache");
+        }
 
-                            close(pipes[i-1][0]);
-                            close(pipes[i][1]);
+        // The requests that a crash interrupted wait before any client can connect
+        REQUEST pending = NULL, running = NULL;
+        if (settings.journal && !(journal = journal_open(settings.journal))) perror("journal");
+        if (journal) replay_journal(&pending, filters);
 
-                        }
+        // Clients connect to a socket, a socket left by a server that ended is replaced
+        char * main_socket = settings.socket, status_path[MAX], cwd[MAX];
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, main_socket, sizeof(addr.sun_path) - 1);
+        unlink(main_socket);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+            perror("main socket");
+            exit(1);
+        }
+        // Other instances are told the absolute path of the socket
+        if (main_socket[0] == '/' || !getcwd(cwd, MAX) || snprintf(socket_path, MAX, "%s/%s", cwd, main_socket) >= MAX)
+            snprintf(socket_path, MAX, "%s", main_socket);
+        snprintf(status_path, MAX, "%s" STATUS_SUFFIX, main_socket);
+        if (!(status = status_create(status_path))) {
+            perror("status segment");
+            exit(1);
+        }
 
-                        // Executes last filter and places it in the output 
-                        if (fork() == 0) {
+        // Ended stages and reloads are received through a signalfd instead of being polled
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGHUP);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        signal(SIGPIPE, SIG_IGN);
+        int fd_signal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd_signal < 0) {
+            perror("signalfd");
+            exit(1);
+        }
 
-                            dup2(pipes[i-1][0], STDIN_FILENO);
-                            close(pipes[i-1][0]);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event event = { .events = EPOLLIN };
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        event.data.fd = fd_signal;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd_signal, &event);
 
-                            dup2(fd_output, STDOUT_FILENO);
-                            close(fd_output);
+        // Workers are forked before any client connects, with the signals of the stages already set up
+        start_workers(filters);
+        publish_status(pending, NULL, filters);
+        clock_gettime(CLOCK_MONOTONIC, &adapted);
 
-                            execlp(filters_array[i], filters_array[i], NULL);
-                            perror("execlp");
-                            _exit(1);
+        // Instances that share their work register with the coordinator, which tells them when to lend requests
+        CONNECTION connections = NULL;
+        if (settings.coordinator && (coordinator = connect_instance(settings.coordinator, &connections)))
+            advertise(pending, NULL, filters);
+        int timeout = pending ? 0 : -1, reloading = 0;
+        
+        while (1) {
 
-                        }
+            // Sleeps until a client connects or writes, a stage ends, a reload is asked, or the metrics, the limits or a deadline are due
+            struct epoll_event events[MAX_EVENTS];
+            int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+            if (n_events < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                break;
+            }
 
-                        close(pipes[i-1][0]);
+            for (int i = 0; i < n_events; i++) {
 
-                    }
+                WORKER * w;
+                if (events[i].data.fd == fd_signal) {
 
-                    // Collects the new processes created
-                    for (int j = 0; j < n_filters; j++) 
-                        wait(NULL);
-                    
-                    // Writes that the request was finalized
-                    write(fd_client, "0", 1);
-                    close(fd_client);
+                    // Empties the signalfd, the stages are collected with wait4
+                    struct signalfd_siginfo info;
+                    while (read(fd_signal, &info, sizeof(info)) > 0)
+                        if (info.ssi_signo == SIGHUP) reloading = 1;
+                    collect_stages(&pending, &running, filters);
 
-                    _exit(1);
-                }
-                else {
-                    
-                    req->pid = pid;
-                    if (!head) head = req;
-                    req = req->next;
-                    
                 }
+                else if (events[i].data.fd == fd) accept_clients(fd, epoll_fd, &connections);
+                else if ((w = find_worker(filters, 0, events[i].data.fd))) read_worker(w, &pending, &running, filters);
+                else read_connection(events[i].data.fd, epoll_fd, &connections, &pending, &running, filters);
+
+            }
+
+            if (reloading) {
+                reload(filters, config_filename, filters_folder);
+                reloading = 0;
             }
 
+            // Drops the requests that are past their deadline, starts the ones that fit in the freed filters and
+            // new limits, and shows the result to readers of the status
+            int expire = expire_requests(&pending, &running);
+            int adapt = adapt_limits(filters, pending);
+            dispatch_requests(&pending, &running, filters);
+            publish_status(pending, running, filters);
+            timeout = metrics_flush(metrics);
+            if (adapt >= 0 && (timeout < 0 || adapt < timeout)) timeout = adapt;
+            if (expire >= 0 && (timeout < 0 || expire < timeout)) timeout = expire;
+
+            // What the journal got in this pass reaches storage at once
+            if (journal) journal_sync(journal);
+            if (coordinator) advertise(pending, running, filters);
+
         }
 
+        close(epoll_fd);
+        close(fd_signal);
+        close(fd);
+        unlink(main_socket);
+        unlink(status_path);
+        status_unmap(status);
+
         // Frees filters
         free_filters(filters);
+        if (cache) cache_close(cache);
+        if (prefixes) cache_close(prefixes);
+        metrics_close(metrics);
+        if (topology) topology_close(topology);
+        if (journal) journal_close(journal);
+        while (pool) {
+            REQUEST r = pool;
+            pool = r->next;
+            arena_free(r->arena);
+            free(r);
+        }
 
     }
     else {
@@ -553,4 +4903,4 @@ int main(int argc, char * argv[]) {
 
     return 0;
     
-}
\ No newline at end of file
+}
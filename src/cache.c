@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "cache.h"
+
+#define CACHE_BLOCK 65536 // Bytes read at once when hashing or copying
+
+/**
+ * @brief Output kept in the cache
+*/
+typedef struct entry {
+
+    char key[CACHE_KEY_SIZE];
+    long long size;
+    time_t last_used;
+    double cost; // Seconds it takes to compute the entry again, 0 if unknown
+    double value; // The entry with the lowest value is the first to leave
+
+} ENTRY;
+
+/**
+ * @brief Directory of outputs named by the hash of what produced them, with a size cap.
+ * Eviction is GreedyDual-Size: an entry is worth the value of the last evicted entry plus its cost
+ * per byte, so entries that are cheap to compute again or big go first, and without costs it's LRU
+*/
+struct cache {
+
+    char * directory;
+    long long max_bytes;
+    long long bytes;
+    ENTRY * entries;
+    int n_entries;
+    int cap;
+    double inflation; // Value of the last evicted entry, ages the entries that aren't used
+    unsigned int generation; // Changes every time an entry is added or removed
+    long long hits;
+    long long misses;
+
+};
+
+/**
+ * @brief Two FNV-1a lanes with different bases, together a 128-bit hash
+*/
+typedef struct hash {
+
+    uint64_t a;
+    uint64_t b;
+
+} HASH;
+
+/**
+ * @brief Adds bytes to a hash
+*/
+static void hash_bytes(HASH * h, const void * data, size_t size) {
+
+    const unsigned char * bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        h->a = (h->a ^ bytes[i]) * 0x100000001b3ULL;
+        h->b = (h->b ^ bytes[i]) * 0x9e3779b97f4a7c15ULL;
+        h->b ^= h->b >> 29;
+    }
+
+}
+
+/**
+ * @brief Identifies a source file, once for every key built from it
+ * @param id Where to place the identifier, CACHE_KEY_SIZE bytes
+ * @param fd Source file, its offset doesn't change
+ * @param by_content If true, the source is identified by its contents, otherwise by its inode, size and mtime
+ * @return 0 on success, -1 if the source can't be read
+*/
+int cache_source(char * id, int fd, int by_content) {
+
+    HASH h = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL };
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+
+    if (by_content) {
+
+        char * buffer = malloc(CACHE_BLOCK);
+        ssize_t bytes_read;
+        off_t offset = 0;
+        while ((bytes_read = pread(fd, buffer, CACHE_BLOCK, offset)) > 0) {
+            hash_bytes(&h, buffer, bytes_read);
+            offset += bytes_read;
+        }
+        free(buffer);
+        if (bytes_read < 0) return -1;
+
+    }
+    else {
+
+        hash_bytes(&h, &st.st_dev, sizeof(st.st_dev));
+        hash_bytes(&h, &st.st_ino, sizeof(st.st_ino));
+        hash_bytes(&h, &st.st_size, sizeof(st.st_size));
+        hash_bytes(&h, &st.st_mtim, sizeof(st.st_mtim));
+
+    }
+
+    snprintf(id, CACHE_KEY_SIZE, "%016llx%016llx", (unsigned long long) h.a, (unsigned long long) h.b);
+
+    return 0;
+
+}
+
+/**
+ * @brief Builds the key of an output from its source and what was applied to it
+ * @param key Where to place the key, CACHE_KEY_SIZE bytes
+ * @param source_id Identifier of the source, from cache_source
+ * @param description Normalized chain of filters, with the versions of the filters and the settings that matter
+*/
+void cache_key(char * key, char * source_id, char * description) {
+
+    HASH h = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL };
+
+    hash_bytes(&h, source_id, strlen(source_id));
+    hash_bytes(&h, description, strlen(description));
+    snprintf(key, CACHE_KEY_SIZE, "%016llx%016llx", (unsigned long long) h.a, (unsigned long long) h.b);
+
+}
+
+/**
+ * @brief Copies a file from its start to an output. A regular output is replaced, sharing the blocks
+ * of the file (reflink) when the file system allows it, any other output gets the bytes written
+ * @param fd_source File to copy, its offset doesn't change
+ * @param fd_output Output
+ * @return 0 on success, -1 on error
+*/
+int cache_copy(int fd_source, int fd_output) {
+
+    struct stat st;
+    if (fstat(fd_output, &st) < 0) return -1;
+    if (S_ISREG(st.st_mode)) {
+        if (ftruncate(fd_output, 0) < 0 || lseek(fd_output, 0, SEEK_SET) < 0) return -1;
+        if (ioctl(fd_output, FICLONE, fd_source) == 0) return 0;
+    }
+
+    // Without reflinks, the kernel copies it, or the bytes go through a buffer
+    loff_t offset = 0;
+    ssize_t copied;
+    while ((copied = copy_file_range(fd_source, &offset, fd_output, NULL, CACHE_BLOCK * 16, 0)) > 0);
+    if (copied == 0) return 0;
+
+    char * buffer = malloc(CACHE_BLOCK);
+    ssize_t bytes_read;
+    while ((bytes_read = pread(fd_source, buffer, CACHE_BLOCK, offset)) > 0) {
+        char * bytes = buffer;
+        for (ssize_t left = bytes_read, written; left > 0; left -= written, bytes += written)
+            if ((written = write(fd_output, bytes, left)) <= 0) {
+                bytes_read = -1;
+                break;
+            }
+        if (bytes_read < 0) break;
+        offset += bytes_read;
+    }
+    free(buffer);
+
+    return bytes_read < 0 ? -1 : 0;
+
+}
+
+/**
+ * @brief Finds an entry of the cache
+ * @return Index of the entry, or -1 if it isn't cached
+*/
+static int find_entry(CACHE c, char * key) {
+
+    for (int i = 0; i < c->n_entries; i++)
+        if (!strcmp(c->entries[i].key, key)) return i;
+
+    return -1;
+
+}
+
+/**
+ * @brief Places the path of an entry in a buffer
+*/
+static void entry_path(CACHE c, char * key, char * path, size_t size) {
+
+    snprintf(path, size, "%s/%s", c->directory, key);
+
+}
+
+/**
+ * @brief Removes an entry from the cache and its file
+*/
+static void remove_entry(CACHE c, int i) {
+
+    char path[4096];
+    entry_path(c, c->entries[i].key, path, sizeof(path));
+    unlink(path);
+
+    c->bytes -= c->entries[i].size;
+    c->entries[i] = c->entries[--c->n_entries];
+    c->generation++;
+
+}
+
+/**
+ * @brief Gives an entry its value, when it's added or used
+*/
+static void value_entry(CACHE c, ENTRY * e) {
+
+    e->value = c->inflation + (e->cost > 0 ? e->cost / (e->size > 0 ? e->size : 1) : 0);
+
+}
+
+/**
+ * @brief Adds an entry to the cache
+*/
+static void add_entry(CACHE c, char * key, long long size, time_t last_used, double cost) {
+
+    if (c->n_entries == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->entries = realloc(c->entries, c->cap * sizeof(ENTRY));
+    }
+
+    ENTRY * e = &c->entries[c->n_entries++];
+    snprintf(e->key, CACHE_KEY_SIZE, "%s", key);
+    e->size = size;
+    e->last_used = last_used;
+    e->cost = cost;
+    value_entry(c, e);
+    c->bytes += size;
+    c->generation++;
+
+}
+
+/**
+ * @brief Removes the entries with the lowest value until the cache fits its size,
+ * the least recently used first on ties
+*/
+static void evict(CACHE c) {
+
+    while (c->bytes > c->max_bytes && c->n_entries > 0) {
+
+        int lowest = 0;
+        for (int i = 1; i < c->n_entries; i++) {
+            ENTRY * e = &c->entries[i], * l = &c->entries[lowest];
+            if (e->value < l->value || (e->value == l->value && e->last_used < l->last_used)) lowest = i;
+        }
+        c->inflation = c->entries[lowest].value;
+        remove_entry(c, lowest);
+
+    }
+
+}
+
+/**
+ * @brief Opens a cache, loading the entries already in its directory
+ * @param directory Directory of the cache, created if it doesn't exist
+ * @param max_bytes Size above which the entries with the lowest value are removed
+ * @return The cache, or NULL if the directory can't be used
+*/
+CACHE cache_open(char * directory, long long max_bytes) {
+
+    if (mkdir(directory, 0755) < 0 && access(directory, W_OK) < 0) return NULL;
+
+    DIR * dir = opendir(directory);
+    if (!dir) return NULL;
+
+    CACHE c = calloc(1, sizeof(struct cache));
+    c->directory = strdup(directory);
+    c->max_bytes = max_bytes;
+
+    // The modification time of an entry is the last time it was used, costs aren't kept
+    struct dirent * d;
+    while ((d = readdir(dir))) {
+
+        char path[4096];
+        struct stat st;
+        entry_path(c, d->d_name, path, sizeof(path));
+
+        if (strlen(d->d_name) == CACHE_KEY_SIZE - 1 && strspn(d->d_name, "0123456789abcdef") == CACHE_KEY_SIZE - 1) {
+            if (stat(path, &st) == 0) add_entry(c, d->d_name, st.st_size, st.st_mtime, 0);
+        }
+        else if (strstr(d->d_name, ".tmp")) unlink(path); // Left by a store that didn't end
+
+    }
+    closedir(dir);
+
+    evict(c);
+
+    return c;
+
+}
+
+/**
+ * @brief Writes a cached output to an output
+ * @param c Cache
+ * @param key Key of the output
+ * @param fd_output Where to write it
+ * @return 0 on a hit, -1 on a miss
+*/
+int cache_fetch(CACHE c, char * key, int fd_output) {
+
+    int i = find_entry(c, key);
+    char path[4096];
+    if (i >= 0) {
+
+        entry_path(c, key, path, sizeof(path));
+
+        int ret = -1, fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ret = cache_copy(fd, fd_output);
+            close(fd);
+        }
+
+        if (ret == 0) {
+            c->hits++;
+            c->entries[i].last_used = time(NULL);
+            value_entry(c, &c->entries[i]);
+            utimensat(AT_FDCWD, path, NULL, 0);
+            return 0;
+        }
+
+        // An entry that can't be read is of no use
+        remove_entry(c, i);
+
+    }
+
+    c->misses++;
+
+    return -1;
+
+}
+
+/**
+ * @brief Gets if an output is cached, without using it
+ * @param c Cache
+ * @param key Key of the output
+ * @return 1 if cached, 0 if not
+*/
+int cache_contains(CACHE c, char * key) {
+
+    return find_entry(c, key) >= 0;
+
+}
+
+/**
+ * @brief Gets a number that changes every time an entry is added or removed,
+ * to know if a previous search in the cache is still valid
+ * @param c Cache
+ * @return Generation of the cache
+*/
+unsigned int cache_generation(CACHE c) {
+
+    return c->generation;
+
+}
+
+/**
+ * @brief Opens a cached output to read it
+ * @param c Cache
+ * @param key Key of the output
+ * @return File descriptor on a hit, -1 on a miss
+*/
+int cache_lookup(CACHE c, char * key) {
+
+    int i = find_entry(c, key);
+    char path[4096];
+    if (i >= 0) {
+
+        entry_path(c, key, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            c->hits++;
+            c->entries[i].last_used = time(NULL);
+            value_entry(c, &c->entries[i]);
+            utimensat(AT_FDCWD, path, NULL, 0);
+            return fd;
+        }
+
+        remove_entry(c, i);
+
+    }
+
+    c->misses++;
+
+    return -1;
+
+}
+
+/**
+ * @brief Creates the file of a new entry, that only becomes part of the cache with cache_commit
+ * @param c Cache
+ * @param key Key of the output
+ * @return File descriptor to write the output, or -1 if it's cached or already being written
+*/
+int cache_create(CACHE c, char * key) {
+
+    if (find_entry(c, key) >= 0) return -1;
+
+    char path[4096 + 4];
+    entry_path(c, key, path, sizeof(path) - 4);
+    strcat(path, ".tmp");
+
+    return open(path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+
+}
+
+/**
+ * @brief Adds an entry written after cache_create to the cache
+ * @param c Cache
+ * @param key Key of the output
+ * @param cost Seconds it took to compute the output
+ * @return 0 on success, -1 on error
+*/
+int cache_commit(CACHE c, char * key, double cost) {
+
+    char path[4096], tmp_path[4096 + 4];
+    entry_path(c, key, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    struct stat st;
+    if (stat(tmp_path, &st) < 0 || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    add_entry(c, key, st.st_size, time(NULL), cost);
+    evict(c);
+
+    return 0;
+
+}
+
+/**
+ * @brief Discards an entry written after cache_create
+ * @param c Cache
+ * @param key Key of the output
+*/
+void cache_abort(CACHE c, char * key) {
+
+    char path[4096 + 4];
+    entry_path(c, key, path, sizeof(path) - 4);
+    strcat(path, ".tmp");
+    unlink(path);
+
+}
+
+/**
+ * @brief Keeps a copy of an output in the cache
+ * @param c Cache
+ * @param key Key of the output
+ * @param fd_output Output to keep, a regular file open for reading
+ * @return 0 on success, -1 on error
+*/
+int cache_store(CACHE c, char * key, int fd_output) {
+
+    // The entry only appears once it's complete
+    int fd = cache_create(c, key);
+    if (fd < 0) return find_entry(c, key) >= 0 ? 0 : -1;
+
+    int ret = cache_copy(fd_output, fd);
+    if (close(fd) < 0) ret = -1;
+    if (ret < 0) {
+        cache_abort(c, key);
+        return -1;
+    }
+
+    return cache_commit(c, key, 0);
+
+}
+
+/**
+ * @brief Writes the counters of a cache
+ * @param c Cache
+ * @param name Name of the cache in the status
+ * @param buffer Where to write
+ * @param size Size of the buffer
+ * @return Number of characters written, as snprintf
+*/
+int cache_status(CACHE c, char * name, char * buffer, int size) {
+
+    return snprintf(buffer, size, "%s: %lld hits, %lld misses, %d entries, %lld/%lld bytes\n",
+                                    name, c->hits, c->misses, c->n_entries, c->bytes, c->max_bytes);
+
+}
+
+/**
+ * @brief Frees a cache, its files stay in the directory
+ * @param c Cache
+*/
+void cache_close(CACHE c) {
+
+    free(c->directory);
+    free(c->entries);
+    free(c);
+
+}
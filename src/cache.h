@@ -0,0 +1,36 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_KEY_SIZE 33 // 128-bit hash in hexadecimal, plus the '\0'
+
+typedef struct cache * CACHE;
+
+CACHE cache_open(char * directory, long long max_bytes);
+
+int cache_source(char * id, int fd, int by_content);
+
+void cache_key(char * key, char * source_id, char * description);
+
+int cache_fetch(CACHE c, char * key, int fd_output);
+
+int cache_store(CACHE c, char * key, int fd_output);
+
+int cache_contains(CACHE c, char * key);
+
+unsigned int cache_generation(CACHE c);
+
+int cache_lookup(CACHE c, char * key);
+
+int cache_create(CACHE c, char * key);
+
+int cache_commit(CACHE c, char * key, double cost);
+
+void cache_abort(CACHE c, char * key);
+
+int cache_copy(int fd_source, int fd_output);
+
+int cache_status(CACHE c, char * name, char * buffer, int size);
+
+void cache_close(CACHE c);
+
+#endif
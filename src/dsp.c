@@ -0,0 +1,744 @@
+#include <math.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "dsp.h"
+
+#define TEMPO_WINDOW 0.04 // Seconds of audio in each WSOLA window
+#define TEMPO_TOLERANCE 0.01 // Seconds a WSOLA window may move to match the previous one
+#define TEMPO_COARSE_STEP 4 // Offsets skipped in the first pass of the WSOLA search
+
+/**
+ * @brief State of one effect of a chain
+*/
+typedef struct dsp_stage {
+
+    EFFECT effect;
+    int channels;
+
+    // Echo: ring buffer with the last inputs and the delay of each tap in frames
+    float * history;
+    size_t history_frames;
+    size_t history_pos;
+    size_t taps[DSP_MAX_TAPS];
+
+    // Tempo: buffered input, counted in absolute frames, and its mono mix used to match windows
+    float * input;
+    float * mono;
+    long input_start;
+    size_t input_frames;
+    size_t input_cap;
+    float * window;
+    float * ola; // Overlap-add accumulator with one window of output
+    int window_frames;
+    int hop; // Synthesis hop, half a window
+    int tolerance;
+    long step; // Number of windows already added
+    long prev; // Input position of the last window, -1 before the first
+    size_t total_in;
+    size_t total_out;
+
+    // Output of the effects that don't work in place
+    float * out;
+    size_t out_frames;
+    size_t out_cap;
+
+} DSP_STAGE;
+
+/**
+ * @brief Chain of effects applied to interleaved float PCM
+*/
+struct dsp_chain {
+
+    DSP_STAGE * stages;
+    int n_stages;
+    int rate;
+    int channels;
+
+};
+
+/**
+ * @brief Parses a parameter of the config file that describes an effect
+ * @param e Effect to fill
+ * @param key Name of the parameter: gain, tempo or echo
+ * @param value Value of the parameter, echo uses ffmpeg's aecho syntax (in:out:delays:decays)
+ * @return 0 if parsed, -1 if the key isn't an effect or the value is invalid
+*/
+int dsp_parse_effect(EFFECT * e, char * key, char * value) {
+
+    if (!strcmp(key, "gain")) {
+        e->type = EFFECT_GAIN;
+        e->gain = atof(value);
+        return 0;
+    }
+
+    if (!strcmp(key, "tempo")) {
+        e->type = EFFECT_TEMPO;
+        e->tempo = atof(value);
+        return e->tempo > 0 ? 0 : -1;
+    }
+
+    if (!strcmp(key, "echo")) {
+
+        char * save;
+        char * in_gain = strtok_r(value, ":", &save);
+        char * out_gain = strtok_r(NULL, ":", &save);
+        char * delays = strtok_r(NULL, ":", &save);
+        char * decays = strtok_r(NULL, ":", &save);
+        if (!decays) return -1;
+
+        e->type = EFFECT_ECHO;
+        e->in_gain = atof(in_gain);
+        e->out_gain = atof(out_gain);
+
+        // Delays and decays are separated by '|', each tap needs both
+        int n_delays = 0, n_decays = 0;
+        for (char * d = strtok_r(delays, "|", &save); d && n_delays < DSP_MAX_TAPS; d = strtok_r(NULL, "|", &save))
+            e->delays[n_delays++] = atof(d);
+        for (char * d = strtok_r(decays, "|", &save); d && n_decays < DSP_MAX_TAPS; d = strtok_r(NULL, "|", &save))
+            e->decays[n_decays++] = atof(d);
+        e->n_taps = n_delays < n_decays ? n_delays : n_decays;
+
+        return e->n_taps ? 0 : -1;
+
+    }
+
+    return -1;
+
+}
+
+/**
+ * @brief Gets how much input an effect needs before a point to give, after it, the same output
+ * it gives on the whole stream, so a stream can be cut and processed in parts
+ * @param e Effect
+ * @return Seconds of input, or -1 if the effect is unknown
+*/
+double dsp_warmup(EFFECT * e) {
+
+    double seconds = 0;
+    switch (e->type) {
+        case EFFECT_GAIN:
+            break;
+        case EFFECT_ECHO: // The longest delay reaches back the furthest
+            for (int i = 0; i < e->n_taps; i++)
+                if (e->delays[i] / 1000 > seconds) seconds = e->delays[i] / 1000;
+            break;
+        case EFFECT_TEMPO: // Enough windows for the search to settle on the same positions
+            seconds = 2 * TEMPO_WINDOW + TEMPO_TOLERANCE;
+            break;
+        default:
+            seconds = -1;
+            break;
+    }
+
+    return seconds;
+
+}
+
+/**
+ * @brief Joins the end of a stream with the start of another one that overlaps it: finds where the
+ * second stream best continues the first, within a search range, and crossfades them there
+ * @param tail Frames of the first stream from the join on, replaced by the crossfade
+ * @param head Frames of the second stream from search frames before the join on, frames + 2 * search of them
+ * @param frames Frames to crossfade
+ * @param search Frames the join may move to either side
+ * @param channels Channels of both streams
+ * @return Frame of head where the crossfade started
+*/
+int dsp_join(float * tail, float * head, int frames, int search, int channels) {
+
+    int best = search;
+    double best_score = -INFINITY;
+    for (int offset = 0; offset <= 2 * search; offset++) {
+
+        double dot = 0, energy = 1e-9;
+        float * h = head + (size_t) offset * channels;
+        for (size_t n = 0; n < (size_t) frames * channels; n++) {
+            dot += tail[n] * h[n];
+            energy += h[n] * h[n];
+        }
+
+        // Ties keep the offset closest to the nominal join
+        double score = dot / sqrt(energy);
+        if (score > best_score || (score == best_score && abs(offset - search) < abs(best - search))) {
+            best_score = score;
+            best = offset;
+        }
+
+    }
+
+    float * h = head + (size_t) best * channels;
+    for (int n = 0; n < frames; n++) {
+        float w = 0.5 - 0.5 * cos(M_PI * (n + 0.5) / frames);
+        for (int c = 0; c < channels; c++)
+            tail[n * channels + c] = tail[n * channels + c] * (1 - w) + h[n * channels + c] * w;
+    }
+
+    return best;
+
+}
+
+/**
+ * @brief Multiplies samples by a gain, one at a time
+*/
+static void gain_scalar(float * samples, size_t n, float gain) {
+
+    for (size_t i = 0; i < n; i++) samples[i] *= gain;
+
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * @brief Multiplies samples by a gain, four at a time
+*/
+__attribute__((target("sse")))
+static void gain_sse(float * samples, size_t n, float gain) {
+
+    __m128 factor = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), factor));
+    gain_scalar(samples + i, n - i, gain);
+
+}
+
+/**
+ * @brief Multiplies samples by a gain, eight at a time
+*/
+__attribute__((target("avx2")))
+static void gain_avx2(float * samples, size_t n, float gain) {
+
+    __m256 factor = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(samples + i, _mm256_mul_ps(_mm256_loadu_ps(samples + i), factor));
+    gain_scalar(samples + i, n - i, gain);
+
+}
+
+#endif
+
+/**
+ * @brief Multiplies samples by a gain with the widest vector instructions the CPU has
+ * @param samples Samples to change
+ * @param n Number of samples
+ * @param gain Factor to apply
+*/
+void dsp_gain(float * samples, size_t n, float gain) {
+
+    static void (* gain_function)(float *, size_t, float) = NULL;
+
+    if (!gain_function) {
+        gain_function = gain_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) gain_function = gain_avx2;
+        else if (__builtin_cpu_supports("sse")) gain_function = gain_sse;
+#endif
+    }
+
+    gain_function(samples, n, gain);
+
+}
+
+/**
+ * @brief Makes sure the output of a stage has room for more frames
+ * @param s Stage
+ * @param frames Number of frames to add
+ * @return Pointer to where the new frames go
+*/
+static float * reserve_output(DSP_STAGE * s, size_t frames) {
+
+    if (s->out_frames + frames > s->out_cap) {
+        s->out_cap = (s->out_frames + frames) * 2;
+        s->out = realloc(s->out, s->out_cap * s->channels * sizeof(float));
+    }
+
+    return s->out + s->out_frames * s->channels;
+
+}
+
+/**
+ * @brief Prepares the ring buffer of an echo
+*/
+static void echo_init(DSP_STAGE * s, int rate) {
+
+    s->history_frames = 1;
+    for (int i = 0; i < s->effect.n_taps; i++) {
+
+        s->taps[i] = s->effect.delays[i] * rate / 1000.0;
+        if (s->taps[i] < 1) s->taps[i] = 1;
+        if (s->taps[i] > s->history_frames) s->history_frames = s->taps[i];
+
+    }
+
+    s->history = calloc(s->history_frames * s->channels, sizeof(float));
+    s->history_pos = 0;
+
+}
+
+/**
+ * @brief Applies an echo in place: out = (in * in_gain + sum of delayed inputs * decays) * out_gain
+*/
+static void echo_process(DSP_STAGE * s, float * data, size_t frames) {
+
+    int channels = s->channels;
+    size_t length = s->history_frames;
+
+    for (size_t f = 0; f < frames; f++) {
+
+        float * frame = data + f * channels;
+        for (int c = 0; c < channels; c++) {
+
+            float in = frame[c];
+            float out = in * s->effect.in_gain;
+            for (int j = 0; j < s->effect.n_taps; j++)
+                out += s->history[((s->history_pos + length - s->taps[j]) % length) * channels + c] * s->effect.decays[j];
+
+            s->history[s->history_pos * channels + c] = in;
+            frame[c] = out * s->effect.out_gain;
+
+        }
+
+        s->history_pos = (s->history_pos + 1) % length;
+
+    }
+
+}
+
+/**
+ * @brief Prepares the windows and buffers of a WSOLA tempo change
+*/
+static void tempo_init(DSP_STAGE * s, int rate) {
+
+    s->window_frames = (int) (rate * TEMPO_WINDOW) & ~1;
+    if (s->window_frames < 64) s->window_frames = 64;
+    s->hop = s->window_frames / 2;
+    s->tolerance = rate * TEMPO_TOLERANCE;
+
+    // A periodic Hann window adds up to 1 when overlapped by half
+    s->window = malloc(s->window_frames * sizeof(float));
+    for (int n = 0; n < s->window_frames; n++)
+        s->window[n] = 0.5 - 0.5 * cos(2 * M_PI * n / s->window_frames);
+
+    s->ola = calloc(s->window_frames * s->channels, sizeof(float));
+    s->step = 0;
+    s->prev = -1;
+
+}
+
+/**
+ * @brief Adds frames to the input buffered by a tempo change
+*/
+static void tempo_append(DSP_STAGE * s, float * data, size_t frames) {
+
+    if (s->input_frames + frames > s->input_cap) {
+        s->input_cap = (s->input_frames + frames) * 2;
+        s->input = realloc(s->input, s->input_cap * s->channels * sizeof(float));
+        s->mono = realloc(s->mono, s->input_cap * sizeof(float));
+    }
+
+    float * input = s->input + s->input_frames * s->channels;
+    float * mono = s->mono + s->input_frames;
+    if (data) memcpy(input, data, frames * s->channels * sizeof(float));
+    else memset(input, 0, frames * s->channels * sizeof(float));
+
+    for (size_t f = 0; f < frames; f++) {
+        float sum = 0;
+        for (int c = 0; c < s->channels; c++) sum += input[f * s->channels + c];
+        mono[f] = sum;
+    }
+
+    s->input_frames += frames;
+
+}
+
+/**
+ * @brief Measures how well a window starting at x continues the previous window
+ * @return Normalized cross-correlation with the natural continuation
+*/
+static float tempo_similarity(DSP_STAGE * s, long x, long natural) {
+
+    float * candidate = s->mono + (x - s->input_start);
+    float * reference = s->mono + (natural - s->input_start);
+    float dot = 0, energy = 0;
+
+    // Only the half that overlaps the previous window matters, every other frame is enough
+    for (int n = 0; n < s->hop; n += 2) {
+        dot += candidate[n] * reference[n];
+        energy += candidate[n] * candidate[n];
+    }
+
+    return dot / sqrtf(energy + 1e-9f);
+
+}
+
+/**
+ * @brief Adds one window to the output of a tempo change, if enough input is buffered
+ * @return 1 if a window was added, 0 if more input is needed
+*/
+static int tempo_step(DSP_STAGE * s) {
+
+    int channels = s->channels;
+    long ideal = lround(s->step * s->hop * s->effect.tempo);
+    long natural = s->prev + s->hop;
+    long lo = ideal - s->tolerance, hi = ideal + s->tolerance;
+    long end = s->input_start + (long) s->input_frames;
+
+    if (lo < s->input_start) lo = s->input_start;
+    if (hi + s->window_frames > end || (s->prev >= 0 && natural + s->window_frames > end)) return 0;
+
+    // Searches the window closest to the ideal position that best continues the previous one
+    long x = 0;
+    if (s->prev >= 0) {
+
+        float best = -INFINITY;
+        for (long candidate = lo; candidate <= hi; candidate += TEMPO_COARSE_STEP) {
+            float similarity = tempo_similarity(s, candidate, natural);
+            if (similarity > best) {
+                best = similarity;
+                x = candidate;
+            }
+        }
+
+        long coarse = x;
+        for (long candidate = coarse - TEMPO_COARSE_STEP + 1; candidate < coarse + TEMPO_COARSE_STEP; candidate++) {
+            if (candidate < lo || candidate > hi || candidate == coarse) continue;
+            float similarity = tempo_similarity(s, candidate, natural);
+            if (similarity > best) {
+                best = similarity;
+                x = candidate;
+            }
+        }
+
+    }
+
+    // Overlap-adds the window, the first one isn't faded in
+    float * input = s->input + (x - s->input_start) * channels;
+    for (int n = 0; n < s->window_frames; n++) {
+        float w = (s->prev < 0 && n < s->hop) ? 1 : s->window[n];
+        for (int c = 0; c < channels; c++)
+            s->ola[n * channels + c] += w * input[n * channels + c];
+    }
+
+    // The first hop is complete, it goes to the output
+    memcpy(reserve_output(s, s->hop), s->ola, s->hop * channels * sizeof(float));
+    s->out_frames += s->hop;
+    memmove(s->ola, s->ola + s->hop * channels, (s->window_frames - s->hop) * channels * sizeof(float));
+    memset(s->ola + (s->window_frames - s->hop) * channels, 0, s->hop * channels * sizeof(float));
+
+    s->prev = x;
+    s->step++;
+
+    // Drops the input no future window can use
+    long keep = lround(s->step * s->hop * s->effect.tempo) - s->tolerance;
+    if (s->prev + s->hop < keep) keep = s->prev + s->hop;
+    long drop = keep - s->input_start;
+    if (drop > s->window_frames) {
+        memmove(s->input, s->input + drop * channels, (s->input_frames - drop) * channels * sizeof(float));
+        memmove(s->mono, s->mono + drop, (s->input_frames - drop) * sizeof(float));
+        s->input_frames -= drop;
+        s->input_start += drop;
+    }
+
+    return 1;
+
+}
+
+/**
+ * @brief Changes the tempo of frames, keeping the pitch
+ * @return Frames that are ready
+*/
+static float * tempo_process(DSP_STAGE * s, float * data, size_t frames, size_t * out_frames) {
+
+    s->out_frames = 0;
+    s->total_in += frames;
+    tempo_append(s, data, frames);
+    while (tempo_step(s));
+
+    s->total_out += s->out_frames;
+    *out_frames = s->out_frames;
+    return s->out;
+
+}
+
+/**
+ * @brief Ends a tempo change, so the output lasts the input divided by the tempo
+ * @return Remaining frames
+*/
+static float * tempo_flush(DSP_STAGE * s, size_t * out_frames) {
+
+    s->out_frames = 0;
+
+    // Silence after the end lets the last windows be searched
+    tempo_append(s, NULL, s->window_frames + s->hop + s->tolerance);
+    while (lround(s->step * s->hop * s->effect.tempo) < (long) s->total_in && tempo_step(s));
+
+    memcpy(reserve_output(s, s->window_frames - s->hop), s->ola, (s->window_frames - s->hop) * s->channels * sizeof(float));
+    s->out_frames += s->window_frames - s->hop;
+
+    size_t expected = lround(s->total_in / s->effect.tempo);
+    if (s->total_out + s->out_frames > expected)
+        s->out_frames = expected > s->total_out ? expected - s->total_out : 0;
+
+    s->total_out += s->out_frames;
+    *out_frames = s->out_frames;
+    return s->out;
+
+}
+
+/**
+ * @brief Applies the effect of a stage
+ * @return Processed frames, in place for the effects that keep the number of frames
+*/
+static float * stage_process(DSP_STAGE * s, float * data, size_t frames, size_t * out_frames) {
+
+    *out_frames = frames;
+
+    switch (s->effect.type) {
+        case EFFECT_GAIN:
+            dsp_gain(data, frames * s->channels, s->effect.gain);
+            break;
+        case EFFECT_ECHO:
+            echo_process(s, data, frames);
+            break;
+        case EFFECT_TEMPO:
+            data = tempo_process(s, data, frames, out_frames);
+            break;
+        default:
+            break;
+    }
+
+    return data;
+
+}
+
+/**
+ * @brief Gets the frames a stage still holds at the end of the input
+ * @return Remaining frames
+*/
+static float * stage_flush(DSP_STAGE * s, size_t * out_frames) {
+
+    *out_frames = 0;
+
+    // The echo of the last frames is heard after the input ends
+    if (s->effect.type == EFFECT_ECHO) {
+        s->out_frames = 0;
+        float * silence = reserve_output(s, s->history_frames);
+        memset(silence, 0, s->history_frames * s->channels * sizeof(float));
+        echo_process(s, silence, s->history_frames);
+        *out_frames = s->history_frames;
+        return s->out;
+    }
+
+    if (s->effect.type == EFFECT_TEMPO) return tempo_flush(s, out_frames);
+
+    return NULL;
+
+}
+
+/**
+ * @brief Creates a chain of effects
+ * @param effects Effects, in the order they are applied
+ * @param n_effects Number of effects
+ * @param rate Sample rate of the PCM
+ * @param channels Number of interleaved channels of the PCM
+ * @return The chain
+*/
+DSP_CHAIN dsp_chain_new(EFFECT * effects[], int n_effects, int rate, int channels) {
+
+    DSP_CHAIN c = malloc(sizeof(struct dsp_chain));
+    c->stages = calloc(n_effects, sizeof(DSP_STAGE));
+    c->n_stages = n_effects;
+    c->rate = rate;
+    c->channels = channels;
+
+    for (int i = 0; i < n_effects; i++) {
+
+        DSP_STAGE * s = &c->stages[i];
+        s->effect = *effects[i];
+        s->channels = channels;
+
+        if (s->effect.type == EFFECT_ECHO) echo_init(s, rate);
+        else if (s->effect.type == EFFECT_TEMPO) tempo_init(s, rate);
+
+    }
+
+    return c;
+
+}
+
+/**
+ * @brief Applies a chain to a block of frames
+ * @param c Chain
+ * @param in Interleaved frames, they may be changed
+ * @param frames Number of frames
+ * @param out_frames Number of frames of the output
+ * @return Output, valid until the next call
+*/
+float * dsp_chain_process(DSP_CHAIN c, float * in, size_t frames, size_t * out_frames) {
+
+    for (int i = 0; i < c->n_stages; i++)
+        in = stage_process(&c->stages[i], in, frames, &frames);
+
+    *out_frames = frames;
+    return in;
+
+}
+
+/**
+ * @brief Writes a whole buffer
+ * @return 0 if written, -1 on error
+*/
+static int write_all(int fd, void * buffer, size_t size) {
+
+    char * data = buffer;
+    while (size > 0) {
+
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        size -= written;
+
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Applies a chain to the PCM read from a descriptor until its end
+ * @param c Chain
+ * @param fd_in Descriptor with interleaved float PCM
+ * @param fd_out Descriptor to write the processed PCM to
+ * @return 0 on success, -1 on error
+*/
+int dsp_run(DSP_CHAIN c, int fd_in, int fd_out) {
+
+    size_t frame_size = c->channels * sizeof(float);
+    char * block = malloc(DSP_BLOCK * frame_size);
+    size_t used = 0;
+    ssize_t bytes_read;
+    int ret = 0;
+
+    while ((bytes_read = read(fd_in, block + used, DSP_BLOCK * frame_size - used)) != 0) {
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        used += bytes_read;
+
+        // Incomplete frames wait for the rest of their samples
+        size_t frames = used / frame_size, out_frames;
+        if (!frames) continue;
+        float * out = dsp_chain_process(c, (float *) block, frames, &out_frames);
+        if (write_all(fd_out, out, out_frames * frame_size) < 0) {
+            ret = -1;
+            break;
+        }
+
+        used -= frames * frame_size;
+        memmove(block, block + frames * frame_size, used);
+
+    }
+
+    // What each stage holds at the end still goes through the stages after it
+    for (int i = 0; !ret && i < c->n_stages; i++) {
+
+        size_t frames;
+        float * out = stage_flush(&c->stages[i], &frames);
+        for (int j = i + 1; frames && j < c->n_stages; j++)
+            out = stage_process(&c->stages[j], out, frames, &frames);
+        if (frames && write_all(fd_out, out, frames * frame_size) < 0) ret = -1;
+
+    }
+
+    free(block);
+
+    return ret;
+
+}
+
+/**
+ * @brief Starts a raw PCM stream
+ * @param fd Descriptor of the stream
+ * @param rate Sample rate
+ * @param channels Number of interleaved channels
+ * @return 0 on success, -1 on error
+*/
+int dsp_write_header(int fd, int rate, int channels) {
+
+    PCM_HEADER header;
+    memcpy(header.magic, PCM_MAGIC, sizeof(header.magic));
+    header.format = PCM_F32LE;
+    header.rate = rate;
+    header.channels = channels;
+
+    return write_all(fd, &header, sizeof(header));
+
+}
+
+/**
+ * @brief Reads the header of a raw PCM stream, and nothing after it
+ * @param fd Descriptor of the stream
+ * @param rate Where to place the sample rate
+ * @param channels Where to place the number of channels
+ * @return 0 on success, -1 if the stream doesn't start with a valid header
+*/
+int dsp_read_header(int fd, int * rate, int * channels) {
+
+    PCM_HEADER header;
+    size_t total = 0;
+    while (total < sizeof(header)) {
+
+        ssize_t bytes_read = read(fd, (char *) &header + total, sizeof(header) - total);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) return -1;
+        total += bytes_read;
+
+    }
+
+    if (memcmp(header.magic, PCM_MAGIC, sizeof(header.magic)) || header.format != PCM_F32LE 
+                                                                 || !header.rate || !header.channels)
+        return -1;
+
+    *rate = header.rate;
+    *channels = header.channels;
+
+    return 0;
+
+}
+
+/**
+ * @brief Frees a chain
+ * @param c Chain
+*/
+void dsp_chain_free(DSP_CHAIN c) {
+
+    for (int i = 0; i < c->n_stages; i++) {
+
+        DSP_STAGE * s = &c->stages[i];
+        free(s->history);
+        free(s->input);
+        free(s->mono);
+        free(s->window);
+        free(s->ola);
+        free(s->out);
+
+    }
+    free(c->stages);
+    free(c);
+
+}
@@ -0,0 +1,77 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DSP_MAX_TAPS 8 // Delays an echo can have
+#define DSP_BLOCK 4096 // Frames read from the decoder at once
+#define DSP_CROSSFADE 0.02 // Seconds two streams overlap when they're joined
+#define DSP_JOIN_SEARCH 0.01 // Seconds a join may move to either side to match the streams
+
+#define PCM_MAGIC "AURP"
+#define PCM_F32LE 1 // Interleaved 32-bit float samples, little endian
+
+/**
+ * @brief Header that starts a raw PCM stream between two stages of a pipeline
+*/
+typedef struct pcm_header {
+
+    char magic[4]; // PCM_MAGIC
+    uint32_t format; // PCM_F32LE
+    uint32_t rate;
+    uint32_t channels;
+
+} PCM_HEADER;
+
+/**
+ * @brief Kinds of effect the built-in engine can apply
+*/
+typedef enum effect_type {
+
+    EFFECT_NONE,
+    EFFECT_GAIN,
+    EFFECT_ECHO,
+    EFFECT_TEMPO
+
+} EFFECT_TYPE;
+
+/**
+ * @brief Parameters of an effect, as declared in the config file
+*/
+typedef struct effect {
+
+    EFFECT_TYPE type;
+    float gain; // Factor of a gain
+    float tempo; // Speed factor of a tempo change
+    float in_gain; // Echo parameters, with the meaning of ffmpeg's aecho
+    float out_gain;
+    int n_taps;
+    float delays[DSP_MAX_TAPS]; // Milliseconds
+    float decays[DSP_MAX_TAPS];
+
+} EFFECT;
+
+typedef struct dsp_chain * DSP_CHAIN;
+
+int dsp_parse_effect(EFFECT * e, char * key, char * value);
+
+double dsp_warmup(EFFECT * e);
+
+int dsp_join(float * tail, float * head, int frames, int search, int channels);
+
+void dsp_gain(float * samples, size_t n, float gain);
+
+DSP_CHAIN dsp_chain_new(EFFECT * effects[], int n_effects, int rate, int channels);
+
+float * dsp_chain_process(DSP_CHAIN c, float * in, size_t frames, size_t * out_frames);
+
+int dsp_run(DSP_CHAIN c, int fd_in, int fd_out);
+
+int dsp_write_header(int fd, int rate, int channels);
+
+int dsp_read_header(int fd, int * rate, int * channels);
+
+void dsp_chain_free(DSP_CHAIN c);
+
+#endif
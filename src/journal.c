@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x4a525541 // First bytes of the file, "AURJ" in little endian
+#define JOURNAL_VERSION 1 // Changes whenever the layout of the file does
+#define JOURNAL_CHUNK (1 << 20) // Bytes the file is sized in multiples of
+#define JOURNAL_ALIGN 8 // Records start at multiples of it
+
+/**
+ * @brief Kinds of record
+*/
+typedef enum record_type {
+
+    RECORD_ACCEPT = 1, // A job was accepted, with the strings of its transform message
+    RECORD_DECODE, // The source of a job was decoded and kept for its segments, with a DECODE_PAYLOAD
+    RECORD_SEGMENT, // A segment of a job ended, with a SEGMENT_PAYLOAD
+    RECORD_END // A job ended, however it did
+
+} RECORD_TYPE;
+
+/**
+ * @brief Start of the file
+*/
+typedef struct file_header {
+
+    uint32_t magic; // JOURNAL_MAGIC
+    uint32_t version; // JOURNAL_VERSION
+    uint32_t generation; // Changes when the journal is emptied, records of other generations are stale
+    uint32_t reserved;
+
+} FILE_HEADER;
+
+/**
+ * @brief Start of a record, followed by its payload and padded to JOURNAL_ALIGN
+*/
+typedef struct record_header {
+
+    uint32_t length; // Bytes of the payload
+    uint32_t checksum; // Of the rest of the header and the payload, so a torn record ends the journal
+    uint32_t type; // RECORD_TYPE, 0 where nothing was written
+    int32_t task;
+    uint32_t generation; // Of the file when the record was written
+    uint32_t reserved;
+
+} RECORD_HEADER;
+
+typedef struct decode_payload {
+
+    int64_t bytes;
+    int32_t n_segments;
+    int32_t reserved;
+
+} DECODE_PAYLOAD;
+
+typedef struct segment_payload {
+
+    int64_t from;
+    int64_t to;
+    int32_t segment;
+    int32_t reserved;
+
+} SEGMENT_PAYLOAD;
+
+/**
+ * @brief Append-only file of the jobs accepted and how far they got, mapped in memory. Records are written
+ * to the mapping and reach the storage together, once per journal_sync. The jobs that didn't end are also
+ * kept in memory, so the file can be rewritten with only them when it's full
+*/
+struct journal {
+
+    char * path;
+    int fd;
+    char * map;
+    size_t size; // Bytes of the file, all of them mapped
+    size_t used; // Bytes written, from the start of the file
+    size_t dirty; // Bytes from there on that may not be on the storage yet
+    uint32_t generation;
+    JOURNAL_JOB * jobs; // Jobs that didn't end, in the order they were accepted
+    int n_jobs;
+    int cap;
+
+};
+
+/**
+ * @brief Rounds a size up to a multiple of a power of two
+*/
+static size_t round_up(size_t size, size_t multiple) {
+
+    return (size + multiple - 1) & ~(multiple - 1);
+
+}
+
+/**
+ * @brief Computes the checksum of a record (FNV-1a)
+ * @param h Header of the record, whose checksum isn't included
+ * @param payload Payload of the record
+ * @return Checksum
+*/
+static uint32_t checksum(RECORD_HEADER * h, const char * payload) {
+
+    uint32_t hash = 2166136261u;
+    uint32_t fields[4] = { h->length, h->type, (uint32_t) h->task, h->generation };
+    const unsigned char * bytes = (const unsigned char *) fields;
+    for (size_t i = 0; i < sizeof(fields); i++) hash = (hash ^ bytes[i]) * 16777619u;
+    bytes = (const unsigned char *) payload;
+    for (uint32_t i = 0; i < h->length; i++) hash = (hash ^ bytes[i]) * 16777619u;
+
+    return hash;
+
+}
+
+/**
+ * @brief Bytes a record takes in the file
+*/
+static size_t record_size(uint32_t length) {
+
+    return round_up(sizeof(RECORD_HEADER) + length, JOURNAL_ALIGN);
+
+}
+
+/**
+ * @brief Finds the position of a job among the ones that didn't end
+ * @return Position, -1 if it's not there
+*/
+static int find_job(JOURNAL j, int task) {
+
+    for (int i = 0; i < j->n_jobs; i++)
+        if (j->jobs[i].task == task) return i;
+
+    return -1;
+
+}
+
+/**
+ * @brief Applies a record to the jobs that didn't end
+ * @param j Journal
+ * @param h Header of the record
+ * @param payload Payload of the record
+*/
+static void apply(JOURNAL j, RECORD_HEADER * h, const char * payload) {
+
+    int i = find_job(j, h->task);
+    if (h->type == RECORD_ACCEPT && i < 0) {
+
+        if (j->n_jobs == j->cap) {
+            j->cap = j->cap ? 2 * j->cap : 16;
+            j->jobs = realloc(j->jobs, j->cap * sizeof(JOURNAL_JOB));
+        }
+        JOURNAL_JOB * job = &j->jobs[j->n_jobs++];
+        memset(job, 0, sizeof(JOURNAL_JOB));
+        job->task = h->task;
+        job->payload = malloc(h->length ? h->length : 1);
+        memcpy(job->payload, payload, h->length);
+        job->length = h->length;
+        job->decoded = -1;
+
+    }
+    if (i < 0) return;
+
+    JOURNAL_JOB * job = &j->jobs[i];
+    if (h->type == RECORD_DECODE && h->length >= sizeof(DECODE_PAYLOAD)) {
+
+        // Segments cut from an earlier decode don't match this one
+        DECODE_PAYLOAD decode;
+        memcpy(&decode, payload, sizeof(decode));
+        job->decoded = decode.bytes;
+        job->n_segments = decode.n_segments;
+        job->n_checkpoints = 0;
+
+    }
+    else if (h->type == RECORD_SEGMENT && h->length >= sizeof(SEGMENT_PAYLOAD)) {
+
+        SEGMENT_PAYLOAD segment;
+        memcpy(&segment, payload, sizeof(segment));
+        job->checkpoints = realloc(job->checkpoints, (job->n_checkpoints + 1) * sizeof(JOURNAL_CHECKPOINT));
+        job->checkpoints[job->n_checkpoints++] = (JOURNAL_CHECKPOINT) { segment.segment, segment.from, segment.to };
+
+    }
+    else if (h->type == RECORD_END) {
+
+        free(job->payload);
+        free(job->checkpoints);
+        memmove(job, job + 1, (j->n_jobs - i - 1) * sizeof(JOURNAL_JOB));
+        j->n_jobs--;
+
+    }
+
+}
+
+/**
+ * @brief Writes a record at the end of the mapping, which has room for it. The payload goes first, so a
+ * record cut short by a crash fails its checksum
+ * @param j Journal
+ * @param type RECORD_TYPE
+ * @param task Task of the job
+ * @param payload Payload
+ * @param length Bytes of the payload
+*/
+static void put(JOURNAL j, uint32_t type, int task, const char * payload, uint32_t length) {
+
+    RECORD_HEADER h = { length, 0, type, task, j->generation, 0 };
+    h.checksum = checksum(&h, payload);
+
+    char * at = j->map + j->used;
+    memcpy(at + sizeof(RECORD_HEADER), payload, length);
+    memcpy(at, &h, sizeof(RECORD_HEADER));
+
+    if (j->dirty > j->used) j->dirty = j->used;
+    j->used += record_size(length);
+
+}
+
+/**
+ * @brief Writes the records of a job that didn't end, enough to rebuild it
+ * @param j Journal
+ * @param job Job
+*/
+static void put_job(JOURNAL j, JOURNAL_JOB * job) {
+
+    put(j, RECORD_ACCEPT, job->task, job->payload, job->length);
+    if (job->decoded < 0) return;
+
+    DECODE_PAYLOAD decode = { job->decoded, job->n_segments, 0 };
+    put(j, RECORD_DECODE, job->task, (char *) &decode, sizeof(decode));
+    for (int i = 0; i < job->n_checkpoints; i++) {
+        JOURNAL_CHECKPOINT * c = &job->checkpoints[i];
+        SEGMENT_PAYLOAD segment = { c->from, c->to, c->segment, 0 };
+        put(j, RECORD_SEGMENT, job->task, (char *) &segment, sizeof(segment));
+    }
+
+}
+
+/**
+ * @brief Replaces the file with a new one that only has the jobs that didn't end, with room for more.
+ * The new file reaches the storage before it takes the place of the old one
+ * @param j Journal
+ * @param extra Bytes of the record that has to fit after them
+ * @return 0 on success, -1 on error, with the old file still in use
+*/
+static int rewrite(JOURNAL j, size_t extra) {
+
+    size_t needed = sizeof(FILE_HEADER) + extra;
+    for (int i = 0; i < j->n_jobs; i++) {
+        needed += record_size(j->jobs[i].length);
+        if (j->jobs[i].decoded >= 0)
+            needed += record_size(sizeof(DECODE_PAYLOAD)) + j->jobs[i].n_checkpoints * record_size(sizeof(SEGMENT_PAYLOAD));
+    }
+    size_t size = round_up(2 * needed, JOURNAL_CHUNK);
+
+    char path[strlen(j->path) + 5];
+    sprintf(path, "%s.new", j->path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    char * map = MAP_FAILED;
+    if (fd < 0 || ftruncate(fd, size) < 0 || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        if (fd >= 0) close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    char * old_map = j->map;
+    size_t old_size = j->size;
+    j->map = map;
+    j->size = size;
+    j->used = sizeof(FILE_HEADER);
+    FILE_HEADER header = { JOURNAL_MAGIC, JOURNAL_VERSION, j->generation, 0 };
+    memcpy(map, &header, sizeof(header));
+    for (int i = 0; i < j->n_jobs; i++) put_job(j, &j->jobs[i]);
+
+    if (msync(map, j->used, MS_SYNC) < 0 || rename(path, j->path) < 0) {
+        munmap(map, size);
+        close(fd);
+        unlink(path);
+        j->map = old_map;
+        j->size = old_size;
+        return -1;
+    }
+
+    if (old_map) munmap(old_map, old_size);
+    if (j->fd >= 0) close(j->fd);
+    j->fd = fd;
+    j->dirty = j->used;
+
+    return 0;
+
+}
+
+/**
+ * @brief Appends a record and applies it. When the last job ends, the journal is emptied instead
+ * @param j Journal
+ * @param type RECORD_TYPE
+ * @param task Task of the job
+ * @param payload Payload
+ * @param length Bytes of the payload
+ * @return 0 on success, -1 if the record couldn't be written
+*/
+static int append(JOURNAL j, uint32_t type, int task, const char * payload, uint32_t length) {
+
+    RECORD_HEADER h = { length, 0, type, task, j->generation, 0 };
+    if (type == RECORD_END && j->n_jobs == 1 && j->jobs[0].task == task) {
+
+        // A new generation makes every record stale, it's written through so no record of it
+        // can reach the storage before it
+        apply(j, &h, payload);
+        j->generation++;
+        memcpy(j->map + offsetof(FILE_HEADER, generation), &j->generation, sizeof(j->generation));
+        j->used = sizeof(FILE_HEADER);
+        j->dirty = j->used;
+        return msync(j->map, sizeof(FILE_HEADER), MS_SYNC);
+
+    }
+
+    if (j->used + record_size(length) > j->size && rewrite(j, record_size(length)) < 0) return -1;
+    put(j, type, task, payload, length);
+    apply(j, &h, payload);
+
+    return 0;
+
+}
+
+/**
+ * @brief Opens a journal and reads the jobs that didn't end, then rewrites it with only them
+ * @param path Path of the file, created if it doesn't exist
+ * @return Journal, NULL on error
+*/
+JOURNAL journal_open(char * path) {
+
+    JOURNAL j = calloc(1, sizeof(struct journal));
+    j->path = strdup(path);
+    j->fd = -1;
+
+    // Records are read until the first one that wasn't written whole, or is stale
+    int fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    char * map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(FILE_HEADER))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+
+        FILE_HEADER header;
+        memcpy(&header, map, sizeof(header));
+        size_t offset = sizeof(FILE_HEADER);
+        while (header.magic == JOURNAL_MAGIC && header.version == JOURNAL_VERSION &&
+               offset + sizeof(RECORD_HEADER) <= (size_t) st.st_size) {
+
+            RECORD_HEADER h;
+            memcpy(&h, map + offset, sizeof(h));
+            char * payload = map + offset + sizeof(RECORD_HEADER);
+            if (!h.type || h.generation != header.generation || h.length > st.st_size - offset - sizeof(RECORD_HEADER) ||
+                h.checksum != checksum(&h, payload))
+                break;
+
+            apply(j, &h, payload);
+            offset += record_size(h.length);
+
+        }
+        j->generation = header.generation + 1;
+        munmap(map, st.st_size);
+
+    }
+    if (fd >= 0) close(fd);
+
+    if (fd < 0 || rewrite(j, 0) < 0) {
+        journal_close(j);
+        return NULL;
+    }
+
+    return j;
+
+}
+
+/**
+ * @brief Gets the jobs that didn't end
+ * @param j Journal
+ * @param jobs Where to place the array of the jobs, owned by the journal
+ * @return Number of jobs
+*/
+int journal_jobs(JOURNAL j, JOURNAL_JOB ** jobs) {
+
+    *jobs = j->jobs;
+    return j->n_jobs;
+
+}
+
+/**
+ * @brief Finds a job that didn't end
+ * @param j Journal
+ * @param task Task of the job
+ * @return The job, owned by the journal until its next change, NULL if it's not there
+*/
+JOURNAL_JOB * journal_find(JOURNAL j, int task) {
+
+    int i = find_job(j, task);
+    return i >= 0 ? &j->jobs[i] : NULL;
+
+}
+
+/**
+ * @brief Records that a job was accepted
+ * @param j Journal
+ * @param task Task of the job
+ * @param payload Strings of its transform message, enough to accept it again
+ * @param length Bytes of the strings
+ * @return 0 on success, -1 on error
+*/
+int journal_accept(JOURNAL j, int task, char * payload, uint32_t length) {
+
+    return append(j, RECORD_ACCEPT, task, payload, length);
+
+}
+
+/**
+ * @brief Records that the source of a job was decoded and kept for its segments, which forgets the segments
+ * that ended before
+ * @param j Journal
+ * @param task Task of the job
+ * @param bytes Size of the decoded source
+ * @param n_segments Segments it's split in
+ * @return 0 on success, -1 on error
+*/
+int journal_decode(JOURNAL j, int task, long long bytes, int n_segments) {
+
+    DECODE_PAYLOAD decode = { bytes, n_segments, 0 };
+    return append(j, RECORD_DECODE, task, (char *) &decode, sizeof(decode));
+
+}
+
+/**
+ * @brief Records that a segment of a job ended, and its output is on the storage
+ * @param j Journal
+ * @param task Task of the job
+ * @param segment Index of the segment
+ * @param from First frame of the decoded source it read
+ * @param to Frame after the last one it read
+ * @return 0 on success, -1 on error
+*/
+int journal_segment(JOURNAL j, int task, int segment, long long from, long long to) {
+
+    SEGMENT_PAYLOAD payload = { from, to, segment, 0 };
+    return append(j, RECORD_SEGMENT, task, (char *) &payload, sizeof(payload));
+
+}
+
+/**
+ * @brief Records that a job ended, so it isn't accepted again
+ * @param j Journal
+ * @param task Task of the job
+ * @return 0 on success, -1 on error
+*/
+int journal_end(JOURNAL j, int task) {
+
+    return append(j, RECORD_END, task, "", 0);
+
+}
+
+/**
+ * @brief Makes the records written since the last call reach the storage, all at once
+ * @param j Journal
+ * @return 0 on success, -1 on error
+*/
+int journal_sync(JOURNAL j) {
+
+    if (j->dirty >= j->used) return 0;
+
+    size_t start = j->dirty & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+    if (msync(j->map + start, j->used - start, MS_SYNC) < 0) return -1;
+    j->dirty = j->used;
+
+    return 0;
+
+}
+
+/**
+ * @brief Closes a journal, with its records on the storage
+ * @param j Journal
+*/
+void journal_close(JOURNAL j) {
+
+    if (j->map) {
+        journal_sync(j);
+        munmap(j->map, j->size);
+    }
+    if (j->fd >= 0) close(j->fd);
+    for (int i = 0; i < j->n_jobs; i++) {
+        free(j->jobs[i].payload);
+        free(j->jobs[i].checkpoints);
+    }
+    free(j->jobs);
+    free(j->path);
+    free(j);
+
+}
@@ -0,0 +1,52 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+typedef struct journal * JOURNAL;
+
+/**
+ * @brief Segment of a job that ended, with the range of the decoded source it was cut from
+*/
+typedef struct journal_checkpoint {
+
+    int segment;
+    long long from; // First frame read
+    long long to; // Frame after the last one read
+
+} JOURNAL_CHECKPOINT;
+
+/**
+ * @brief Job that was accepted and didn't end yet, as the journal tells it
+*/
+typedef struct journal_job {
+
+    int task;
+    char * payload; // Strings of its transform message
+    uint32_t length;
+    long long decoded; // Bytes of its decoded source once it was kept for its segments, -1 before
+    int n_segments; // Segments it was split in when it was decoded
+    JOURNAL_CHECKPOINT * checkpoints; // Segments that ended
+    int n_checkpoints;
+
+} JOURNAL_JOB;
+
+JOURNAL journal_open(char * path);
+
+int journal_jobs(JOURNAL j, JOURNAL_JOB ** jobs);
+
+JOURNAL_JOB * journal_find(JOURNAL j, int task);
+
+int journal_accept(JOURNAL j, int task, char * payload, uint32_t length);
+
+int journal_decode(JOURNAL j, int task, long long bytes, int n_segments);
+
+int journal_segment(JOURNAL j, int task, int segment, long long from, long long to);
+
+int journal_end(JOURNAL j, int task);
+
+int journal_sync(JOURNAL j);
+
+void journal_close(JOURNAL j);
+
+#endif
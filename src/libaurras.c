@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+#include "status.h"
+#include "libaurras.h"
+
+/**
+ * @brief Connection to the server, with the records of its jobs that weren't taken yet
+*/
+struct aurras {
+
+    int fd; // Connection to the server
+    int fd_event; // Readable while records are queued
+    int fd_poll; // Epoll instance with the connection and fd_event, what aurras_fd gives
+    char * socket_path;
+    uint32_t next_job;
+    double deadline; // Seconds the server gives each job submitted to end, 0 for no deadline
+    char buffer[sizeof(MESSAGE_HEADER) + PROTOCOL_MAX_PAYLOAD]; // Bytes that don't make a whole message yet
+    size_t used;
+    char payload[PROTOCOL_MAX_PAYLOAD];
+    AURRAS_RECORD * records; // Records received and not taken, from head to n_records
+    int head;
+    int n_records;
+    int capacity;
+    STATUS * status; // Status segment of the server, mapped once it's first read
+
+};
+
+/**
+ * @brief Connects to the socket of a server
+ * @param socket_path Path of the socket
+ * @return Connected socket, -1 on error
+*/
+static int connect_to(char * socket_path) {
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+
+}
+
+/**
+ * @brief Queues the record a message of the server carries
+ * @param a Connection
+ * @param header Header of a MESSAGE_STATE
+ * @param payload Payload of the message, a COMPLETION if the job ended
+*/
+static void queue_record(AURRAS a, MESSAGE_HEADER * header, char * payload) {
+
+    if (a->n_records == a->capacity) {
+        a->capacity = a->capacity ? 2 * a->capacity : 64;
+        a->records = realloc(a->records, a->capacity * sizeof(AURRAS_RECORD));
+    }
+
+    AURRAS_RECORD * record = &a->records[a->n_records++];
+    memset(record, 0, sizeof(AURRAS_RECORD));
+    record->job = header->tag;
+    record->state = header->state;
+    if (header->length >= sizeof(COMPLETION)) {
+        COMPLETION completion;
+        memcpy(&completion, payload, sizeof(completion));
+        record->exit_status = completion.exit_status;
+        record->queued = completion.queued;
+        record->running = completion.running;
+        record->cpu = completion.cpu;
+    }
+
+    // The eventfd stays readable until the queue is emptied
+    if (a->n_records - a->head == 1) {
+        uint64_t one = 1;
+        write(a->fd_event, &one, sizeof(one));
+    }
+
+}
+
+/**
+ * @brief Reads what the server sent and queues the records of every whole message
+ * @param a Connection
+ * @param wait If true, blocks until something arrives
+ * @return 0 on success, -1 if the connection ended or broke the protocol
+*/
+static int receive_records(AURRAS a, int wait) {
+
+    while (1) {
+
+        int n_fds = 0;
+        ssize_t bytes_read = receive_bytes(a->fd, a->buffer + a->used, sizeof(a->buffer) - a->used,
+                                           NULL, &n_fds, 0, wait ? 0 : MSG_DONTWAIT);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read < 0 && errno == EAGAIN) return 0;
+        if (bytes_read <= 0) return -1;
+        a->used += bytes_read;
+
+        // The rest waits for the bytes that complete it, the buffer always fits a whole message
+        size_t offset = 0;
+        ssize_t size;
+        MESSAGE_HEADER header;
+        char * payload;
+        while ((size = parse_message(a->buffer + offset, a->used - offset, &header, &payload)) > 0) {
+            if (header.type == MESSAGE_STATE) queue_record(a, &header, payload);
+            offset += size;
+        }
+        if (size < 0) return -1;
+        a->used -= offset;
+        memmove(a->buffer, a->buffer + offset, a->used);
+
+        if (wait) return 0;
+
+    }
+
+}
+
+/**
+ * @brief Connects to a server. Names of files given to aurras_submit are relative to the working directory
+ * at this moment
+ * @param socket_path Path of the socket of the server, NULL for the one named by the environment variable
+ * AURRAS_SOCKET, or else the default one. That of a coordinator only gives the status of all its instances
+ * @return Connection, NULL on error
+*/
+AURRAS aurras_open(char * socket_path) {
+
+    AURRAS a = calloc(1, sizeof(struct aurras));
+    if (!a) return NULL;
+    if (!socket_path) socket_path = getenv("AURRAS_SOCKET");
+    a->socket_path = strdup(socket_path && *socket_path ? socket_path : MAIN_SOCKET);
+    a->fd = connect_to(a->socket_path);
+    a->fd_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    a->fd_poll = epoll_create1(EPOLL_CLOEXEC);
+    int fd_directory = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    struct epoll_event event = { .events = EPOLLIN };
+    int ok = a->fd >= 0 && a->fd_event >= 0 && a->fd_poll >= 0 && fd_directory >= 0 &&
+             epoll_ctl(a->fd_poll, EPOLL_CTL_ADD, a->fd, &event) == 0 &&
+             epoll_ctl(a->fd_poll, EPOLL_CTL_ADD, a->fd_event, &event) == 0 &&
+             send_message(a->fd, MESSAGE_DIRECTORY, 0, 0, NULL, 0, &fd_directory, 1) == 0;
+
+    int error = errno;
+    if (fd_directory >= 0) close(fd_directory);
+    if (!ok) {
+        aurras_close(a);
+        errno = error;
+        return NULL;
+    }
+
+    return a;
+
+}
+
+/**
+ * @brief Gets a descriptor that's readable while there may be records to take with aurras_records
+ * @param a Connection
+ * @return Descriptor, owned by the connection
+*/
+int aurras_fd(AURRAS a) {
+
+    return a->fd_poll;
+
+}
+
+/**
+ * @brief Sends a transform packed in the payload of the connection once the socket takes it
+ * @param a Connection
+ * @param length Bytes of the payload
+ * @param fds Source and output already open, NULL for the server to open them by name
+ * @return Id of the job, -1 on error
+*/
+static int send_transform(AURRAS a, uint32_t length, int fds[2]) {
+
+    // Records are queued while waiting to send, so the server never waits for a client that's only sending
+    struct pollfd p = { a->fd, POLLIN | POLLOUT, 0 };
+    do {
+        if (poll(&p, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if ((p.revents & (POLLIN | POLLHUP | POLLERR)) && receive_records(a, 0) < 0) return -1;
+    } while (!(p.revents & POLLOUT));
+
+    if (send_message(a->fd, MESSAGE_TRANSFORM, a->next_job, 0, a->payload, length, fds, fds ? 2 : 0) < 0) return -1;
+    return a->next_job++;
+
+}
+
+/**
+ * @brief Sets the deadline of the jobs submitted next through a connection. The server drops a job that
+ * didn't end by then, killing its processes if it started, and its last record is AURRAS_EXPIRED
+ * @param a Connection
+ * @param seconds Seconds since the server receives each job, 0 for no deadline
+*/
+void aurras_deadline(AURRAS a, double seconds) {
+
+    a->deadline = seconds > 0 ? seconds : 0;
+
+}
+
+/**
+ * @brief Submits a transform job, without waiting for it
+ * @param a Connection
+ * @param source Name of the source
+ * @param output Name of the output
+ * @param filters Names of the filters
+ * @param n_filters Number of filters
+ * @param priority Priority level, from 0 to 9
+ * @param fds Source and output already open, NULL for the server to open them by name.
+ * The output is only cached if it's readable
+ * @return Id of the job, -1 on error
+*/
+int aurras_submit(AURRAS a, char * source, char * output, char * filters[], int n_filters, int priority, int fds[2]) {
+
+    return aurras_submit_range(a, source, output, filters, n_filters, priority, 0, 0, fds);
+
+}
+
+/**
+ * @brief Submits a transform job of a window of the source, without waiting for it. The server admits it
+ * as a preview, ahead of whole transforms
+ * @param a Connection
+ * @param source Name of the source
+ * @param output Name of the output
+ * @param filters Names of the filters
+ * @param n_filters Number of filters
+ * @param priority Priority level, from 0 to 9
+ * @param start Seconds of the source before the window
+ * @param duration Seconds of the window, 0 until the end of the source. With no start either, the whole
+ * source is transformed, as with aurras_submit
+ * @param fds Source and output already open, NULL for the server to open them by name
+ * @return Id of the job, -1 on error
+*/
+int aurras_submit_range(AURRAS a, char * source, char * output, char * filters[], int n_filters, int priority, 
+                        double start, double duration, int fds[2]) {
+
+    char priority_str[12], window[64] = "", deadline[32];
+    snprintf(priority_str, sizeof(priority_str), "%d", priority);
+    if (start > 0 || duration > 0) snprintf(window, sizeof(window), "%.6f:%.6f", start, duration);
+    snprintf(deadline, sizeof(deadline), "%.3f", a->deadline);
+
+    // Input, output, priority, window, deadline and then each filter. Nothing is cut, what doesn't fit is an error
+    uint32_t length = 0;
+    int ok = pack_string(a->payload, &length, source) == 0 && pack_string(a->payload, &length, output) == 0 &&
+             pack_string(a->payload, &length, priority_str) == 0 && pack_string(a->payload, &length, window) == 0 &&
+             pack_string(a->payload, &length, deadline) == 0;
+    for (int i = 0; ok && i < n_filters; i++) ok = pack_string(a->payload, &length, filters[i]) == 0;
+    if (!ok) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    return send_transform(a, length, fds);
+
+}
+
+/**
+ * @brief Submits a job that produces several outputs from one source, without waiting for it. The server
+ * applies the filters their chains start with in common once, and copies the stream where they part.
+ * The files are opened by name and the job ends once all its outputs do
+ * @param a Connection
+ * @param source Name of the source
+ * @param outputs Name of each output
+ * @param filters Names of the filters of each output
+ * @param n_filters Number of filters of each output, at least 1
+ * @param n_outputs Number of outputs, up to PROTOCOL_MAX_OUTPUTS
+ * @param priority Priority level, from 0 to 9
+ * @return Id of the job, -1 on error
+*/
+int aurras_submit_tree(AURRAS a, char * source, char * outputs[], char ** filters[], int n_filters[], int n_outputs, int priority) {
+
+    if (n_outputs < 1 || n_outputs > PROTOCOL_MAX_OUTPUTS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char priority_str[12], deadline[32];
+    snprintf(priority_str, sizeof(priority_str), "%d", priority);
+    snprintf(deadline, sizeof(deadline), "%.3f", a->deadline);
+
+    // Like a transform, with an empty string before each output after the first one
+    uint32_t length = 0;
+    int ok = pack_string(a->payload, &length, source) == 0 && pack_string(a->payload, &length, outputs[0]) == 0 &&
+             pack_string(a->payload, &length, priority_str) == 0 && pack_string(a->payload, &length, "") == 0 &&
+             pack_string(a->payload, &length, deadline) == 0;
+    for (int i = 0; ok && i < n_outputs; i++) {
+        if (i) ok = pack_string(a->payload, &length, "") == 0 && pack_string(a->payload, &length, outputs[i]) == 0;
+        for (int j = 0; ok && j < n_filters[i]; j++) ok = pack_string(a->payload, &length, filters[i][j]) == 0;
+    }
+    if (!ok) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    return send_transform(a, length, NULL);
+
+}
+
+/**
+ * @brief Takes the records that arrived, without waiting
+ * @param a Connection
+ * @param records Where to place the records
+ * @param max Size of records
+ * @return Number of records, -1 if the connection ended and no records are left
+*/
+int aurras_records(AURRAS a, AURRAS_RECORD * records, int max) {
+
+    if (receive_records(a, 0) < 0 && a->head == a->n_records) return -1;
+
+    int n = a->n_records - a->head < max ? a->n_records - a->head : max;
+    memcpy(records, a->records + a->head, n * sizeof(AURRAS_RECORD));
+    a->head += n;
+
+    if (a->head == a->n_records) {
+        uint64_t count;
+        read(a->fd_event, &count, sizeof(count));
+        a->head = a->n_records = 0;
+    }
+
+    return n;
+
+}
+
+/**
+ * @brief Takes the next record, waiting for it
+ * @param a Connection
+ * @param record Where to place the record
+ * @return 0 on success, -1 if the connection ended
+*/
+int aurras_next(AURRAS a, AURRAS_RECORD * record) {
+
+    while (a->head == a->n_records)
+        if (receive_records(a, 1) < 0) return -1;
+
+    return aurras_records(a, record, 1) == 1 ? 0 : -1;
+
+}
+
+/**
+ * @brief Cancels a job. A job that waits ends right away, one that runs once its processes are killed.
+ * Its last record tells how it ended, since it may end before the cancel arrives
+ * @param a Connection
+ * @param job Id of the job
+ * @return 0 on success, -1 on error
+*/
+int aurras_cancel(AURRAS a, int job) {
+
+    return send_message(a->fd, MESSAGE_CANCEL, job, 0, NULL, 0, NULL, 0);
+
+}
+
+/**
+ * @brief Maps the status segment of the server, again if the server it was mapped from ended
+ * @param a Connection
+ * @return Segment, NULL on error
+*/
+static STATUS * map_status(AURRAS a) {
+
+    if (a->status && kill(a->status->pid, 0) < 0 && errno == ESRCH) {
+        status_unmap(a->status);
+        a->status = NULL;
+    }
+    if (a->status) return a->status;
+
+    char path[strlen(a->socket_path) + sizeof(STATUS_SUFFIX)];
+    sprintf(path, "%s%s", a->socket_path, STATUS_SUFFIX);
+    if (!(a->status = status_map(path))) return NULL;
+
+    // A segment left by a server that ended has no server to talk about
+    if (kill(a->status->pid, 0) < 0 && errno == ESRCH) {
+        status_unmap(a->status);
+        a->status = NULL;
+        errno = ECONNREFUSED;
+    }
+
+    return a->status;
+
+}
+
+/**
+ * @brief Copies the status the server published, without a message to it and without making it wait
+ * @param a Connection
+ * @param status Where to copy the status
+ * @return 0 on success, -1 on error
+*/
+int aurras_snapshot(AURRAS a, STATUS * status) {
+
+    STATUS * s = map_status(a);
+    return s ? status_read(s, status) : -1;
+
+}
+
+/**
+ * @brief Gets the status of the server as text
+ * @param a Connection
+ * @param buffer Where to write the status, ended by '\0'
+ * @param size Size of the buffer
+ * @return Length of the status, -1 on error
+*/
+int aurras_status(AURRAS a, char * buffer, int size) {
+
+    STATUS * status = malloc(sizeof(STATUS));
+    int length = aurras_snapshot(a, status) == 0 ? status_format(status, buffer, size) : -1;
+    free(status);
+    return length;
+
+}
+
+/**
+ * @brief Sends a request to the server through a connection of its own, and waits for the text it replies with
+ * @param a Connection
+ * @param type Type of the message
+ * @param tag Tag of the message
+ * @param buffer Where to write the text, ended by '\0'
+ * @param size Size of the buffer
+ * @return Length of the text, -1 on error
+*/
+static int ask_server(AURRAS a, int type, uint32_t tag, char * buffer, int size) {
+
+    if (size < 1) return -1;
+    int fd = connect_to(a->socket_path);
+    if (fd < 0) return -1;
+    if (send_message(fd, type, tag, 0, NULL, 0, NULL, 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char * reply = malloc(sizeof(MESSAGE_HEADER) + PROTOCOL_MAX_PAYLOAD);
+    size_t used = 0;
+    int length = -1;
+    while (length < 0) {
+
+        int n_fds = 0;
+        ssize_t bytes_read = receive_bytes(fd, reply + used, sizeof(MESSAGE_HEADER) + PROTOCOL_MAX_PAYLOAD - used, NULL, &n_fds, 0, 0);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) break;
+        used += bytes_read;
+
+        MESSAGE_HEADER header;
+        char * payload;
+        ssize_t message = parse_message(reply, used, &header, &payload);
+        if (message < 0) break;
+        if (message > 0 && header.type == MESSAGE_STATUS_REPLY) {
+            length = header.length < (uint32_t) size ? (int) header.length : size - 1;
+            memcpy(buffer, payload, length);
+            buffer[length] = '\0';
+        }
+        else if (message > 0) {
+            used -= message;
+            memmove(reply, reply + message, used);
+        }
+
+    }
+
+    free(reply);
+    close(fd);
+    return length;
+
+}
+
+/**
+ * @brief Gets the latency and resources of the jobs the server ran, by chain, through a connection of its own
+ * @param a Connection
+ * @param buffer Where to write the text, ended by '\0'
+ * @param size Size of the buffer
+ * @return Length of the text, -1 on error
+*/
+int aurras_stats(AURRAS a, char * buffer, int size) {
+
+    return ask_server(a, MESSAGE_STATS, 0, buffer, size);
+
+}
+
+/**
+ * @brief Cancels a task of any client by its number in the status, through a connection of its own.
+ * The client of the task gets AURRAS_CANCELLED as its last record
+ * @param a Connection
+ * @param task Number of the task
+ * @param buffer Where to write what the server did, ended by '\0'
+ * @param size Size of the buffer
+ * @return Length of the text, -1 on error
+*/
+int aurras_cancel_task(AURRAS a, int task, char * buffer, int size) {
+
+    return ask_server(a, MESSAGE_CANCEL_TASK, task, buffer, size);
+
+}
+
+/**
+ * @brief Closes a connection. The server cancels the jobs that didn't end
+ * @param a Connection
+*/
+void aurras_close(AURRAS a) {
+
+    if (a->fd >= 0) close(a->fd);
+    if (a->fd_event >= 0) close(a->fd_event);
+    if (a->fd_poll >= 0) close(a->fd_poll);
+    if (a->status) status_unmap(a->status);
+    free(a->socket_path);
+    free(a->records);
+    free(a);
+
+}
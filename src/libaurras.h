@@ -0,0 +1,65 @@
+#ifndef LIBAURRAS_H
+#define LIBAURRAS_H
+
+#include "status.h"
+
+typedef struct aurras * AURRAS;
+
+/**
+ * @brief States a job goes through, each one reported by a record
+*/
+typedef enum aurras_state {
+
+    AURRAS_DONE,
+    AURRAS_PROCESSING, // The server started the job, more records follow
+    AURRAS_FAILED,
+    AURRAS_CANCELLED,
+    AURRAS_EXPIRED, // Its deadline passed before it ended
+    AURRAS_REJECTED // The queue of the server was full, it can be submitted again later
+
+} AURRAS_STATE;
+
+/**
+ * @brief Record of a change in the state of a job. The ones that end it carry its exit status and timing
+*/
+typedef struct aurras_record {
+
+    int job; // As returned by aurras_submit
+    AURRAS_STATE state;
+    int exit_status; // Of the first stage that failed, 128 plus the signal if one killed it
+    double queued; // Seconds the job waited in the server before it started
+    double running; // Seconds since it started until it ended
+    double cpu; // Seconds of CPU its stages took, where the server could measure it
+
+} AURRAS_RECORD;
+
+AURRAS aurras_open(char * socket_path);
+
+int aurras_fd(AURRAS a);
+
+void aurras_deadline(AURRAS a, double seconds);
+
+int aurras_submit(AURRAS a, char * source, char * output, char * filters[], int n_filters, int priority, int fds[2]);
+
+int aurras_submit_range(AURRAS a, char * source, char * output, char * filters[], int n_filters, int priority, 
+                        double start, double duration, int fds[2]);
+
+int aurras_submit_tree(AURRAS a, char * source, char * outputs[], char ** filters[], int n_filters[], int n_outputs, int priority);
+
+int aurras_records(AURRAS a, AURRAS_RECORD * records, int max);
+
+int aurras_next(AURRAS a, AURRAS_RECORD * record);
+
+int aurras_cancel(AURRAS a, int job);
+
+int aurras_snapshot(AURRAS a, STATUS * status);
+
+int aurras_status(AURRAS a, char * buffer, int size);
+
+int aurras_stats(AURRAS a, char * buffer, int size);
+
+int aurras_cancel_task(AURRAS a, int task, char * buffer, int size);
+
+void aurras_close(AURRAS a);
+
+#endif
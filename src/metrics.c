@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define HISTOGRAM_SUB_BITS 7 // Each power of two is split in 2^6 buckets, under 1% of error
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_MAX_SHIFT 30 // Microseconds up to 2^37, about 38 hours, larger values count as that
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT + 2) * HISTOGRAM_HALF)
+#define METRICS_MAX_CHAINS 64 // Chains with their own histograms, the others are counted together
+#define METRICS_INTERVAL 1 // Seconds between writes of the exposition file
+#define OTHER_CHAIN "(other)"
+#define N_RESULTS 6 // Ways a job ends, the last one where an unknown result is counted
+
+static const char * phase_names[N_PHASES] = { "queued", "spawn", "run", "total" };
+static const char * results[N_RESULTS] = { "done", "failed", "cancelled", "expired", "rejected", "cached" };
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define N_QUANTILES (int) (sizeof(quantiles) / sizeof(quantiles[0]))
+
+/**
+ * @brief Latency histogram with buckets of the same relative width (HDR): values below 2^HISTOGRAM_SUB_BITS
+ * microseconds are exact, and above that each bucket is 1/HISTOGRAM_HALF of its power of two wide
+*/
+typedef struct histogram {
+
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    long long count;
+    double sum; // Seconds
+    double max;
+
+} HISTOGRAM;
+
+/**
+ * @brief What the jobs of a chain took
+*/
+typedef struct chain {
+
+    char * chain;
+    long long jobs[N_RESULTS]; // By result, like results
+    HISTOGRAM phases[N_PHASES];
+    long long n_stages;
+    USAGE usage; // Sum of the resources of the jobs, except max_rss, the largest
+    long long bytes_in;
+    long long bytes_out;
+
+} CHAIN;
+
+/**
+ * @brief Metrics of the jobs the server ran, by chain
+*/
+struct metrics {
+
+    char * exposition_path; // File rewritten with the metrics, NULL for none
+    int fd_log; // One JSON line per job, -1 for none
+    CHAIN * chains;
+    int n_chains;
+    int cap;
+    int dirty; // If true, the exposition file is behind
+    struct timespec flushed; // When the exposition file was last written
+
+};
+
+/**
+ * @brief Gets the bucket of a value
+ * @param micros Value in microseconds
+ * @return Index of the bucket
+*/
+static int bucket_of(uint64_t micros) {
+
+    if (micros >= 1ULL << (HISTOGRAM_SUB_BITS + HISTOGRAM_MAX_SHIFT)) micros = (1ULL << (HISTOGRAM_SUB_BITS + HISTOGRAM_MAX_SHIFT)) - 1;
+    if (micros < 2 * HISTOGRAM_HALF) return micros;
+
+    int shift = 63 - __builtin_clzll(micros) - (HISTOGRAM_SUB_BITS - 1);
+    return shift * HISTOGRAM_HALF + (micros >> shift);
+
+}
+
+/**
+ * @brief Gets the largest value that falls in a bucket
+ * @param bucket Index of the bucket
+ * @return Value in microseconds
+*/
+static uint64_t bucket_top(int bucket) {
+
+    if (bucket < 2 * HISTOGRAM_HALF) return bucket;
+
+    int shift = bucket / HISTOGRAM_HALF - 1;
+    return ((uint64_t) (bucket - shift * HISTOGRAM_HALF + 1) << shift) - 1;
+
+}
+
+/**
+ * @brief Adds a value to a histogram
+ * @param h Histogram
+ * @param seconds Value
+*/
+static void histogram_add(HISTOGRAM * h, double seconds) {
+
+    if (seconds < 0) seconds = 0;
+    h->counts[bucket_of((uint64_t) llround(seconds * 1e6))]++;
+    h->count++;
+    h->sum += seconds;
+    if (seconds > h->max) h->max = seconds;
+
+}
+
+/**
+ * @brief Gets a quantile of a histogram, as the top of the bucket where it falls
+ * @param h Histogram
+ * @param q Quantile, from 0 to 1
+ * @return Value in seconds, 0 if the histogram is empty
+*/
+static double histogram_quantile(HISTOGRAM * h, double q) {
+
+    if (!h->count) return 0;
+
+    long long target = (long long) ceil(q * h->count), seen = 0;
+    if (target < 1) target = 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            double top = bucket_top(i) / 1e6;
+            return top < h->max ? top : h->max;
+        }
+    }
+
+    return h->max;
+
+}
+
+/**
+ * @brief Opens the metrics of a server
+ * @param exposition_path File where the metrics are written for scrapers, NULL for none
+ * @param log_path File where a JSON line is appended for each job, NULL for none
+ * @return Metrics
+*/
+METRICS metrics_open(char * exposition_path, char * log_path) {
+
+    METRICS m = calloc(1, sizeof(struct metrics));
+    m->exposition_path = exposition_path ? strdup(exposition_path) : NULL;
+    m->fd_log = -1;
+    if (log_path && (m->fd_log = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) perror(log_path);
+    m->dirty = 1;
+
+    return m;
+
+}
+
+/**
+ * @brief Finds the metrics of a chain, adding them if there's room
+ * @param m Metrics
+ * @param name Names of the filters of the chain
+ * @return Metrics of the chain, or of the other chains once there's no room
+*/
+static CHAIN * find_chain(METRICS m, char * name) {
+
+    for (int i = 0; i < m->n_chains; i++)
+        if (!strcmp(m->chains[i].chain, name)) return &m->chains[i];
+
+    // The other chains share the slot after the last one
+    if (m->n_chains > METRICS_MAX_CHAINS) return &m->chains[METRICS_MAX_CHAINS];
+    if (m->n_chains == METRICS_MAX_CHAINS) name = OTHER_CHAIN;
+
+    if (m->n_chains == m->cap) {
+        m->cap = m->cap ? 2 * m->cap : 8;
+        m->chains = realloc(m->chains, m->cap * sizeof(CHAIN));
+    }
+    CHAIN * c = &m->chains[m->n_chains++];
+    memset(c, 0, sizeof(CHAIN));
+    c->chain = strdup(name);
+
+    return c;
+
+}
+
+/**
+ * @brief Writes a string as a JSON string
+ * @param f Stream
+ * @param s String
+*/
+static void write_json_string(FILE * f, char * s) {
+
+    fputc('"', f);
+    for (; s && *s; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') fprintf(f, "\\%c", ch);
+        else if (ch < 0x20) fprintf(f, "\\u%04x", ch);
+        else fputc(ch, f);
+    }
+    fputc('"', f);
+
+}
+
+/**
+ * @brief Appends the line of a job to the log, in a single write so lines of other writers don't mix
+ * @param m Metrics
+ * @param job Job
+*/
+static void log_job(METRICS m, JOB_METRICS * job) {
+
+    char * line = NULL;
+    size_t length = 0;
+    FILE * f = open_memstream(&line, &length);
+    if (!f) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(f, "{\"time\":%.3f,\"task\":%d,\"chain\":", now.tv_sec + now.tv_nsec / 1e9, job->task);
+    write_json_string(f, job->chain);
+    fprintf(f, ",\"source\":");
+    write_json_string(f, job->source);
+    fprintf(f, ",\"output\":");
+    write_json_string(f, job->output);
+    fprintf(f, ",\"result\":\"%s\",\"exit_status\":%d", job->result, job->exit_status);
+    for (int i = 0; i < N_PHASES; i++)
+        if (job->seconds[i] >= 0) fprintf(f, ",\"%s\":%.6f", phase_names[i], job->seconds[i]);
+    fprintf(f, ",\"stages\":%d,\"user\":%.6f,\"system\":%.6f,\"max_rss_kb\":%lld,\"in_blocks\":%lld,\"out_blocks\":%lld",
+               job->n_stages, job->usage.user, job->usage.system, (long long) job->usage.max_rss,
+               (long long) job->usage.in_blocks, (long long) job->usage.out_blocks);
+    fprintf(f, ",\"bytes_in\":%lld,\"bytes_out\":%lld}\n", job->bytes_in, job->bytes_out);
+    fclose(f);
+
+    if (write(m->fd_log, line, length) < 0) perror("job log");
+    free(line);
+
+}
+
+/**
+ * @brief Records a job that ended
+ * @param m Metrics
+ * @param job Job
+*/
+void metrics_record(METRICS m, JOB_METRICS * job) {
+
+    CHAIN * c = find_chain(m, job->chain);
+
+    int result = 0;
+    while (result < N_RESULTS - 1 && strcmp(results[result], job->result)) result++;
+    c->jobs[result]++;
+
+    for (int i = 0; i < N_PHASES; i++)
+        if (job->seconds[i] >= 0) histogram_add(&c->phases[i], job->seconds[i]);
+
+    c->n_stages += job->n_stages;
+    c->usage.user += job->usage.user;
+    c->usage.system += job->usage.system;
+    if (job->usage.max_rss > c->usage.max_rss) c->usage.max_rss = job->usage.max_rss;
+    c->usage.in_blocks += job->usage.in_blocks;
+    c->usage.out_blocks += job->usage.out_blocks;
+    if (job->bytes_in > 0) c->bytes_in += job->bytes_in;
+    if (job->bytes_out > 0) c->bytes_out += job->bytes_out;
+
+    if (m->fd_log >= 0) log_job(m, job);
+    m->dirty = 1;
+
+}
+
+/**
+ * @brief Writes what the jobs of each chain took, for people
+ * @param m Metrics
+ * @param buffer Where to write, ended by '\0'
+ * @param size Size of the buffer
+ * @return Length of the text, cut to the buffer
+*/
+int metrics_report(METRICS m, char * buffer, int size) {
+
+    FILE * f = fmemopen(buffer, size, "w");
+    if (!f) return -1;
+    setvbuf(f, NULL, _IONBF, 0);
+
+    if (!m->n_chains) fprintf(f, "No jobs ended yet\n");
+    for (int i = 0; i < m->n_chains; i++) {
+
+        CHAIN * c = &m->chains[i];
+        long long jobs = 0;
+        for (int j = 0; j < N_RESULTS; j++) jobs += c->jobs[j];
+        fprintf(f, "Chain %s: %lld jobs, %lld failed, %lld cancelled, %lld expired, %lld rejected, %lld from the cache\n",
+                   c->chain, jobs, c->jobs[1], c->jobs[2], c->jobs[3], c->jobs[4], c->jobs[5]);
+
+        fprintf(f, "    %-8s %10s %10s %10s %10s %10s  (ms)\n", "phase", "p50", "p90", "p99", "p99.9", "max");
+        for (int j = 0; j < N_PHASES; j++) {
+            HISTOGRAM * h = &c->phases[j];
+            if (!h->count) continue;
+            fprintf(f, "    %-8s", phase_names[j]);
+            for (int k = 0; k < N_QUANTILES; k++) fprintf(f, " %10.1f", 1e3 * histogram_quantile(h, quantiles[k]));
+            fprintf(f, " %10.1f\n", 1e3 * h->max);
+        }
+
+        fprintf(f, "    %lld stages, CPU %.3fs user %.3fs system, max RSS %lld KB, storage %lld KB read %lld KB written, "
+                   "files %lld KB in %lld KB out\n", c->n_stages, c->usage.user, c->usage.system, (long long) c->usage.max_rss,
+                   (long long) c->usage.in_blocks / 2, (long long) c->usage.out_blocks / 2, c->bytes_in >> 10, c->bytes_out >> 10);
+
+    }
+
+    long length = ftell(f);
+    fclose(f);
+    if (length >= size) length = size - 1;
+    buffer[length] = '\0';
+    return length;
+
+}
+
+/**
+ * @brief Writes the name of a chain as the value of a label, escaped
+ * @param f Stream
+ * @param chain Name of the chain
+*/
+static void write_label(FILE * f, char * chain) {
+
+    fprintf(f, "chain=\"");
+    for (; *chain; chain++) {
+        if (*chain == '"' || *chain == '\\') fputc('\\', f);
+        if (*chain == '\n') fprintf(f, "\\n");
+        else fputc(*chain, f);
+    }
+    fputc('"', f);
+
+}
+
+/**
+ * @brief Writes the metrics in the text exposition format of Prometheus
+ * @param m Metrics
+ * @param f Stream
+*/
+static void write_exposition(METRICS m, FILE * f) {
+
+    fprintf(f, "# HELP aurras_jobs_total Jobs that ended, by chain and result\n# TYPE aurras_jobs_total counter\n");
+    for (int i = 0; i < m->n_chains; i++)
+        for (int j = 0; j < N_RESULTS; j++) {
+            fprintf(f, "aurras_jobs_total{");
+            write_label(f, m->chains[i].chain);
+            fprintf(f, ",result=\"%s\"} %lld\n", results[j], m->chains[i].jobs[j]);
+        }
+
+    fprintf(f, "# HELP aurras_job_seconds Time of each phase of the jobs, by chain\n# TYPE aurras_job_seconds summary\n");
+    for (int i = 0; i < m->n_chains; i++)
+        for (int j = 0; j < N_PHASES; j++) {
+            HISTOGRAM * h = &m->chains[i].phases[j];
+            if (!h->count) continue;
+            for (int k = 0; k < N_QUANTILES; k++) {
+                fprintf(f, "aurras_job_seconds{");
+                write_label(f, m->chains[i].chain);
+                fprintf(f, ",phase=\"%s\",quantile=\"%g\"} %.6f\n", phase_names[j], quantiles[k], histogram_quantile(h, quantiles[k]));
+            }
+            fprintf(f, "aurras_job_seconds_sum{");
+            write_label(f, m->chains[i].chain);
+            fprintf(f, ",phase=\"%s\"} %.6f\naurras_job_seconds_count{", phase_names[j], h->sum);
+            write_label(f, m->chains[i].chain);
+            fprintf(f, ",phase=\"%s\"} %lld\n", phase_names[j], h->count);
+        }
+
+    fprintf(f, "# HELP aurras_stages_total Processes and worker jobs the jobs ran\n# TYPE aurras_stages_total counter\n");
+    for (int i = 0; i < m->n_chains; i++) {
+        fprintf(f, "aurras_stages_total{");
+        write_label(f, m->chains[i].chain);
+        fprintf(f, "} %lld\n", m->chains[i].n_stages);
+    }
+
+    fprintf(f, "# HELP aurras_cpu_seconds_total CPU time of the stages\n# TYPE aurras_cpu_seconds_total counter\n");
+    for (int i = 0; i < m->n_chains; i++) {
+        fprintf(f, "aurras_cpu_seconds_total{");
+        write_label(f, m->chains[i].chain);
+        fprintf(f, ",mode=\"user\"} %.6f\naurras_cpu_seconds_total{", m->chains[i].usage.user);
+        write_label(f, m->chains[i].chain);
+        fprintf(f, ",mode=\"system\"} %.6f\n", m->chains[i].usage.system);
+    }
+
+    fprintf(f, "# HELP aurras_max_rss_bytes Largest resident set of a stage\n# TYPE aurras_max_rss_bytes gauge\n");
+    for (int i = 0; i < m->n_chains; i++) {
+        fprintf(f, "aurras_max_rss_bytes{");
+        write_label(f, m->chains[i].chain);
+        fprintf(f, "} %lld\n", (long long) m->chains[i].usage.max_rss << 10);
+    }
+
+    fprintf(f, "# HELP aurras_storage_bytes_total Bytes the stages read from and wrote to storage\n"
+               "# TYPE aurras_storage_bytes_total counter\n");
+    for (int i = 0; i < m->n_chains; i++) {
+        fprintf(f, "aurras_storage_bytes_total{");
+        write_label(f, m->chains[i].chain);
+        fprintf(f, ",direction=\"read\"} %lld\naurras_storage_bytes_total{", (long long) m->chains[i].usage.in_blocks * 512);
+        write_label(f, m->chains[i].chain);
+        fprintf(f, ",direction=\"write\"} %lld\n", (long long) m->chains[i].usage.out_blocks * 512);
+    }
+
+    fprintf(f, "# HELP aurras_file_bytes_total Bytes of the sources and outputs that are regular files\n"
+               "# TYPE aurras_file_bytes_total counter\n");
+    for (int i = 0; i < m->n_chains; i++) {
+        fprintf(f, "aurras_file_bytes_total{");
+        write_label(f, m->chains[i].chain);
+        fprintf(f, ",direction=\"in\"} %lld\naurras_file_bytes_total{", m->chains[i].bytes_in);
+        write_label(f, m->chains[i].chain);
+        fprintf(f, ",direction=\"out\"} %lld\n", m->chains[i].bytes_out);
+    }
+
+}
+
+/**
+ * @brief Writes the exposition file if it's behind, at most once every METRICS_INTERVAL. It's written
+ * in a new file that replaces the old one, so a scraper never reads half of it
+ * @param m Metrics
+ * @return Milliseconds until it should be called again, -1 if it's up to date
+*/
+int metrics_flush(METRICS m) {
+
+    if (!m->exposition_path || !m->dirty) return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - m->flushed.tv_sec) + (now.tv_nsec - m->flushed.tv_nsec) / 1e9;
+    if (elapsed < METRICS_INTERVAL) return (int) ceil((METRICS_INTERVAL - elapsed) * 1e3);
+
+    char tmp_path[strlen(m->exposition_path) + 16];
+    sprintf(tmp_path, "%s.%d", m->exposition_path, getpid());
+    FILE * f = fopen(tmp_path, "we");
+    if (!f) perror(tmp_path);
+    else {
+        write_exposition(m, f);
+        if (fclose(f) != 0 || rename(tmp_path, m->exposition_path) < 0) {
+            perror(m->exposition_path);
+            unlink(tmp_path);
+        }
+    }
+
+    m->dirty = 0;
+    m->flushed = now;
+    return -1;
+
+}
+
+/**
+ * @brief Frees the metrics, writing the exposition file a last time
+ * @param m Metrics
+*/
+void metrics_close(METRICS m) {
+
+    m->flushed.tv_sec = m->flushed.tv_nsec = 0;
+    metrics_flush(m);
+
+    for (int i = 0; i < m->n_chains; i++) free(m->chains[i].chain);
+    free(m->chains);
+    free(m->exposition_path);
+    if (m->fd_log >= 0) close(m->fd_log);
+    free(m);
+
+}
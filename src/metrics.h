@@ -0,0 +1,50 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "protocol.h"
+
+/**
+ * @brief Phases of a job, each with its own latency histogram
+*/
+typedef enum phase {
+
+    PHASE_QUEUED, // From its arrival until it was admitted
+    PHASE_SPAWN, // From its admission until its stages were started
+    PHASE_RUN, // From then until its last stage ended
+    PHASE_TOTAL, // From its arrival until its end
+    N_PHASES
+
+} PHASE;
+
+/**
+ * @brief What a job took, recorded once it ends
+*/
+typedef struct job_metrics {
+
+    int task;
+    char * chain; // Names of the filters the client asked for, separated by spaces
+    char * source; // Names the client gave, for the log
+    char * output;
+    char * result; // "done", "failed", "cancelled", "expired", "rejected" or "cached"
+    int exit_status;
+    double seconds[N_PHASES]; // Negative for the phases the job didn't go through
+    int n_stages; // Processes or worker jobs it ran
+    USAGE usage; // Resources of its stages
+    long long bytes_in; // Size of the source and of the output, -1 if they aren't regular files
+    long long bytes_out;
+
+} JOB_METRICS;
+
+typedef struct metrics * METRICS;
+
+METRICS metrics_open(char * exposition_path, char * log_path);
+
+void metrics_record(METRICS m, JOB_METRICS * job);
+
+int metrics_report(METRICS m, char * buffer, int size);
+
+int metrics_flush(METRICS m);
+
+void metrics_close(METRICS m);
+
+#endif
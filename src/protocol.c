@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+/**
+ * @brief Sends a message, with the descriptors it carries
+ * @param fd Connected socket
+ * @param type MESSAGE_TYPE
+ * @param tag Identifier of the request the message is about
+ * @param state REQUEST_STATE, for a MESSAGE_STATE
+ * @param payload Bytes after the header, can be NULL if length is 0
+ * @param length Bytes of the payload, up to PROTOCOL_MAX_PAYLOAD
+ * @param fds Descriptors to send
+ * @param n_fds Number of descriptors, up to PROTOCOL_MAX_FDS
+ * @return 0 on success, -1 on error
+*/
+int send_message(int fd, int type, uint32_t tag, int state, char * payload, uint32_t length, int fds[], int n_fds) {
+
+    if (length > PROTOCOL_MAX_PAYLOAD || n_fds > PROTOCOL_MAX_FDS) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    MESSAGE_HEADER header = { PROTOCOL_VERSION, type, n_fds, state, tag, length };
+    struct iovec iov[2] = { { &header, sizeof(header) }, { payload, length } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = length ? 2 : 1 };
+
+    // The descriptors go as ancillary data of the first bytes, the receiver gets its own copies of them
+    char control[CMSG_SPACE(PROTOCOL_MAX_FDS * sizeof(int))];
+    if (n_fds) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+    }
+
+    // A stream socket may take the message in parts
+    while (msg.msg_iovlen) {
+
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0) return -1;
+
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        while (msg.msg_iovlen && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+
+    }
+
+    return 0;
+
+}
+
+/**
+ * @brief Receives bytes from a socket, keeping the descriptors that came with them
+ * @param fd Connected socket
+ * @param buffer Where to write
+ * @param size Size of the buffer
+ * @param fds Where to append the descriptors
+ * @param n_fds Pointer to the number of descriptors in fds, updated
+ * @param max_fds Size of fds, the descriptors beyond it are closed
+ * @param flags Flags of recvmsg, like MSG_DONTWAIT
+ * @return Bytes received, 0 at the end of the stream, -1 on error
+*/
+ssize_t receive_bytes(int fd, char * buffer, size_t size, int fds[], int * n_fds, int max_fds, int flags) {
+
+    char control[CMSG_SPACE(PROTOCOL_MAX_FDS * sizeof(int))];
+    struct iovec iov = { buffer, size };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t bytes_read = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (bytes_read < 0) return -1;
+
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int * received = (int *) CMSG_DATA(cmsg);
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++) {
+            if (*n_fds < max_fds) fds[(*n_fds)++] = received[i];
+            else close(received[i]);
+        }
+    }
+
+    return bytes_read;
+
+}
+
+/**
+ * @brief Parses the message at the start of a buffer, if it arrived whole
+ * @param buffer Bytes received
+ * @param used Number of bytes in the buffer
+ * @param header Where to place the header
+ * @param payload Where to place a pointer to the payload, inside the buffer
+ * @return Bytes the message takes, 0 if it's incomplete, -1 if it's invalid
+*/
+ssize_t parse_message(char * buffer, size_t used, MESSAGE_HEADER * header, char ** payload) {
+
+    if (used < sizeof(MESSAGE_HEADER)) return 0;
+
+    // The header may not be aligned in the buffer
+    memcpy(header, buffer, sizeof(MESSAGE_HEADER));
+    if (header->version != PROTOCOL_VERSION || header->length > PROTOCOL_MAX_PAYLOAD || header->n_fds > PROTOCOL_MAX_FDS)
+        return -1;
+    if (used < sizeof(MESSAGE_HEADER) + header->length) return 0;
+
+    *payload = buffer + sizeof(MESSAGE_HEADER);
+    return sizeof(MESSAGE_HEADER) + header->length;
+
+}
+
+/**
+ * @brief Appends a string and its '\0' to a payload of PROTOCOL_MAX_PAYLOAD bytes
+ * @param payload Payload
+ * @param length Pointer to the bytes already in the payload, updated
+ * @param s String
+ * @return 0 on success, -1 if it doesn't fit
+*/
+int pack_string(char * payload, uint32_t * length, char * s) {
+
+    size_t size = strlen(s) + 1;
+    if (size > PROTOCOL_MAX_PAYLOAD - *length) return -1;
+
+    memcpy(payload + *length, s, size);
+    *length += size;
+    return 0;
+
+}
+
+/**
+ * @brief Splits a payload in the strings it packs
+ * @param payload Payload
+ * @param length Bytes of the payload
+ * @param fields Where to place a pointer to each string, inside the payload
+ * @param max_fields Size of fields
+ * @return Number of strings, -1 if there are too many or the last one isn't ended
+*/
+int unpack_strings(char * payload, uint32_t length, char * fields[], int max_fields) {
+
+    if (length && payload[length - 1] != '\0') return -1;
+
+    int n = 0;
+    for (uint32_t i = 0; i < length; i += strlen(payload + i) + 1) {
+        if (n == max_fields) return -1;
+        fields[n++] = payload + i;
+    }
+
+    return n;
+
+}
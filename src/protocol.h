@@ -0,0 +1,140 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAIN_SOCKET "tmp/main_socket"
+#define COORDINATOR_SOCKET "tmp/coordinator_socket" // Where instances that share their work find the coordinator
+#define PROTOCOL_VERSION 6 // Changes whenever the layout of a message does
+#define PROTOCOL_MAX_PAYLOAD 65536 // Bytes of the largest payload a message can carry
+#define PROTOCOL_MAX_FDS 2 // Descriptors a message can carry
+#define PROTOCOL_MAX_OUTPUTS 8 // Outputs a transform can produce from its source
+#define CAPACITY_NAME 64 // Bytes of the name of a filter in a MESSAGE_CAPACITY, with the '\0'
+
+// Filters declared with persistent=yes stay resident: they're started once with a SOCK_SEQPACKET control socket
+// as descriptor WORKER_FD, also named by the environment variable WORKER_FD_ENV. Each job is a MESSAGE_JOB with
+// the input and the output as its 2 descriptors. The filter processes it, closes both and answers with a
+// MESSAGE_STATE whose tag is its exit status, optionally with a USAGE of what the job took, then waits for the
+// next job. It exits when the socket ends. Without the variable, as when worker_pool is 0, it runs once as a
+// plain filter from stdin to stdout
+#define WORKER_FD 3
+#define WORKER_FD_ENV "AURRAS_WORKER_FD"
+
+/**
+ * @brief Kinds of message. Clients send the first ones, the server replies with the others
+*/
+typedef enum message_type {
+
+    MESSAGE_TRANSFORM = 1, // Source, output, priority, window, deadline and filters, each ended by '\0'. The window
+                           // is empty for the whole source, or "start:duration" in seconds to only transform that
+                           // part of it, as a preview, until its end if the duration is 0. The deadline is in
+                           // seconds since the server received it, or 0 for none: a request that didn't end by
+                           // then is dropped, killing its stages if it started. With 2 descriptors,
+                           // they're the source and the output, otherwise these are opened by name.
+                           // An empty string starts another output, followed by its filters: the server
+                           // runs the chains they start with in common once. Those are only sent by name
+    MESSAGE_STATUS, // Asks for the status of the server
+    MESSAGE_DIRECTORY, // Carries the directory that later names of the connection are relative to
+    MESSAGE_CANCEL, // Cancels the request with the tag
+    MESSAGE_STATE, // New state of the request with the tag, with a COMPLETION once it ends
+    MESSAGE_STATUS_REPLY, // Text of the status
+    MESSAGE_ERROR, // The last message was invalid, the server closes the connection
+    MESSAGE_JOB, // Server to a worker: runs a stage between the 2 descriptors
+    MESSAGE_STATS, // Asks for the latency and resources of the jobs that ended, replied with a MESSAGE_STATUS_REPLY
+    MESSAGE_CANCEL_TASK, // Cancels the task numbered by the tag, of any client, replied with a MESSAGE_STATUS_REPLY
+    MESSAGE_REGISTER, // Instance to the coordinator, or to an instance it lends jobs to: the path of its socket
+    MESSAGE_CAPACITY, // Instance to the coordinator: a CAPACITY, then a CAPACITY_FILTER for each of its filters
+    MESSAGE_STEAL // Coordinator to a busy instance: lends as many as the tag of its waiting jobs to the idle
+                  // instance whose socket is the payload. It sends them as a client would, with their descriptors
+
+} MESSAGE_TYPE;
+
+/**
+ * @brief States a request goes through, as told to its client
+*/
+typedef enum request_state {
+
+    STATE_DONE,
+    STATE_PROCESSING,
+    STATE_FAILED,
+    STATE_CANCELLED,
+    STATE_EXPIRED, // Its deadline passed before it ended
+    STATE_REJECTED // The queue of the server was full
+
+} REQUEST_STATE;
+
+/**
+ * @brief Header that starts every message, in the byte order of the machine since both ends share it
+*/
+typedef struct message_header {
+
+    uint8_t version; // PROTOCOL_VERSION
+    uint8_t type; // MESSAGE_TYPE
+    uint8_t n_fds; // Descriptors sent with the message
+    uint8_t state; // REQUEST_STATE of a MESSAGE_STATE
+    uint32_t tag; // Identifier the client gives a request, repeated in its replies
+    uint32_t length; // Bytes of the payload that follows
+
+} MESSAGE_HEADER;
+
+/**
+ * @brief Payload of a MESSAGE_STATE that ends a request
+*/
+typedef struct completion {
+
+    int32_t exit_status; // Of the first stage that failed, 128 plus the signal if one killed it
+    uint32_t reserved;
+    double queued; // Seconds the request waited before it started
+    double running; // Seconds since it started until it ended
+    double cpu; // Seconds of CPU its stages took, where known
+
+} COMPLETION;
+
+/**
+ * @brief What an instance can take, sent to the coordinator whenever it changes
+*/
+typedef struct capacity {
+
+    int32_t waiting; // Jobs waiting, of any kind
+    int32_t lendable; // Those of them another instance could run
+    int32_t running;
+    int32_t n_filters; // CAPACITY_FILTER that follow
+
+} CAPACITY;
+
+/**
+ * @brief Free instances of a filter of an instance, and the lendable jobs that need it
+*/
+typedef struct capacity_filter {
+
+    char name[CAPACITY_NAME];
+    int32_t free; // Instances it could start at once
+    int32_t queued; // Lendable jobs that need it
+
+} CAPACITY_FILTER;
+
+/**
+ * @brief Resources a stage took. A worker may send it as the payload of the answer to a job
+*/
+typedef struct usage {
+
+    double user; // Seconds of CPU in user mode
+    double system; // Seconds of CPU in kernel mode
+    int64_t max_rss; // Kilobytes of the largest resident set
+    int64_t in_blocks; // Blocks of 512 bytes read from and written to storage
+    int64_t out_blocks;
+
+} USAGE;
+
+int send_message(int fd, int type, uint32_t tag, int state, char * payload, uint32_t length, int fds[], int n_fds);
+
+ssize_t receive_bytes(int fd, char * buffer, size_t size, int fds[], int * n_fds, int max_fds, int flags);
+
+ssize_t parse_message(char * buffer, size_t used, MESSAGE_HEADER * header, char ** payload);
+
+int pack_string(char * payload, uint32_t * length, char * s);
+
+int unpack_strings(char * payload, uint32_t length, char * fields[], int max_fields);
+
+#endif
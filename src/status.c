@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "status.h"
+
+#define READ_ATTEMPTS 1000 // Copies a reader tries before it gives up on a server that stopped in a write
+
+/**
+ * @brief Creates the segment of a server. It's written in a new file that then replaces the one at the path,
+ * so readers never see it before it's set up, and readers of an older server keep their own
+ * @param path Path of the segment
+ * @return Segment, NULL on error
+*/
+STATUS * status_create(char * path) {
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return NULL;
+
+    STATUS * s = MAP_FAILED;
+    if (ftruncate(fd, sizeof(STATUS)) == 0) s = mmap(NULL, sizeof(STATUS), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s != MAP_FAILED) {
+        s->version = STATUS_VERSION;
+        s->pid = getpid();
+    }
+
+    if (s == MAP_FAILED || rename(tmp_path, path) < 0) {
+        int error = errno;
+        if (s != MAP_FAILED) munmap(s, sizeof(STATUS));
+        unlink(tmp_path);
+        errno = error;
+        return NULL;
+    }
+
+    return s;
+
+}
+
+/**
+ * @brief Starts a change of the segment, readers retry until it ends
+ * @param s Segment
+*/
+void status_begin(STATUS * s) {
+
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+}
+
+/**
+ * @brief Ends a change of the segment
+ * @param s Segment
+*/
+void status_end(STATUS * s) {
+
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+
+}
+
+/**
+ * @brief Maps the segment of a server to read it
+ * @param path Path of the segment
+ * @return Segment, NULL on error
+*/
+STATUS * status_map(char * path) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    STATUS * s = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(STATUS))
+        s = mmap(NULL, sizeof(STATUS), PROT_READ, MAP_SHARED, fd, 0);
+    else errno = EPROTO;
+    close(fd);
+    if (s == MAP_FAILED) return NULL;
+
+    if (s->version != STATUS_VERSION) {
+        munmap(s, sizeof(STATUS));
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return s;
+
+}
+
+/**
+ * @brief Copies a consistent state of the segment, without waiting for the server
+ * @param s Segment
+ * @param copy Where to copy it
+ * @return 0 on success, -1 if the server was always in the middle of a change
+*/
+int status_read(STATUS * s, STATUS * copy) {
+
+    for (int i = 0; i < READ_ATTEMPTS; i++) {
+
+        uint32_t before = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(copy, s, sizeof(STATUS));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) == before) return 0;
+
+    }
+
+    errno = EAGAIN;
+    return -1;
+
+}
+
+/**
+ * @brief Unmaps a segment
+ * @param s Segment
+*/
+void status_unmap(STATUS * s) {
+
+    munmap(s, sizeof(STATUS));
+
+}
+
+/**
+ * @brief Appends formatted text to a buffer, cutting what doesn't fit
+ * @param buffer Buffer
+ * @param size Size of the buffer
+ * @param length Pointer to the length of the text in the buffer, updated
+ * @param format Format, as in printf
+*/
+static void append(char * buffer, int size, int * length, const char * format, ...) {
+
+    if (*length >= size - 1) return;
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer + *length, size - *length, format, args);
+    va_end(args);
+
+    if (n > 0) *length = *length + n < size - 1 ? *length + n : size - 1;
+
+}
+
+/**
+ * @brief Writes the status of a server as text: its running tasks, the usage of each filter and its caches
+ * @param s Copy of the segment
+ * @param buffer Where to write the text, ended by '\0'
+ * @param size Size of the buffer
+ * @return Length of the text
+*/
+int status_format(STATUS * s, char * buffer, int size) {
+
+    int length = 0, listed = 0;
+    buffer[0] = '\0';
+
+    for (int i = 0; i < s->n_tasks; i++) {
+        if (s->tasks[i].state != TASK_RUNNING) continue;
+        append(buffer, size, &length, "Task #%d: %s", s->tasks[i].task, s->tasks[i].line);
+        if (s->tasks[i].domain >= 0) append(buffer, size, &length, " (cores %s, domain %d)", s->tasks[i].cpus, s->tasks[i].domain);
+        append(buffer, size, &length, "\n");
+        listed++;
+    }
+    if (listed < s->n_running) append(buffer, size, &length, "(%d more running tasks)\n", s->n_running - listed);
+    if (s->n_waiting) append(buffer, size, &length, "Waiting tasks: %d\n", s->n_waiting);
+    if (s->budget > 0) append(buffer, size, &length, "CPU budget: %.2f/%.2f cores\n", s->budget_used, s->budget);
+
+    for (int i = 0; i < s->n_filters; i++) {
+        STATUS_FILTER * f = &s->filters[i];
+        append(buffer, size, &length, "Filter %s : %d/%d (running/max)", f->name, f->running, f->max);
+        if (f->limit < f->max) append(buffer, size, &length, " (limited to %d)", f->limit);
+        if (f->warm >= 0) append(buffer, size, &length, " (%d warm workers)", f->warm);
+        if (f->queued) append(buffer, size, &length, " (%d waiting)", f->queued);
+        append(buffer, size, &length, "\n");
+    }
+
+    append(buffer, size, &length, "%s", s->text);
+    if (s->replayed)
+        append(buffer, size, &length, "Journal: %d jobs replayed in %.1f ms, %d segments resumed, %d segments or jobs run again\n",
+               s->replayed, 1e3 * s->replay_seconds, s->resumed, s->redone);
+    append(buffer, size, &length, "Memory: %d requests, %d pooled, %.1f MiB allocated\n",
+           s->n_requests, s->n_pooled, s->heap / (1 << 20));
+    append(buffer, size, &length, "Pid: %d\n", s->pid);
+
+    return length;
+
+}
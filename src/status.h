@@ -0,0 +1,100 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stdint.h>
+
+#define STATUS_SUFFIX ".status" // The segment is a file next to the socket, named by it and this suffix
+#define STATUS_VERSION 5 // Changes whenever the layout of the segment does
+#define STATUS_MAX_TASKS 256 // Tasks listed in the segment, the rest are only counted
+#define STATUS_MAX_FILTERS 64
+#define STATUS_NAME 64 // Bytes of the name of a filter, with the '\0'
+#define STATUS_LINE 512 // Bytes of the description of a task, with the '\0'
+#define STATUS_TEXT 1024 // Bytes of the lines about the caches, with the '\0'
+#define STATUS_CPUS 64 // Bytes of the list of cores of a task, with the '\0'
+
+/**
+ * @brief States of a task in the segment
+*/
+typedef enum task_state {
+
+    TASK_RUNNING,
+    TASK_WAITING
+
+} TASK_STATE;
+
+/**
+ * @brief Task of the server, a request or a segment of one
+*/
+typedef struct status_task {
+
+    int32_t task;
+    int32_t state; // TASK_STATE
+    int32_t priority;
+    int32_t domain; // Cache domain of the cores its stages are pinned to, -1 if they aren't
+    double arrival; // CLOCK_MONOTONIC seconds when the task arrived
+    double started; // CLOCK_MONOTONIC seconds when it started, 0 while it waits
+    char line[STATUS_LINE]; // What the task does, like "transform a.m4a b.mp3 alto eco"
+    char cpus[STATUS_CPUS]; // Cores its stages are pinned to, like "0-3", empty if they aren't
+
+} STATUS_TASK;
+
+/**
+ * @brief Usage of a filter
+*/
+typedef struct status_filter {
+
+    char name[STATUS_NAME];
+    int32_t running; // Instances in use
+    int32_t limit; // Instances it's allowed at the moment, adjusted by the server up to the maximum
+    int32_t max;
+    int32_t queued; // Waiting tasks that need the filter
+    int32_t warm; // Resident workers, -1 if the filter has no pool
+
+} STATUS_FILTER;
+
+/**
+ * @brief Segment where the server publishes its status. The server is its only writer, and changes it
+ * between two increments of the sequence: readers copy it while the sequence is even and didn't change,
+ * so they never make the server wait
+*/
+typedef struct status {
+
+    uint32_t version; // STATUS_VERSION
+    uint32_t sequence; // Odd while the server writes
+    int32_t pid; // Of the server
+    int32_t n_running; // Tasks running, listed or not
+    int32_t n_waiting;
+    int32_t n_tasks; // Tasks listed, the running ones first
+    int32_t n_filters;
+    int32_t reserved;
+    double updated; // CLOCK_MONOTONIC seconds of the last change
+    double budget; // Cores the filters may take together, 0 without a budget
+    double budget_used; // Cores they take at the moment
+    double replay_seconds; // Time the server took to rebuild its queue from the journal when it started
+    int32_t replayed; // Jobs it rebuilt
+    int32_t resumed; // Segments of those jobs that ended before it started, and didn't run again
+    int32_t redone; // Segments of those jobs that ran again, and those jobs that weren't split, which ran whole
+    int32_t n_requests; // Requests and segments the server holds, whatever their state
+    int32_t n_pooled; // Requests that ended, kept to reuse their memory
+    double heap; // Bytes the server allocated, with its requests and their arenas
+    char text[STATUS_TEXT];
+    STATUS_FILTER filters[STATUS_MAX_FILTERS];
+    STATUS_TASK tasks[STATUS_MAX_TASKS];
+
+} STATUS;
+
+STATUS * status_create(char * path);
+
+void status_begin(STATUS * s);
+
+void status_end(STATUS * s);
+
+STATUS * status_map(char * path);
+
+int status_read(STATUS * s, STATUS * copy);
+
+void status_unmap(STATUS * s);
+
+int status_format(STATUS * s, char * buffer, int size);
+
+#endif
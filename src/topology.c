@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "topology.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu%d"
+#define MAX_CACHES 10 // Cache indexes looked at for the last level
+#define NUMA_KEY CPU_SETSIZE // Added to a NUMA node to tell its key from the first core of a cache
+
+/**
+ * @brief Cores the server may use, grouped in domains whose cores share their last level cache, or their
+ * NUMA node when the cache isn't known
+*/
+struct topology {
+
+    int n_cpus;
+    int cpu[CPU_SETSIZE]; // Number of each core
+    int domain[CPU_SETSIZE]; // Domain of each core, by its position in cpu
+    int n_domains;
+    double load[CPU_SETSIZE]; // Stages placed on each core, by its number
+
+};
+
+/**
+ * @brief Reads the first number of a file, like the first core of a list of them
+ * @param path Path to the file
+ * @return The number, -1 if it can't be read
+*/
+static int read_first(char * path) {
+
+    FILE * f = fopen(path, "re");
+    if (!f) return -1;
+
+    int n = -1;
+    if (fscanf(f, "%d", &n) != 1) n = -1;
+    fclose(f);
+
+    return n;
+
+}
+
+/**
+ * @brief Finds what identifies the domain of a core: the first core that shares its L3 cache, or else its NUMA node
+ * @param cpu Number of the core
+ * @return Key of the domain, 0 if neither is known
+*/
+static int domain_key(int cpu) {
+
+    char path[128];
+    for (int i = 0; i < MAX_CACHES; i++) {
+        snprintf(path, sizeof(path), SYSFS_CPU "/cache/index%d/level", cpu, i);
+        int level = read_first(path);
+        if (level < 0) break;
+        if (level != 3) continue;
+        snprintf(path, sizeof(path), SYSFS_CPU "/cache/index%d/shared_cpu_list", cpu, i);
+        int first = read_first(path);
+        if (first >= 0) return first;
+    }
+
+    // The core's directory has a link to its node, named node and the number of the node
+    snprintf(path, sizeof(path), SYSFS_CPU, cpu);
+    DIR * dir = opendir(path);
+    int key = 0;
+    struct dirent * entry;
+    while (dir && (entry = readdir(dir)))
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            key = NUMA_KEY + atoi(entry->d_name + 4);
+            break;
+        }
+    if (dir) closedir(dir);
+
+    return key;
+
+}
+
+/**
+ * @brief Reads the cores the server may use and their domains
+ * @return Topology, NULL on error
+*/
+TOPOLOGY topology_open(void) {
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return NULL;
+
+    TOPOLOGY t = calloc(1, sizeof(struct topology));
+    int keys[CPU_SETSIZE];
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+
+        // Domains are numbered in the order their first core appears
+        int key = domain_key(cpu), d;
+        for (d = 0; d < t->n_domains && keys[d] != key; d++);
+        if (d == t->n_domains) keys[t->n_domains++] = key;
+
+        t->cpu[t->n_cpus] = cpu;
+        t->domain[t->n_cpus++] = d;
+
+    }
+
+    return t;
+
+}
+
+/**
+ * @brief Chooses nearby cores for a pipeline: the least loaded of the least loaded domain. Their load isn't changed
+ * @param t Topology
+ * @param width Cores wanted, fewer if the domain doesn't have them
+ * @param cpus Where the cores are set
+ * @return Domain of the cores, -1 if there's none
+*/
+int topology_place(TOPOLOGY t, int width, cpu_set_t * cpus) {
+
+    CPU_ZERO(cpus);
+
+    // Load per core of each domain
+    double load[t->n_domains > 0 ? t->n_domains : 1];
+    int size[t->n_domains > 0 ? t->n_domains : 1];
+    memset(load, 0, sizeof(load));
+    memset(size, 0, sizeof(size));
+    for (int i = 0; i < t->n_cpus; i++) {
+        load[t->domain[i]] += t->load[t->cpu[i]];
+        size[t->domain[i]]++;
+    }
+
+    int domain = -1;
+    for (int d = 0; d < t->n_domains; d++)
+        if (domain < 0 || load[d] / size[d] < load[domain] / size[domain]) domain = d;
+    if (domain < 0) return -1;
+
+    // The least loaded cores first, the lowest numbers on ties, so a pipeline takes neighbours
+    if (width < 1) width = 1;
+    if (width > size[domain]) width = size[domain];
+    for (int n = 0; n < width; n++) {
+
+        int best = -1;
+        for (int i = 0; i < t->n_cpus; i++)
+            if (t->domain[i] == domain && !CPU_ISSET(t->cpu[i], cpus) && (best < 0 || t->load[t->cpu[i]] < t->load[best]))
+                best = t->cpu[i];
+        CPU_SET(best, cpus);
+
+    }
+
+    return domain;
+
+}
+
+/**
+ * @brief Adds a load to some cores, spread evenly between them
+ * @param t Topology
+ * @param cpus Cores
+ * @param load Stages placed on the cores, negative once they end
+*/
+void topology_load(TOPOLOGY t, cpu_set_t * cpus, double load) {
+
+    int n = CPU_COUNT(cpus);
+    for (int cpu = 0; n && cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, cpus)) {
+            t->load[cpu] += load / n;
+            if (t->load[cpu] < 1e-9) t->load[cpu] = 0;
+        }
+
+}
+
+/**
+ * @brief Writes a set of cores as a list of ranges, like "0-3,8"
+ * @param cpus Cores
+ * @param buffer Where to write the list, ended by '\0'
+ * @param size Size of the buffer
+ * @return Length of the list
+*/
+int topology_format(cpu_set_t * cpus, char * buffer, int size) {
+
+    int length = 0;
+    buffer[0] = '\0';
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && length < size - 1; cpu++) {
+
+        if (!CPU_ISSET(cpu, cpus)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) last++;
+
+        int n = last > cpu ? snprintf(buffer + length, size - length, "%s%d-%d", length ? "," : "", cpu, last)
+                           : snprintf(buffer + length, size - length, "%s%d", length ? "," : "", cpu);
+        length = length + n < size ? length + n : size - 1;
+        cpu = last;
+
+    }
+
+    return length;
+
+}
+
+/**
+ * @brief Frees a topology
+ * @param t Topology
+*/
+void topology_close(TOPOLOGY t) {
+
+    free(t);
+
+}
@@ -0,0 +1,18 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <sched.h> // cpu_set_t, which needs _GNU_SOURCE before the first include
+
+typedef struct topology * TOPOLOGY;
+
+TOPOLOGY topology_open(void);
+
+int topology_place(TOPOLOGY t, int width, cpu_set_t * cpus);
+
+void topology_load(TOPOLOGY t, cpu_set_t * cpus, double load);
+
+int topology_format(cpu_set_t * cpus, char * buffer, int size);
+
+void topology_close(TOPOLOGY t);
+
+#endif
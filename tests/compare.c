@@ -0,0 +1,148 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LAG 4096 // Frames one signal may be shifted from the other, by the delays of the encoders
+#define LAG_EXCERPT 44100 // Frames the shift is searched on, from the middle of the signals
+#define ENVELOPE_WINDOW 1024 // Frames of each RMS value of the envelopes
+
+/**
+ * @brief Reads a file of mono float PCM
+ * @param path Path to the file
+ * @param n Where to write the number of frames
+ * @return The frames, NULL on error
+*/
+float * read_pcm(char * path, long * n) {
+
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    long size = 0, capacity = 1 << 20;
+    float * pcm = malloc(capacity * sizeof(float));
+    size_t read;
+    while ((read = fread(pcm + size, sizeof(float), capacity - size, f)) > 0) {
+        size += read;
+        if (size == capacity) pcm = realloc(pcm, (capacity *= 2) * sizeof(float));
+    }
+    fclose(f);
+
+    *n = size;
+    return pcm;
+
+}
+
+/**
+ * @brief Finds the shift of a signal that best matches a reference, on an excerpt of both
+ * @return Frames a is ahead of b
+*/
+long find_lag(float * a, long n_a, float * b, long n_b) {
+
+    long n = n_a < n_b ? n_a : n_b;
+    long start = n / 2 - LAG_EXCERPT / 2, best_lag = 0;
+    if (start < MAX_LAG) start = MAX_LAG;
+    double best = -INFINITY;
+
+    for (long lag = -MAX_LAG; lag <= MAX_LAG; lag++) {
+        // Normalized by the energy of the shifted excerpt, so a louder part doesn't win over the right shift
+        double sum = 0, energy = 0;
+        for (long i = start; i < start + LAG_EXCERPT && i < n_b && i + lag < n_a; i++) {
+            sum += (double) a[i + lag] * b[i];
+            energy += (double) a[i + lag] * a[i + lag];
+        }
+        if (energy > 0 && sum / sqrt(energy) > best) {
+            best = sum / sqrt(energy);
+            best_lag = lag;
+        }
+    }
+
+    return best_lag;
+
+}
+
+/**
+ * @brief Gets the signal to noise ratio of a signal against a reference, once aligned
+ * @return Decibels
+*/
+double snr(float * a, long n_a, float * b, long n_b, long lag) {
+
+    double signal = 0, noise = 0;
+    for (long i = lag < 0 ? -lag : 0; i < n_b && i + lag < n_a; i++) {
+        double d = a[i + lag] - b[i];
+        signal += (double) b[i] * b[i];
+        noise += d * d;
+    }
+
+    return noise > 0 ? 10 * log10(signal / noise) : INFINITY;
+
+}
+
+/**
+ * @brief Gets the correlation of the RMS envelopes of two signals, which doesn't depend on their phase
+ * @return Pearson correlation, from -1 to 1
+*/
+double envelope(float * a, long n_a, float * b, long n_b) {
+
+    long n = (n_a < n_b ? n_a : n_b) / ENVELOPE_WINDOW;
+    double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+
+    for (long w = 0; w < n; w++) {
+        double ea = 0, eb = 0;
+        for (long i = w * ENVELOPE_WINDOW; i < (w + 1) * ENVELOPE_WINDOW; i++) {
+            ea += (double) a[i] * a[i];
+            eb += (double) b[i] * b[i];
+        }
+        ea = sqrt(ea / ENVELOPE_WINDOW);
+        eb = sqrt(eb / ENVELOPE_WINDOW);
+        sa += ea;
+        sb += eb;
+        saa += ea * ea;
+        sbb += eb * eb;
+        sab += ea * eb;
+    }
+
+    double variance = (n * saa - sa * sa) * (n * sbb - sb * sb);
+    return variance > 0 ? (n * sab - sa * sb) / sqrt(variance) : 0;
+
+}
+
+/**
+ * @brief Compares a decoded output with a reference, both mono float PCM, within tolerances
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @return 0 if the output is within every tolerance, 1 otherwise, 2 on error
+*/
+int main(int argc, char * argv[]) {
+
+    if (argc < 3) {
+        fprintf(stderr, "%s output.f32 reference.f32 [--min-snr dB] [--min-envelope correlation] [--max-length fraction]\n", argv[0]);
+        return 2;
+    }
+
+    // A tolerance of NAN isn't checked
+    double min_snr = NAN, min_envelope = NAN, max_length = 0.01;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--min-snr")) min_snr = atof(argv[i + 1]);
+        else if (!strcmp(argv[i], "--min-envelope")) min_envelope = atof(argv[i + 1]);
+        else if (!strcmp(argv[i], "--max-length")) max_length = atof(argv[i + 1]);
+    }
+
+    long n_a, n_b;
+    float * a = read_pcm(argv[1], &n_a), * b = read_pcm(argv[2], &n_b);
+    if (!a || !b || !n_b) return 2;
+
+    long lag = find_lag(a, n_a, b, n_b);
+    double db = snr(a, n_a, b, n_b, lag), correlation = envelope(a, n_a, b, n_b);
+    double length = (double) (n_a - n_b) / n_b;
+    printf("snr %.1f dB (lag %ld), envelope %.3f, length %+.2f%%\n", db, lag, correlation, 100 * length);
+
+    int valid = fabs(length) <= max_length && !(db < min_snr) && !(correlation < min_envelope);
+    free(a);
+    free(b);
+
+    return valid ? 0 : 1;
+
+}
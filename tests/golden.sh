@@ -0,0 +1,75 @@
+#!/bin/sh
+# Runs the filters of etc/aurrasd.conf, alone and as a chain, in the built-in engine and in their executables
+# from bin/aurrasd-filters, and compares the decoded outputs within a tolerance. Needs ffmpeg
+cd "$(dirname "$0")/.." || exit 1
+
+SOURCE=${GOLDEN_SOURCE:-samples/sample-1-so.m4a}
+MIN_SNR=15 # Decibels an output of a gain or an echo keeps over its difference with the executable
+MIN_ENVELOPE=0.9 # Correlation of the loudness over time, for tempo changes, whose waveforms don't align
+MAX_LENGTH=0.02 # Relative difference of duration
+
+if ! command -v ffmpeg > /dev/null 2>&1; then
+    echo "golden: skipped, ffmpeg isn't installed"
+    exit 0
+fi
+
+work=$(mktemp -d)
+servers=
+cleanup() {
+    for pid in $servers; do kill "$pid" 2>/dev/null; done
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+fail() {
+    echo "golden: FAILED, $1"
+    cat "$work"/*.log
+    exit 1
+}
+
+# One server per engine, with the filters of the shipped config
+start_server() {
+    awk -v engine="$1" '$1 !~ /=/ && NF >= 3 { sub(/ engine=[a-z]*/, ""); $0 = $0 " engine=" engine } { print }' \
+        etc/aurrasd.conf > "$work/$1.conf"
+    echo "socket=$work/$1.socket" >> "$work/$1.conf"
+    bin/aurrasd "$work/$1.conf" bin/aurrasd-filters > "$work/$1.log" 2>&1 &
+    servers="$servers $!"
+    for i in $(seq 50); do
+        AURRAS_SOCKET=$work/$1.socket bin/aurras status > /dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    fail "the $1 server didn't start"
+}
+start_server builtin
+start_server external
+
+# The output of each engine is decoded to mono PCM, where they're compared
+run() {
+    name=$(echo "$*" | tr ' ' '-')
+    for engine in builtin external; do
+        AURRAS_SOCKET=$work/$engine.socket bin/aurras transform "$SOURCE" "$work/$engine-$name.mp3" "$@" > /dev/null ||
+            fail "$engine engine: $*"
+        ffmpeg -hide_banner -loglevel error -y -i "$work/$engine-$name.mp3" -f f32le -ac 1 -ar 44100 "$work/$engine-$name.pcm" ||
+            fail "decoding the $engine output of $*"
+    done
+}
+
+failed=0
+check() {
+    tolerance=$1
+    shift
+    run "$@"
+    name=$(echo "$*" | tr ' ' '-')
+    printf "golden: %-20s " "$*"
+    bin/aurras-compare "$work/builtin-$name.pcm" "$work/external-$name.pcm" $tolerance --max-length $MAX_LENGTH || failed=1
+}
+
+check "--min-snr $MIN_SNR" alto
+check "--min-snr $MIN_SNR" baixo
+check "--min-snr $MIN_SNR" eco
+check "--min-envelope $MIN_ENVELOPE" rapido
+check "--min-envelope $MIN_ENVELOPE" lento
+check "--min-envelope $MIN_ENVELOPE" alto eco rapido
+
+[ $failed -eq 0 ] || fail "outputs of the built-in engine are off from the executables"
+echo "golden: ok"
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Queues more jobs than their filter runs at once, kills the server and starts it again from its journal.
+# Every job has to end with the right output, and the server has to stay up
+cd "$(dirname "$0")/.." || exit 1
+
+JOBS=4
+TIMEOUT=30 # Seconds the restarted server has to end the jobs
+
+work=$(mktemp -d)
+socket=$work/socket
+server=
+client=
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    [ -n "$client" ] && kill "$client" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+fail() {
+    echo "recovery: FAILED, $1"
+    cat "$work/log"
+    exit 1
+}
+
+# A filter that takes a while, so the jobs past the first one wait
+mkdir "$work/filters"
+printf '#!/bin/sh\nsleep 2\nexec cat\n' > "$work/filters/aurrasd-sleep"
+chmod +x "$work/filters/aurrasd-sleep"
+printf 'decoder=cat\nencoder=cat\nwindow_decoder=\nadapt_interval=0\nsocket=%s\nslow aurrasd-sleep 1\n' "$socket" > "$work/aurrasd.conf"
+head -c 65536 /dev/urandom > "$work/source.raw"
+for i in $(seq $JOBS); do echo "$work/source.raw $work/output-$i.raw slow"; done > "$work/manifest"
+
+start_server() {
+    bin/aurrasd "$work/aurrasd.conf" "$work/filters" >> "$work/log" 2>&1 &
+    server=$!
+    for i in $(seq 50); do
+        [ -S "$socket" ] && AURRAS_SOCKET=$socket bin/aurras status > /dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    fail "the server didn't start"
+}
+
+start_server
+AURRAS_SOCKET=$socket bin/aurras batch "$work/manifest" > /dev/null 2>&1 &
+client=$!
+sleep 1
+kill -9 "$server"
+wait "$server" 2>/dev/null
+rm -f "$socket"
+start_server
+
+elapsed=0
+while [ $elapsed -lt $((TIMEOUT * 10)) ]; do
+    kill -0 "$server" 2>/dev/null || fail "the server died after the replay"
+    done=0
+    for i in $(seq $JOBS); do cmp -s "$work/source.raw" "$work/output-$i.raw" && done=$((done + 1)); done
+    [ $done -eq $JOBS ] && break
+    sleep 0.1
+    elapsed=$((elapsed + 1))
+done
+[ $done -eq $JOBS ] || fail "$done of $JOBS jobs ended after the restart"
+grep -q "Journal: .* jobs replayed" "$work/log" || fail "no jobs were replayed"
+kill -0 "$server" 2>/dev/null || fail "the server died after the jobs ended"
+
+echo "recovery: ok, $JOBS jobs ended after a crash"
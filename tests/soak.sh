@@ -0,0 +1,49 @@
+#!/bin/sh
+# Submits many jobs to a server and fails if its memory grows with them. A first run fills the pool of
+# requests, which the server keeps, so the measured one starts from its steady state
+cd "$(dirname "$0")/.." || exit 1
+
+JOBS=${SOAK_JOBS:-10000}
+WARMUP=1000
+MAX_GROWTH=${SOAK_MAX_GROWTH:-256} # Kilobytes of resident and of allocated memory
+
+work=$(mktemp -d)
+socket=$work/socket
+server=
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+fail() {
+    echo "soak: FAILED, $1"
+    cat "$work/log"
+    exit 1
+}
+
+# Jobs are short and never cached, so the run measures the server and not the filters
+mkdir "$work/filters" "$work/samples"
+printf '#!/bin/sh\nexec cat\n' > "$work/filters/aurrasd-cat"
+chmod +x "$work/filters/aurrasd-cat"
+printf 'decoder=cat\nencoder=cat\nwindow_decoder=\nadapt_interval=0\njournal=\nmetrics_file=\nsocket=%s\ncopy aurrasd-cat 4\n' \
+    "$socket" > "$work/aurrasd.conf"
+head -c 65536 /dev/urandom > "$work/samples/source.raw"
+
+bin/aurrasd "$work/aurrasd.conf" "$work/filters" > "$work/log" 2>&1 &
+server=$!
+for i in $(seq 50); do
+    AURRAS_SOCKET=$socket bin/aurras status > /dev/null 2>&1 && break
+    sleep 0.1
+done
+
+bench() {
+    bin/aurras-bench --socket "$socket" --clients 4 --depth 4 --mix copy --samples "$work/samples" --output "$work/bench" "$@" \
+        > /dev/null
+}
+bench --jobs $WARMUP || fail "the warm-up run failed"
+bench --jobs "$JOBS" --max-growth "$MAX_GROWTH" || fail "the memory of the server grew over $JOBS jobs"
+grep -q "^failed 0$" "$work/bench" || fail "jobs failed"
+
+grep "^server_" "$work/bench" | sed 's/^/soak: /'
+echo "soak: ok, $JOBS jobs"